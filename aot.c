@@ -0,0 +1,564 @@
+/*
+ * aot.c - bytecode-to-C compiler with dlopen loading
+ *
+ * aot_compile() loads the program into a scratch VM to reuse the decoder
+ * and verifier, then writes one C function for it: every memory slot the
+ * program touches and every operand stack entry becomes a local, every
+ * jump target becomes a label named after its bytecode offset. Arrays
+ * stay in vm->memory and are indexed there, so a program whose scalar
+ * slots overlap an array is not compiled. Because
+ * the verifier proved the stack depth at each instruction, `s3` is always
+ * the same stack entry wherever it appears. The function is built with
+ * gcc into "<source>.<hash>.so" next to the source file and loaded with
+ * dlopen(); the hash covers the bytecode and the generator version, so a
+ * changed program never picks up a stale object. The object also carries
+ * the bytecode it was built from, and is used only if that matches the
+ * submitted program byte for byte: two programs whose hashes collide
+ * never run each other's code.
+ *
+ * The generated code reports the same pc, sp, VMError and instruction
+ * count the interpreter would, and writes the locals back into
+ * vm->memory and vm->stack, so memstat and vm_dump_state() read the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
+#include "aot.h"
+#include "instructions.h"
+
+/* Bump when the generated code changes shape; part of the cache hash */
+#define AOT_FORMAT "lab6-aot-6"
+
+#define AOT_ENTRY_SYMBOL "lab_program"
+#define AOT_HASH_SYMBOL  "lab_program_hash"
+#define AOT_SIZE_SYMBOL  "lab_program_size"
+#define AOT_CODE_SYMBOL  "lab_program_code"
+
+/* Must match the struct written into the generated source */
+typedef struct {
+    int32_t pc;
+    int32_t sp;
+    int32_t error;
+    int32_t unused;
+    uint64_t count;
+} AotExit;
+
+/* Prints go through vm_print_int() so they share the VM's output
+   buffer; read() and eof() go through vm_read_int() and vm_input_eof() */
+typedef void (*AotPrint)(void *vm, int32_t value);
+typedef int32_t (*AotInput)(void *vm);
+typedef void (*AotEntry)(int32_t *memory, int32_t *stack, AotExit *out,
+                         AotPrint print, AotInput read, AotInput eof, void *vm);
+
+struct AotProgram {
+    void *handle;
+    AotEntry entry;
+    char *path;
+};
+
+/* FNV-1a over the format tag and the bytecode */
+static uint32_t program_hash(const BytecodeProgram *prog) {
+    uint32_t h = 2166136261u;
+    for (const char *p = AOT_FORMAT; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    for (int i = 0; i < prog->code_size; i++) {
+        h = (h ^ prog->code[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* "<source>.<hash>.so" (or ".c"); "./" keeps dlopen() off the search path */
+static char *cache_path(const char *source_path, uint32_t hash, const char *ext) {
+    const char *prefix = strchr(source_path, '/') ? "" : "./";
+    size_t len = strlen(prefix) + strlen(source_path) + 16 + strlen(ext);
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s%s.%08x%s", prefix, source_path, hash, ext);
+    return path;
+}
+
+/* The object at so_path, if it was built from exactly prog's bytecode */
+static AotProgram *load_object(const char *so_path, const BytecodeProgram *prog,
+                               uint32_t hash) {
+    void *handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) return NULL;
+
+    AotEntry entry = (AotEntry)dlsym(handle, AOT_ENTRY_SYMBOL);
+    const uint32_t *stored = (const uint32_t *)dlsym(handle, AOT_HASH_SYMBOL);
+    const int32_t *size = (const int32_t *)dlsym(handle, AOT_SIZE_SYMBOL);
+    const uint8_t *code = (const uint8_t *)dlsym(handle, AOT_CODE_SYMBOL);
+    if (!entry || !stored || *stored != hash || !size || *size != prog->code_size ||
+        !code || memcmp(code, prog->code, prog->code_size) != 0) {
+        dlclose(handle);
+        return NULL;
+    }
+
+    AotProgram *aot = malloc(sizeof(AotProgram));
+    if (!aot) { dlclose(handle); return NULL; }
+    aot->handle = handle;
+    aot->entry = entry;
+    aot->path = strdup(so_path);
+    return aot;
+}
+
+AotProgram *aot_load_cached(const char *source_path, BytecodeProgram *prog) {
+    uint32_t hash = program_hash(prog);
+    char *so_path = cache_path(source_path, hash, ".so");
+    if (!so_path) return NULL;
+
+    AotProgram *aot = NULL;
+    struct stat st;
+    if (stat(so_path, &st) == 0) aot = load_object(so_path, prog, hash);
+    free(so_path);
+    return aot;
+}
+
+/* C comparison operator for a compare or compare-and-branch opcode */
+static const char *compare_op(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CMP:    case OP_JZ_LT: case OP_R_LT: case OP_R_JZ_LT: return "<";
+        case OP_CMP_EQ: case OP_JZ_EQ: case OP_R_EQ: case OP_R_JZ_EQ: return "==";
+        case OP_CMP_NE: case OP_JZ_NE: case OP_R_NE: case OP_R_JZ_NE: return "!=";
+        case OP_CMP_GT: case OP_JZ_GT: case OP_R_GT: case OP_R_JZ_GT: return ">";
+        case OP_CMP_LE: case OP_JZ_LE: case OP_R_LE: case OP_R_JZ_LE: return "<=";
+        default:                                                      return ">=";
+    }
+}
+
+static const char *arith_op(uint8_t opcode) {
+    switch (opcode) {
+        case OP_ADD: case OP_LOAD2_ADD: case OP_R_ADD: return "+";
+        case OP_SUB: case OP_LOAD2_SUB: case OP_R_SUB: return "-";
+        case OP_MUL: case OP_LOAD2_MUL: case OP_R_MUL: return "*";
+        case OP_AND: case OP_R_AND:                    return "&";
+        case OP_OR:  case OP_R_OR:                     return "|";
+        case OP_XOR: case OP_R_XOR:                    return "^";
+        default:                                       return "/";
+    }
+}
+
+/* C for x / 2^k or x % 2^k with OP_DIV_POW2's rounding; x is a local */
+static void emit_pow2(FILE *f, const char *dst, const char *x, bool mod, int32_t k) {
+    int32_t m = (int32_t)((1u << (k & 31)) - 1);
+    if (mod) {
+        fprintf(f, "{ int32_t t = (%s >> 31) & %d; %s = ((%s + t) & %d) - t; }\n",
+                x, m, dst, x, m);
+    } else {
+        fprintf(f, "%s = (%s + ((%s >> 31) & %d)) >> %d;\n", dst, x, x, m, k & 31);
+    }
+}
+
+/* Slot operands of an instruction, for declaring the m<N> locals */
+static void mark_slots(const VMInstr *ins, bool *used) {
+    switch (ins->opcode) {
+        case OP_STORE: case OP_LOAD: case OP_INC_SLOT: case OP_PUSH_STORE:
+        case OP_R_MOVI: case OP_R_PRINT: case OP_R_READ: case OP_R_EOF:
+            used[ins->operand] = true;
+            break;
+        case OP_LOAD2_ADD: case OP_LOAD2_SUB: case OP_LOAD2_MUL:
+        case OP_R_MOV: case OP_R_DIV_POW2: case OP_R_MOD_POW2:
+            used[ins->operand] = used[ins->operand2] = true;
+            break;
+        case OP_R_JZ: case OP_LOOP_INC: case OP_LOOP_DEC:
+            used[ins->operand2] = true;
+            break;
+        case OP_R_ADD: case OP_R_SUB: case OP_R_MUL: case OP_R_DIV:
+        case OP_R_MOD: case OP_R_AND: case OP_R_OR: case OP_R_XOR:
+        case OP_R_SHL: case OP_R_SHR:
+        case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+        case OP_R_GT: case OP_R_LE: case OP_R_GE:
+            used[ins->operand] = used[ins->operand2] = used[ins->operand3] = true;
+            break;
+        case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+        case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+        case OP_LOOP_INC_M: case OP_LOOP_DEC_M:
+            used[ins->operand2] = used[ins->operand3] = true;
+            break;
+        default:
+            break;
+    }
+}
+
+/* Array operands of an instruction: up to two (base, length) ranges */
+static int array_ranges(const VMInstr *ins, int32_t base[2], int32_t *len) {
+    switch (ins->opcode) {
+        case OP_LOAD_IDX: case OP_STORE_IDX: case OP_LOAD_ELEM: case OP_STORE_ELEM:
+        case OP_FILL: case OP_SUM:
+            base[0] = ins->operand;
+            *len = ins->operand2;
+            return 1;
+        case OP_COPY: case OP_DOT: case OP_VADD: case OP_VMUL:
+            base[0] = ins->operand;
+            base[1] = ins->operand2;
+            *len = ins->operand3;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/* No m<N> local stands for a slot that an array opcode reaches through
+   memory[] */
+static bool arrays_apart(const VM *vm, const bool *used) {
+    for (int i = 0; i < vm->insn_count; i++) {
+        int32_t base[2], len;
+        int k = vm->insn_depth[i] < 0 ? 0 : array_ranges(&vm->insns[i], base, &len);
+        for (int j = 0; j < k; j++) {
+            for (int32_t s = base[j]; s < base[j] + len; s++) {
+                if (used[s]) return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Write the C translation of vm's decoded program to f. Returns false for
+ * an opcode the translator does not handle (the heap opcodes, whose
+ * collector scans vm->stack and vm->memory for roots while the generated
+ * code keeps them in locals) or for scalar slots inside an array.
+ */
+static bool emit_c(FILE *f, VM *vm, uint32_t hash) {
+    int n = vm->insn_count;
+    const VMInstr *insns = vm->insns;
+    const int *depth = vm->insn_depth;
+    bool *used = calloc(vm->memory_size + 1, sizeof(bool));
+    bool *target = calloc(n + 1, sizeof(bool));
+    if (!used || !target) {
+        free(used);
+        free(target);
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (depth[i] < 0) continue;
+        mark_slots(&insns[i], used);
+        uint8_t op = insns[i].opcode;
+        if (op == OP_JMP || op == OP_JZ || op == OP_JNZ ||
+            (op >= OP_JZ_LT && op <= OP_JZ_GE)) {
+            target[insns[i].operand] = true;
+        } else if ((op >= OP_R_JZ && op <= OP_R_JZ_GE) ||
+                   (op >= OP_LOOP_INC && op <= OP_LOOP_DEC_M)) {
+            target[insns[i].operand] = true;
+        }
+    }
+    if (!arrays_apart(vm, used)) {
+        free(used);
+        free(target);
+        return false;
+    }
+
+    fprintf(f, "/* Generated by the lab6 AOT compiler (%s). Do not edit. */\n", AOT_FORMAT);
+    fprintf(f, "#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(f, "typedef struct { int32_t pc, sp, error, unused; uint64_t count; } AotExit;\n\n");
+    fprintf(f, "const uint32_t %s = 0x%08xu;\n", AOT_HASH_SYMBOL, hash);
+    /* The bytecode itself, for load_object() to compare */
+    fprintf(f, "const int32_t %s = %d;\n", AOT_SIZE_SYMBOL, vm->code_size);
+    fprintf(f, "const uint8_t %s[%d] = {", AOT_CODE_SYMBOL, vm->code_size + 1);
+    for (int i = 0; i < vm->code_size; i++) {
+        fprintf(f, "%s%u,", i % 16 ? " " : "\n    ", vm->code[i]);
+    }
+    fprintf(f, "\n};\n\n");
+    /* idiv traps on INT32_MIN / -1: the VM's b == -1 case */
+    fprintf(f, "static inline int32_t div32(int32_t a, int32_t b) "
+               "{ return b == -1 ? (int32_t)(0u - (uint32_t)a) : a / b; }\n");
+    fprintf(f, "static inline int32_t mod32(int32_t a, int32_t b) "
+               "{ return b == -1 ? 0 : a %% b; }\n\n");
+    fprintf(f, "#define EXIT(pc_, sp_, err_) do { out->pc = (pc_); out->sp = (sp_); "
+               "out->error = (err_); goto done; } while (0)\n\n");
+    fprintf(f, "void %s(int32_t *memory, int32_t *stack, AotExit *out,\n"
+               "        void (*print)(void *, int32_t), int32_t (*read)(void *),\n"
+               "        int32_t (*eof)(void *), void *vm) {\n", AOT_ENTRY_SYMBOL);
+    for (int s = 0; s < vm->memory_size; s++) {
+        if (used[s]) fprintf(f, "    int32_t m%d = memory[%d];\n", s, s);
+    }
+    for (int k = 0; k < vm->max_stack_depth; k++) {
+        fprintf(f, "    int32_t s%d = 0;\n", k);
+    }
+    fprintf(f, "    uint64_t n = 0;\n\n");
+
+    bool ok = true;
+    for (int i = 0; ok && i < n; i++) {
+        const VMInstr *ins = &insns[i];
+        int d = depth[i];
+        int next_pc = vm->insn_offset[i + 1];
+        int a = ins->operand, b = ins->operand2, c = ins->operand3;
+
+        if (d < 0) continue;
+        if (target[i]) fprintf(f, "pc_%d:\n", vm->insn_offset[i]);
+        fprintf(f, "    n++; ");
+
+        switch (ins->opcode) {
+            case OP_PUSH:       fprintf(f, "s%d = %d;\n", d, a); break;
+            case OP_POP:        fprintf(f, "/* pop */\n"); break;
+            case OP_DUP:        fprintf(f, "s%d = s%d;\n", d, d - 1); break;
+            case OP_ADD: case OP_SUB: case OP_MUL:
+                fprintf(f, "s%d = s%d %s s%d;\n", d - 2, d - 2, arith_op(ins->opcode), d - 1);
+                break;
+            case OP_AND: case OP_OR: case OP_XOR:
+                fprintf(f, "s%d = s%d %s s%d;\n", d - 2, d - 2, arith_op(ins->opcode), d - 1);
+                break;
+            case OP_DIV: case OP_MOD:
+                fprintf(f, "if (s%d == 0) EXIT(%d, %d, %d); s%d = %s(s%d, s%d);\n",
+                        d - 1, next_pc, d - 1, VM_ERROR_DIVISION_BY_ZERO, d - 2,
+                        ins->opcode == OP_MOD ? "mod32" : "div32", d - 2, d - 1);
+                break;
+            case OP_SHL:
+                fprintf(f, "s%d = (int32_t)((uint32_t)s%d << (s%d & 31));\n", d - 2, d - 2, d - 1);
+                break;
+            case OP_SHR:
+                fprintf(f, "s%d = s%d >> (s%d & 31);\n", d - 2, d - 2, d - 1);
+                break;
+            case OP_DIV_POW2: case OP_MOD_POW2: {
+                char x[16];
+                snprintf(x, sizeof(x), "s%d", d - 1);
+                emit_pow2(f, x, x, ins->opcode == OP_MOD_POW2, a);
+                break;
+            }
+            case OP_CMP: case OP_CMP_EQ: case OP_CMP_NE:
+            case OP_CMP_GT: case OP_CMP_LE: case OP_CMP_GE:
+                fprintf(f, "s%d = s%d %s s%d;\n", d - 2, d - 2, compare_op(ins->opcode), d - 1);
+                break;
+            case OP_JMP:
+                fprintf(f, "goto pc_%d;\n", vm->insn_offset[a]);
+                break;
+            case OP_JZ: case OP_JNZ:
+                fprintf(f, "if (s%d %s 0) goto pc_%d;\n", d - 1,
+                        ins->opcode == OP_JZ ? "==" : "!=", vm->insn_offset[a]);
+                break;
+            case OP_STORE:      fprintf(f, "m%d = s%d;\n", a, d - 1); break;
+            case OP_LOAD:       fprintf(f, "s%d = m%d;\n", d, a); break;
+            case OP_INC_SLOT:   fprintf(f, "m%d += %d;\n", a, b); break;
+            case OP_PUSH_STORE:
+            case OP_R_MOVI:     fprintf(f, "m%d = %d;\n", a, b); break;
+            case OP_LOAD2_ADD: case OP_LOAD2_SUB: case OP_LOAD2_MUL:
+                fprintf(f, "s%d = m%d %s m%d;\n", d, a, arith_op(ins->opcode), b);
+                break;
+            case OP_JZ_LT: case OP_JZ_EQ: case OP_JZ_NE:
+            case OP_JZ_GT: case OP_JZ_LE: case OP_JZ_GE:
+                fprintf(f, "if (!(s%d %s s%d)) goto pc_%d;\n",
+                        d - 2, compare_op(ins->opcode), d - 1, vm->insn_offset[a]);
+                break;
+            case OP_R_MOV:      fprintf(f, "m%d = m%d;\n", a, b); break;
+            case OP_R_ADD: case OP_R_SUB: case OP_R_MUL:
+                fprintf(f, "m%d = m%d %s m%d;\n", a, b, arith_op(ins->opcode), c);
+                break;
+            case OP_R_AND: case OP_R_OR: case OP_R_XOR:
+                fprintf(f, "m%d = m%d %s m%d;\n", a, b, arith_op(ins->opcode), c);
+                break;
+            case OP_R_DIV: case OP_R_MOD:
+                fprintf(f, "if (m%d == 0) EXIT(%d, %d, %d); m%d = %s(m%d, m%d);\n",
+                        c, next_pc, d, VM_ERROR_DIVISION_BY_ZERO, a,
+                        ins->opcode == OP_R_MOD ? "mod32" : "div32", b, c);
+                break;
+            case OP_R_SHL:
+                fprintf(f, "m%d = (int32_t)((uint32_t)m%d << (m%d & 31));\n", a, b, c);
+                break;
+            case OP_R_SHR:
+                fprintf(f, "m%d = m%d >> (m%d & 31);\n", a, b, c);
+                break;
+            case OP_R_DIV_POW2: case OP_R_MOD_POW2: {
+                char dst[16], x[16];
+                snprintf(dst, sizeof(dst), "m%d", a);
+                snprintf(x, sizeof(x), "m%d", b);
+                emit_pow2(f, dst, x, ins->opcode == OP_R_MOD_POW2, c);
+                break;
+            }
+            case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+            case OP_R_GT: case OP_R_LE: case OP_R_GE:
+                fprintf(f, "m%d = m%d %s m%d;\n", a, b, compare_op(ins->opcode), c);
+                break;
+            case OP_R_JZ:
+                fprintf(f, "if (m%d == 0) goto pc_%d;\n", b, vm->insn_offset[a]);
+                break;
+            case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+            case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+                fprintf(f, "if (!(m%d %s m%d)) goto pc_%d;\n",
+                        b, compare_op(ins->opcode), c, vm->insn_offset[a]);
+                break;
+            case OP_LOOP_INC:   fprintf(f, "if (++m%d < %d) goto pc_%d;\n", b, c, vm->insn_offset[a]); break;
+            case OP_LOOP_DEC:   fprintf(f, "if (--m%d > %d) goto pc_%d;\n", b, c, vm->insn_offset[a]); break;
+            case OP_LOOP_INC_M: fprintf(f, "if (++m%d < m%d) goto pc_%d;\n", b, c, vm->insn_offset[a]); break;
+            case OP_LOOP_DEC_M: fprintf(f, "if (--m%d > m%d) goto pc_%d;\n", b, c, vm->insn_offset[a]); break;
+            case OP_PRINT:      fprintf(f, "print(vm, s%d);\n", d - 1); break;
+            case OP_R_PRINT:    fprintf(f, "print(vm, m%d);\n", a); break;
+            case OP_READ:       fprintf(f, "s%d = read(vm);\n", d); break;
+            case OP_EOF:        fprintf(f, "s%d = eof(vm);\n", d); break;
+            case OP_R_READ:     fprintf(f, "m%d = read(vm);\n", a); break;
+            case OP_R_EOF:      fprintf(f, "m%d = eof(vm);\n", a); break;
+            case OP_LOAD_IDX:
+                fprintf(f, "if ((uint32_t)s%d >= %uu) EXIT(%d, %d, %d); s%d = memory[%d + s%d];\n",
+                        d - 1, (uint32_t)b, next_pc, d - 1, VM_ERROR_INDEX_BOUNDS, d - 1, a, d - 1);
+                break;
+            case OP_STORE_IDX:
+                fprintf(f, "if ((uint32_t)s%d >= %uu) EXIT(%d, %d, %d); memory[%d + s%d] = s%d;\n",
+                        d - 2, (uint32_t)b, next_pc, d - 2, VM_ERROR_INDEX_BOUNDS, a, d - 2, d - 1);
+                break;
+            case OP_LOAD_ELEM:  fprintf(f, "s%d = memory[%d + m%d];\n", d, a, c); break;
+            case OP_STORE_ELEM: fprintf(f, "memory[%d + m%d] = s%d;\n", a, c, d - 1); break;
+            case OP_FILL:
+                fprintf(f, "for (int32_t k = 0; k < %d; k++) memory[%d + k] = s%d;\n", b, a, d - 1);
+                break;
+            case OP_COPY:
+                fprintf(f, "memmove(memory + %d, memory + %d, %d * sizeof(int32_t));\n", a, b, c);
+                break;
+            case OP_SUM:
+                fprintf(f, "s%d = 0; for (int32_t k = 0; k < %d; k++) s%d += memory[%d + k];\n",
+                        d, b, d, a);
+                break;
+            case OP_DOT:
+                fprintf(f, "s%d = 0; for (int32_t k = 0; k < %d; k++) s%d += memory[%d + k] * memory[%d + k];\n",
+                        d, c, d, a, b);
+                break;
+            case OP_VADD: case OP_VMUL:
+                fprintf(f, "for (int32_t k = 0; k < %d; k++) memory[%d + k] %s= memory[%d + k];\n",
+                        c, a, ins->opcode == OP_VADD ? "+" : "*", b);
+                break;
+            case OP_HALT:       fprintf(f, "EXIT(%d, %d, 0);\n", next_pc, d); break;
+            default:            ok = false; break;
+        }
+    }
+
+    fprintf(f, "\ndone:\n");
+    for (int s = 0; s < vm->memory_size; s++) {
+        if (used[s]) fprintf(f, "    memory[%d] = m%d;\n", s, s);
+    }
+    for (int k = 0; k < vm->max_stack_depth; k++) {
+        fprintf(f, "    if (out->sp > %d) stack[%d] = s%d;\n", k, k, k);
+    }
+    fprintf(f, "    out->count = n;\n}\n");
+
+    free(used);
+    free(target);
+    return ok;
+}
+
+/* gcc -O2 -fwrapv -shared -fPIC -o so_path c_path; 0 on success */
+static int run_compiler(const char *c_path, const char *so_path) {
+    char *argv[] = { "gcc", "-O2", "-fwrapv", "-shared", "-fPIC", "-o",
+                     (char *)so_path, (char *)c_path, NULL };
+    sigset_t block, old;
+    int status = -1;
+
+    /* Keep the shell's SIGCHLD handler from reaping the compiler first */
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        execvp(argv[0], argv);
+        perror("gcc");
+        _exit(127);
+    }
+    if (pid > 0 && waitpid(pid, &status, 0) != pid) status = -1;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0) { perror("fork"); return -1; }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+AotProgram *aot_compile(const char *source_path, BytecodeProgram *prog) {
+    AotProgram *aot = aot_load_cached(source_path, prog);
+    if (aot) return aot;
+
+    /* Decode and verify in a scratch VM */
+    VMLimits limits;
+    codegen_vm_limits(prog, &limits);
+    VM *vm = vm_create_sized(&limits);
+    if (!vm) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    vm_attach_program(vm, prog->code, prog->code_size);
+    if (!vm->verified) {
+        fprintf(stderr, "Error: '%s' does not pass bytecode verification; "
+                        "only verified programs can be compiled\n", source_path);
+        vm_destroy(vm);
+        return NULL;
+    }
+
+    uint32_t hash = program_hash(prog);
+    char *c_path = cache_path(source_path, hash, ".c");
+    char *so_path = cache_path(source_path, hash, ".so");
+    FILE *f = c_path ? fopen(c_path, "w") : NULL;
+    bool ok = f != NULL;
+    bool keep_c = false;
+    if (!ok) {
+        fprintf(stderr, "Error: cannot write '%s'\n", c_path ? c_path : source_path);
+    } else {
+        ok = emit_c(f, vm, hash);
+        if (fclose(f) != 0) ok = false;
+        if (!ok) fprintf(stderr, "Error: cannot translate '%s' to C\n", source_path);
+    }
+    vm_destroy(vm);
+
+    if (ok && run_compiler(c_path, so_path) != 0) {
+        fprintf(stderr, "Error: gcc failed on '%s'\n", c_path);
+        ok = false;
+        keep_c = true;
+    }
+    if (ok) {
+        aot = load_object(so_path, prog, hash);
+        if (!aot) {
+            fprintf(stderr, "Error: cannot load '%s': %s\n", so_path, dlerror());
+        }
+    }
+    /* Keep the C file only when gcc rejected it, to look at; a program
+       emit_c() declines leaves a half-written file, which goes too */
+    if (f && !keep_c) unlink(c_path);
+    free(c_path);
+    free(so_path);
+    return aot;
+}
+
+static void aot_print(void *vm, int32_t value) {
+    vm_print_int(vm, value);
+}
+
+static int32_t aot_read(void *vm) {
+    return vm_read_int(vm);
+}
+
+static int32_t aot_eof(void *vm) {
+    return vm_input_eof(vm);
+}
+
+VMError aot_run(AotProgram *aot, VM *vm) {
+    AotExit out = { 0, 0, VM_OK, 0, 0 };
+
+    /* The generated function always starts at the first instruction */
+    if (vm->pc != 0 || vm->sp != 0) {
+        vm->error = VM_ERROR_CODE_BOUNDS;
+        vm->running = false;
+        return vm->error;
+    }
+
+    vm->running = true;
+    aot->entry(vm->memory, vm->stack, &out, aot_print, aot_read, aot_eof, vm);
+    vm_flush_output(vm);
+    vm->pc = out.pc;
+    vm->sp = out.sp;
+    vm->error = (VMError)out.error;
+    vm->instr_count += out.count;
+    vm->running = false;
+    return vm->error;
+}
+
+const char *aot_path(const AotProgram *aot) {
+    return aot->path;
+}
+
+void aot_free(AotProgram *aot) {
+    if (!aot) return;
+    dlclose(aot->handle);
+    free(aot->path);
+    free(aot);
+}
@@ -0,0 +1,22 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "codegen.h"
+#include "vm.h"
+
+/*
+ * Ahead-of-time compiler: translates a verified BytecodeProgram into a C
+ * function, builds it with the system compiler into "<source>.so" and
+ * loads it with dlopen(). The object records a hash of the bytecode it
+ * was built from, so a later submit of the same source can reuse it
+ * without generating or compiling anything.
+ */
+typedef struct AotProgram AotProgram;
+
+AotProgram *aot_compile(const char *source_path, BytecodeProgram *prog);
+AotProgram *aot_load_cached(const char *source_path, BytecodeProgram *prog);
+VMError aot_run(AotProgram *aot, VM *vm);
+const char *aot_path(const AotProgram *aot);
+void aot_free(AotProgram *aot);
+
+#endif
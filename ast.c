@@ -2,7 +2,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ast.h"
-ASTNode *root = NULL;
 
 /* ===== Symbol Table ===== */
 #define MAX_VARS 128
@@ -159,6 +158,17 @@ int eval(ASTNode *n) {
                     exit(1);
                 }
                 return l / r;
+            case OP_MOD:
+                if (r == 0) {
+                    printf("Runtime Error: division by zero\n");
+                    exit(1);
+                }
+                return l % r;
+            case OP_AND: return l & r;
+            case OP_OR:  return l | r;
+            case OP_XOR: return l ^ r;
+            case OP_SHL: return (int)((unsigned)l << (r & 31));
+            case OP_SHR: return l >> (r & 31);
             case OP_LT:  return l < r;
             case OP_GT:  return l > r;
             case OP_LE:  return l <= r;
@@ -200,6 +210,21 @@ int eval(ASTNode *n) {
     case NODE_PRINT:
         printf("%d\n", eval(n->left));
         return 0;
+
+    /* The evaluator has no input source: it reads as empty */
+    case NODE_READ:
+        return 0;
+    case NODE_EOF:
+        return 1;
+
+    /* Arrays, builtins and functions only exist in compiled code */
+    case NODE_ARRAY_DECL:
+    case NODE_INDEX:
+    case NODE_INDEX_ASSIGN:
+    case NODE_CALL:
+    case NODE_FUNC:
+    case NODE_RETURN:
+        return 0;
     }
 
     return 0;
@@ -211,6 +236,7 @@ void ast_free(ASTNode *node) {
     ast_free(node->left);
     ast_free(node->right);
     ast_free(node->extra);
+    ast_free(node->next);
     if (node->varName) free(node->varName);
     free(node);
 }
@@ -11,7 +11,15 @@ typedef enum {
     NODE_IF,
     NODE_WHILE,
     NODE_SEQ,
-    NODE_PRINT    /* LAB6 CHANGE: added for print() statement support */
+    NODE_PRINT,   /* LAB6 CHANGE: added for print() statement support */
+    NODE_READ,    /* read(): next input value */
+    NODE_EOF,     /* eof(): 1 once the input is used up */
+    NODE_ARRAY_DECL,   /* var name[value]; */
+    NODE_INDEX,        /* name[left] */
+    NODE_INDEX_ASSIGN, /* name[left] = right; */
+    NODE_CALL,         /* name(left, left->next, ...) */
+    NODE_FUNC,         /* func name(left, left->next, ...) right */
+    NODE_RETURN        /* return left; (left may be NULL) */
 } NodeType;
 
 /* ===== Operator Types ===== */
@@ -25,7 +33,13 @@ typedef enum {
     OP_LE,
     OP_GE,
     OP_EQ,
-    OP_NEQ
+    OP_NEQ,
+    OP_MOD,
+    OP_AND,     /* bitwise & | ^ */
+    OP_OR,
+    OP_XOR,
+    OP_SHL,     /* shift counts are taken mod 32 */
+    OP_SHR      /* arithmetic */
 } OpType;
 
 /* ===== AST Node ===== */
@@ -38,7 +52,7 @@ typedef struct ASTNode {
     struct ASTNode *left;
     struct ASTNode *right;
     struct ASTNode *extra;
-    struct ASTNode *next;   /* required by parser */
+    struct ASTNode *next;   /* required by parser; next call argument */
 
 } ASTNode;
 
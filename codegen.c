@@ -11,10 +11,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include "codegen.h"
+#include "vm.h"   /* VMLimits, default region sizes */
 
 /* Bytecode opcodes (hex values from Lab 4 instructions.h) */
 #define EMIT_PUSH   0x01
+#define EMIT_POP    0x02
 #define EMIT_STORE  0x30
 #define EMIT_LOAD   0x31
 #define EMIT_ADD    0x10
@@ -27,182 +30,1910 @@
 #define EMIT_CMP_GT 0x17
 #define EMIT_CMP_LE 0x18
 #define EMIT_CMP_GE 0x19
+#define EMIT_MOD    0x1A
+#define EMIT_AND    0x1B
+#define EMIT_OR     0x1C
+#define EMIT_XOR    0x1D
+#define EMIT_SHL    0x1E
+#define EMIT_SHR    0x1F
 #define EMIT_JMP    0x20
 #define EMIT_JZ     0x21
+#define EMIT_CALL   0x40
 #define EMIT_PRINT  0x50
+#define EMIT_READ   0x51
+#define EMIT_EOF    0x52
 #define EMIT_HALT   0xFF
 
-static BytecodeProgram *prog;
+/* Counted loops (instructions.h 0x58-0x5B) */
+#define EMIT_LOOP_INC   0x58
+#define EMIT_LOOP_DEC   0x59
+#define EMIT_LOOP_INC_M 0x5A
+#define EMIT_LOOP_DEC_M 0x5B
 
-static void emit_byte(uint8_t b) {
-    if (prog->code_size >= MAX_CODE_SIZE) {
-        fprintf(stderr, "codegen: code buffer overflow\n");
-        exit(1);
+/* Call frames (instructions.h 0x42-0x49) */
+#define EMIT_ENTER       0x42
+#define EMIT_RETURN      0x43
+#define EMIT_TAIL        0x44
+#define EMIT_LOAD_LOCAL  0x48
+#define EMIT_STORE_LOCAL 0x49
+
+/* Superinstructions (instructions.h 0x60-0x6D) */
+#define EMIT_INC_SLOT   0x60
+#define EMIT_PUSH_STORE 0x61
+#define EMIT_LOAD2_ADD  0x62
+#define EMIT_LOAD2_SUB  0x63
+#define EMIT_LOAD2_MUL  0x64
+#define EMIT_DIV_POW2   0x65
+#define EMIT_MOD_POW2   0x66
+#define EMIT_JZ_LT  0x68
+#define EMIT_JZ_EQ  0x69
+#define EMIT_JZ_NE  0x6A
+#define EMIT_JZ_GT  0x6B
+#define EMIT_JZ_LE  0x6C
+#define EMIT_JZ_GE  0x6D
+
+/* Register engine (instructions.h 0x70-0x8A) */
+#define EMIT_R_MOV    0x70
+#define EMIT_R_MOVI   0x71
+#define EMIT_R_ADD    0x72
+#define EMIT_R_SUB    0x73
+#define EMIT_R_MUL    0x74
+#define EMIT_R_DIV    0x75
+#define EMIT_R_LT     0x78
+#define EMIT_R_EQ     0x79
+#define EMIT_R_NE     0x7A
+#define EMIT_R_GT     0x7B
+#define EMIT_R_LE     0x7C
+#define EMIT_R_GE     0x7D
+#define EMIT_R_JZ     0x80
+#define EMIT_R_JZ_LT  0x81
+#define EMIT_R_JZ_EQ  0x82
+#define EMIT_R_JZ_NE  0x83
+#define EMIT_R_JZ_GT  0x84
+#define EMIT_R_JZ_LE  0x85
+#define EMIT_R_JZ_GE  0x86
+#define EMIT_R_PRINT  0x88
+#define EMIT_R_READ   0x89
+#define EMIT_R_EOF    0x8A
+
+/* Remainder, bitwise and shifts (instructions.h 0xA0-0xA7) */
+#define EMIT_R_MOD      0xA0
+#define EMIT_R_AND      0xA1
+#define EMIT_R_OR       0xA2
+#define EMIT_R_XOR      0xA3
+#define EMIT_R_SHL      0xA4
+#define EMIT_R_SHR      0xA5
+#define EMIT_R_DIV_POW2 0xA6
+#define EMIT_R_MOD_POW2 0xA7
+
+/* Arrays (instructions.h 0x90-0x9D) */
+#define EMIT_LOAD_IDX   0x90
+#define EMIT_STORE_IDX  0x91
+#define EMIT_LOAD_ELEM  0x92
+#define EMIT_STORE_ELEM 0x93
+#define EMIT_FILL       0x98
+#define EMIT_COPY       0x99
+#define EMIT_SUM        0x9A
+#define EMIT_DOT        0x9B
+#define EMIT_VADD       0x9C
+#define EMIT_VMUL       0x9D
+
+/* Heap pairs (instructions.h 0xB0-0xB4) */
+#define EMIT_PAIR       0xB0
+#define EMIT_LEFT       0xB1
+#define EMIT_RIGHT      0xB2
+#define EMIT_SET_LEFT   0xB3
+#define EMIT_SET_RIGHT  0xB4
+
+/* Host calls (instructions.h 0xB8) */
+#define EMIT_NATIVE     0xB8
+
+#define MAX_INDEX_WINDOWS 16
+#define MAX_LOOP_INITS 8
+
+/* A PUSH_STORE: the slot holds `value` from offset `end` until the slot
+   is written again */
+typedef struct {
+    int slot;
+    int32_t value;
+    int end;
+} LoopInit;
+
+/* A CALL or TAIL whose operand gets the callee's entry offset */
+typedef struct {
+    int at;
+    int function;
+} CallPatch;
+
+/* A while loop's index variable, known to stay in [lo, hi] in the loop
+   body until the statement that steps it (see loop_index_window()) */
+typedef struct {
+    int slot;
+    int64_t lo, hi;
+    int open;
+} IndexWindow;
+
+/*
+ * Compiler state for one program. Everything codegen needs lives here
+ * and is passed down explicitly, so programs can be compiled
+ * concurrently.
+ */
+typedef struct {
+    BytecodeProgram *prog;
+
+    /* Operand stack depth of the code emitted so far (stack lowering) */
+    int depth;
+    int max_depth;
+    int unbounded;      /* a loop body leaves values on the stack */
+
+    /* Register lowering: constant pool and temporaries */
+    int32_t *consts;
+    int const_count;
+    int const_capacity;
+    int temp_top;
+    int temp_max;
+    int failed;
+
+    /* Arrays: slots reserved so far, counted from the first array slot */
+    int array_slots;
+    int array_capacity;
+
+    /* Unchecked element accesses (stack lowering) */
+    IndexWindow windows[MAX_INDEX_WINDOWS];
+    int window_count;
+    int element_slots[VM_INDEX_SLOTS];   /* index slots used so far */
+    int element_slot_count;
+    int last_label;     /* latest offset a jump was patched to */
+    LoopInit inits[MAX_LOOP_INITS];     /* latest PUSH_STOREs, oldest first */
+    int init_count;
+
+    /* Functions: the one being compiled (NULL for the main program) and
+       the calls to patch once every body is emitted */
+    FunctionInfo *fn;
+    int function_capacity;
+    CallPatch *calls;
+    int call_count;
+    int call_capacity;
+
+    const NativeLib *natives;   /* library given at submit, or NULL */
+} Codegen;
+
+static void stack_change(Codegen *cg, int delta) {
+    cg->depth += delta;
+    if (cg->depth > cg->max_depth) cg->max_depth = cg->depth;
+}
+
+/* Out of memory: fail the compilation, so submit reports it and the
+   shell carries on */
+static void codegen_oom(Codegen *cg, const char *what) {
+    fprintf(stderr, "codegen: out of memory for %s\n", what);
+    cg->failed = 1;
+}
+
+/* Past MAX_CODE_SIZE the compilation fails and the rest is dropped */
+static void emit_byte(Codegen *cg, uint8_t b) {
+    if (cg->prog->code_size >= MAX_CODE_SIZE) {
+        if (!cg->failed) {
+            fprintf(stderr, "codegen: program needs more than %d bytes of bytecode\n",
+                    MAX_CODE_SIZE);
+        }
+        cg->failed = 1;
+        return;
     }
-    prog->code[prog->code_size++] = b;
+    cg->prog->code[cg->prog->code_size++] = b;
+}
+
+static void emit_int32(Codegen *cg, int32_t val) {
+    emit_byte(cg, val & 0xFF);
+    emit_byte(cg, (val >> 8) & 0xFF);
+    emit_byte(cg, (val >> 16) & 0xFF);
+    emit_byte(cg, (val >> 24) & 0xFF);
 }
 
-static void emit_int32(int32_t val) {
-    emit_byte(val & 0xFF);
-    emit_byte((val >> 8) & 0xFF);
-    emit_byte((val >> 16) & 0xFF);
-    emit_byte((val >> 24) & 0xFF);
+static void patch_int32(Codegen *cg, int offset, int32_t val) {
+    if (offset + 4 > cg->prog->code_size) return;   /* dropped by emit_byte() */
+    cg->prog->code[offset]     = val & 0xFF;
+    cg->prog->code[offset + 1] = (val >> 8) & 0xFF;
+    cg->prog->code[offset + 2] = (val >> 16) & 0xFF;
+    cg->prog->code[offset + 3] = (val >> 24) & 0xFF;
 }
 
-static void patch_int32(int offset, int32_t val) {
-    prog->code[offset]     = val & 0xFF;
-    prog->code[offset + 1] = (val >> 8) & 0xFF;
-    prog->code[offset + 2] = (val >> 16) & 0xFF;
-    prog->code[offset + 3] = (val >> 24) & 0xFF;
+static int current_offset(Codegen *cg) {
+    return cg->prog->code_size;
 }
 
-static int current_offset(void) {
-    return prog->code_size;
+/* Point the jump operand at `offset` to the next instruction */
+static void patch_here(Codegen *cg, int offset) {
+    patch_int32(cg, offset, current_offset(cg));
+    cg->last_label = current_offset(cg);
 }
 
-static void add_source_map(int line) {
-    if (prog->source_map_count >= MAX_SOURCE_MAP) return;
-    prog->source_map[prog->source_map_count].bytecode_offset = current_offset();
-    prog->source_map[prog->source_map_count].source_line = line;
-    prog->source_map_count++;
+static void add_source_map(Codegen *cg, int line) {
+    if (cg->prog->source_map_count >= MAX_SOURCE_MAP) return;
+    cg->prog->source_map[cg->prog->source_map_count].bytecode_offset = current_offset(cg);
+    cg->prog->source_map[cg->prog->source_map_count].source_line = line;
+    cg->prog->source_map_count++;
 }
 
-static int find_or_add_var(const char *name) {
-    for (int i = 0; i < prog->var_count; i++) {
-        if (strcmp(prog->var_names[i], name) == 0) return i;
+static int find_or_add_var(Codegen *cg, const char *name) {
+    for (int i = 0; i < cg->prog->var_count; i++) {
+        if (strcmp(cg->prog->var_names[i], name) == 0) return i;
     }
-    if (prog->var_count >= MAX_CODEGEN_VARS) {
-        fprintf(stderr, "codegen: too many variables\n");
-        exit(1);
+    if (cg->prog->var_count >= cg->prog->var_capacity) {
+        int cap = cg->prog->var_capacity ? cg->prog->var_capacity * 2 : 16;
+        char **names = realloc(cg->prog->var_names, cap * sizeof(char *));
+        if (!names) {
+            codegen_oom(cg, "variables");
+            return 0;
+        }
+        cg->prog->var_names = names;
+        cg->prog->var_capacity = cap;
     }
-    prog->var_names[prog->var_count] = strdup(name);
-    return prog->var_count++;
+    cg->prog->var_names[cg->prog->var_count] = strdup(name);
+    return cg->prog->var_count++;
 }
 
-static void codegen_node(ASTNode *node) {
+/* Frame slot of `name` in the function being compiled, or -1 */
+static int local_index(Codegen *cg, const char *name) {
+    if (!cg->fn) return -1;
+    for (int i = 0; i < cg->fn->local_count; i++) {
+        if (strcmp(cg->fn->local_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void codegen_node(Codegen *cg, ASTNode *node);
+
+/*
+ * Superinstruction selection. When a pattern matches, the covered child
+ * nodes are never visited by codegen_node(cg), so map_subtree(cg) records
+ * their source lines at the fused instruction's offset to keep the
+ * source map as complete as the unfused lowering.
+ */
+static void map_subtree(Codegen *cg, ASTNode *node) {
     if (!node) return;
+    if (node->line_number > 0) add_source_map(cg, node->line_number);
+    map_subtree(cg, node->left);
+    map_subtree(cg, node->right);
+    map_subtree(cg, node->extra);
+}
 
-    if (node->line_number > 0) {
-        add_source_map(node->line_number);
+static int is_comparison(ASTNode *node) {
+    if (!node || node->type != NODE_OP) return 0;
+    switch (node->value) {
+        case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NEQ:
+            return 1;
+    }
+    return 0;
+}
+
+/* Emit `cond` followed by a jump taken when it is false; returns the
+   offset of the jump operand for patching. */
+static int emit_jump_if_false(Codegen *cg, ASTNode *cond) {
+    if (is_comparison(cond)) {
+        if (cond->line_number > 0) add_source_map(cg, cond->line_number);
+        codegen_node(cg, cond->left);
+        codegen_node(cg, cond->right);
+        switch (cond->value) {
+            case OP_LT:  emit_byte(cg, EMIT_JZ_LT); break;
+            case OP_GT:  emit_byte(cg, EMIT_JZ_GT); break;
+            case OP_LE:  emit_byte(cg, EMIT_JZ_LE); break;
+            case OP_GE:  emit_byte(cg, EMIT_JZ_GE); break;
+            case OP_EQ:  emit_byte(cg, EMIT_JZ_EQ); break;
+            case OP_NEQ: emit_byte(cg, EMIT_JZ_NE); break;
+        }
+        stack_change(cg, -2);
+    } else {
+        codegen_node(cg, cond);
+        emit_byte(cg, EMIT_JZ);
+        stack_change(cg, -1);
+    }
+    int patch = current_offset(cg);
+    emit_int32(cg, 0);  /* placeholder */
+    return patch;
+}
+
+/*
+ * Strength reduction on literal powers of two. collect(cg) rewrites
+ * x * 2^k and 2^k * x into x << k in the tree, so both lowerings and the
+ * constant pool see the shift. x / 2^k and x % 2^k keep their node and
+ * lower to DIV_POW2 / MOD_POW2 with k as an immediate; those round toward
+ * zero like DIV and MOD, which a bare shift or mask would not for x < 0.
+ */
+static int pow2_log(ASTNode *node, int32_t *k) {
+    if (node->type != NODE_INT || node->value < 2 || (node->value & (node->value - 1))) {
+        return 0;
+    }
+    *k = __builtin_ctz((unsigned)node->value);
+    return 1;
+}
+
+static void reduce_strength(ASTNode *node) {
+    int32_t k;
+    if (node->value != OP_MUL) return;
+    if (pow2_log(node->left, &k)) {
+        ASTNode *x = node->right;
+        node->right = node->left;
+        node->left = x;
+    } else if (!pow2_log(node->right, &k)) {
+        return;
+    }
+    node->value = OP_SHL;
+    node->right->value = k;
+}
+
+/* x / 2^k or x % 2^k: the POW2 opcode to use, 0 otherwise */
+static int pow2_divide(ASTNode *node, int32_t *k, int reg) {
+    if (!pow2_log(node->right, k)) return 0;
+    if (node->value == OP_DIV) return reg ? EMIT_R_DIV_POW2 : EMIT_DIV_POW2;
+    if (node->value == OP_MOD) return reg ? EMIT_R_MOD_POW2 : EMIT_MOD_POW2;
+    return 0;
+}
+
+/* LOAD a; LOAD b; ADD/SUB/MUL  ->  LOAD2_op a, b */
+static int try_load2_op(Codegen *cg, ASTNode *node) {
+    if (node->left->type != NODE_VAR || node->right->type != NODE_VAR) return 0;
+    if (local_index(cg, node->left->varName) >= 0 ||
+        local_index(cg, node->right->varName) >= 0) {
+        return 0;
+    }
+    uint8_t op;
+    switch (node->value) {
+        case OP_ADD: op = EMIT_LOAD2_ADD; break;
+        case OP_SUB: op = EMIT_LOAD2_SUB; break;
+        case OP_MUL: op = EMIT_LOAD2_MUL; break;
+        default: return 0;
+    }
+    map_subtree(cg, node->left);
+    map_subtree(cg, node->right);
+    int a = find_or_add_var(cg, node->left->varName);
+    int b = find_or_add_var(cg, node->right->varName);
+    emit_byte(cg, op);
+    emit_int32(cg, a);
+    emit_int32(cg, b);
+    stack_change(cg, 1);
+    return 1;
+}
+
+static void forget_init(Codegen *cg, int slot) {
+    for (int i = 0; i < cg->init_count; i++) {
+        if (cg->inits[i].slot == slot) {
+            memmove(&cg->inits[i], &cg->inits[i + 1], (cg->init_count - i - 1) * sizeof(LoopInit));
+            cg->init_count--;
+            return;
+        }
+    }
+}
+
+static void remember_init(Codegen *cg, int slot, int32_t value) {
+    forget_init(cg, slot);
+    if (cg->init_count == MAX_LOOP_INITS) forget_init(cg, cg->inits[0].slot);
+    LoopInit *init = &cg->inits[cg->init_count++];
+    init->slot = slot;
+    init->value = value;
+    init->end = current_offset(cg);
+}
+
+/* `expr` is name + k, k + name or name - k: sets *k to the step */
+static int fused_increment(const char *name, ASTNode *expr, int32_t *k) {
+    if (expr->type != NODE_OP) return 0;
+
+    ASTNode *var = NULL, *c = NULL;
+    if (expr->value == OP_ADD) {
+        if (expr->left->type == NODE_VAR && expr->right->type == NODE_INT) {
+            var = expr->left; c = expr->right;
+        } else if (expr->left->type == NODE_INT && expr->right->type == NODE_VAR) {
+            var = expr->right; c = expr->left;
+        }
+    } else if (expr->value == OP_SUB && expr->left->type == NODE_VAR &&
+               expr->right->type == NODE_INT && expr->right->value != INT32_MIN) {
+        var = expr->left; c = expr->right;
+    }
+    if (!var || strcmp(var->varName, name) != 0) return 0;
+    *k = expr->value == OP_SUB ? -c->value : c->value;
+    return 1;
+}
+
+/* Store of `expr` into `name`: PUSH k; STORE -> PUSH_STORE and
+   x = x + k / x = k + x / x = x - k -> INC_SLOT */
+static int try_fused_store(Codegen *cg, const char *name, ASTNode *expr) {
+    if (expr->type == NODE_INT) {
+        map_subtree(cg, expr);
+        int slot = find_or_add_var(cg, name);
+        emit_byte(cg, EMIT_PUSH_STORE);
+        emit_int32(cg, slot);
+        emit_int32(cg, expr->value);
+        remember_init(cg, slot, expr->value);
+        return 1;
+    }
+
+    int32_t k;
+    if (!fused_increment(name, expr, &k)) return 0;
+    map_subtree(cg, expr);
+    emit_byte(cg, EMIT_INC_SLOT);
+    emit_int32(cg, find_or_add_var(cg, name));
+    emit_int32(cg, k);
+    return 1;
+}
+
+/* ===== Arrays and builtins =====
+ *
+ * collect(cg) walks the program before any code is emitted, in the order
+ * both lowerings visit it, so variables get the same slots either way.
+ * It assigns variable slots, records arrays, rejects misused names and
+ * builtins and, for the register lowering, fills the constant pool.
+ * Arrays follow the variables in memory, so their bases are fixed only
+ * once the walk is done (place_arrays()). An array must be declared
+ * before it is used.
+ */
+typedef enum {
+    CTX_VALUE,      /* an operand */
+    CTX_PUSHED,     /* stored or pushed as is: a literal needs no constant slot */
+    CTX_STATEMENT
+} CollectContext;
+
+typedef struct {
+    const char *name;
+    int arrays;         /* leading array arguments */
+    int values;         /* value arguments after them */
+    int has_value;
+    uint8_t opcode;     /* 0 for len(), a constant */
+} Builtin;
+
+static const Builtin builtins[] = {
+    { "len",  1, 0, 1, 0 },
+    { "sum",  1, 0, 1, EMIT_SUM },
+    { "dot",  2, 0, 1, EMIT_DOT },
+    { "fill", 1, 1, 0, EMIT_FILL },
+    { "copy", 2, 0, 0, EMIT_COPY },
+    { "add",  2, 0, 0, EMIT_VADD },
+    { "mul",  2, 0, 0, EMIT_VMUL },
+    { "pair",      0, 2, 1, EMIT_PAIR },
+    { "left",      0, 1, 1, EMIT_LEFT },
+    { "right",     0, 1, 1, EMIT_RIGHT },
+    { "set_left",  0, 2, 0, EMIT_SET_LEFT },
+    { "set_right", 0, 2, 0, EMIT_SET_RIGHT },
+};
+
+static const Builtin *find_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+static ArrayInfo *find_array(BytecodeProgram *p, const char *name) {
+    for (int i = 0; i < p->array_count; i++) {
+        if (strcmp(p->arrays[i].name, name) == 0) return &p->arrays[i];
+    }
+    return NULL;
+}
+
+static int reg_const_index(Codegen *cg, int32_t value);
+
+static void codegen_error(Codegen *cg, ASTNode *node, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "codegen: line %d: ", node->line_number);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    cg->failed = 1;
+}
+
+static ASTNode *call_argument(ASTNode *call, int k) {
+    ASTNode *a = call->left;
+    while (a && k-- > 0) a = a->next;
+    return a;
+}
+
+static int call_argument_count(ASTNode *call) {
+    int n = 0;
+    for (ASTNode *a = call->left; a; a = a->next) n++;
+    return n;
+}
+
+/* The value of len(x) or an integer literal, known at compile time */
+static int constant_value(Codegen *cg, ASTNode *node, int32_t *value) {
+    if (node->type == NODE_INT) {
+        *value = node->value;
+        return 1;
+    }
+    if (node->type == NODE_CALL && strcmp(node->varName, "len") == 0) {
+        ArrayInfo *arr = find_array(cg->prog, node->left->varName);
+        *value = arr->length;
+        return 1;
+    }
+    return 0;
+}
+
+static void add_array(Codegen *cg, ASTNode *decl) {
+    BytecodeProgram *p = cg->prog;
+    ArrayInfo *arr = find_array(p, decl->varName);
+    if (arr) {
+        if (arr->length != decl->value) {
+            codegen_error(cg, decl, "array '%s' redeclared with length %d", decl->varName, decl->value);
+        }
+        return;
+    }
+    if (codegen_var_slot(p, decl->varName) >= 0) {
+        codegen_error(cg, decl, "'%s' is already a variable", decl->varName);
+        return;
+    }
+    if (decl->value < 1 || decl->value > MAX_ARRAY_SLOTS - cg->array_slots) {
+        codegen_error(cg, decl, "array '%s' must have 1 to %d elements",
+                      decl->varName, MAX_ARRAY_SLOTS - cg->array_slots);
+        return;
+    }
+    if (p->array_count >= cg->array_capacity) {
+        int cap = cg->array_capacity ? cg->array_capacity * 2 : 8;
+        ArrayInfo *arrays = realloc(p->arrays, cap * sizeof(ArrayInfo));
+        if (!arrays) {
+            codegen_oom(cg, "arrays");
+            return;
+        }
+        p->arrays = arrays;
+        cg->array_capacity = cap;
+    }
+    arr = &p->arrays[p->array_count++];
+    arr->name = strdup(decl->varName);
+    arr->base = cg->array_slots;
+    arr->length = decl->value;
+    cg->array_slots += decl->value;
+}
+
+/* `node` names a declared array */
+static int check_array(Codegen *cg, ASTNode *node) {
+    if (node->type == NODE_VAR || node->type == NODE_INDEX || node->type == NODE_INDEX_ASSIGN) {
+        if (local_index(cg, node->varName) < 0 && find_array(cg->prog, node->varName)) return 1;
+        codegen_error(cg, node, "'%s' is not an array", node->varName);
+    } else {
+        codegen_error(cg, node, "expected an array name");
+    }
+    return 0;
+}
+
+static void check_scalar(Codegen *cg, ASTNode *node) {
+    if (local_index(cg, node->varName) >= 0) return;
+    if (find_array(cg->prog, node->varName)) {
+        codegen_error(cg, node, "'%s' is an array; use an index or a builtin", node->varName);
+    } else {
+        find_or_add_var(cg, node->varName);
+    }
+}
+
+/* Literals need constant slots: register lowering, outside functions */
+static int reg_operands(Codegen *cg) {
+    return cg->prog->engine == ENGINE_REG && !cg->fn;
+}
+
+/* ===== Functions =====
+ *
+ * Functions are defined at the top level and may be called before their
+ * definition, so declare_functions(cg) registers them all before the
+ * collect(cg) walk. Parameters and the names declared with `var` anywhere
+ * in the body live in the call's frame; every other name is a global
+ * variable or array. Bodies are emitted after the main program's HALT,
+ * and a call in a return statement becomes OP_TAIL.
+ */
+static FunctionInfo *find_function(BytecodeProgram *p, const char *name) {
+    for (int i = 0; i < p->function_count; i++) {
+        if (strcmp(p->functions[i].name, name) == 0) return &p->functions[i];
+    }
+    return NULL;
+}
+
+static void add_local(Codegen *cg, FunctionInfo *fn, const char *name) {
+    for (int i = 0; i < fn->local_count; i++) {
+        if (strcmp(fn->local_names[i], name) == 0) return;
+    }
+    char **names = realloc(fn->local_names, (fn->local_count + 1) * sizeof(char *));
+    if (!names) {
+        codegen_oom(cg, "locals");
+        return;
+    }
+    fn->local_names = names;
+    fn->local_names[fn->local_count++] = strdup(name);
+}
+
+static void add_function(Codegen *cg, ASTNode *def) {
+    BytecodeProgram *p = cg->prog;
+    if (find_builtin(def->varName)) {
+        codegen_error(cg, def, "'%s' is a builtin", def->varName);
+        return;
+    }
+    if (find_function(p, def->varName)) {
+        codegen_error(cg, def, "function '%s' is already defined", def->varName);
+        return;
+    }
+    if (p->function_count >= cg->function_capacity) {
+        int cap = cg->function_capacity ? cg->function_capacity * 2 : 8;
+        FunctionInfo *functions = realloc(p->functions, cap * sizeof(FunctionInfo));
+        if (!functions) {
+            codegen_oom(cg, "functions");
+            return;
+        }
+        p->functions = functions;
+        cg->function_capacity = cap;
+    }
+    FunctionInfo *fn = &p->functions[p->function_count++];
+    memset(fn, 0, sizeof(FunctionInfo));
+    fn->name = strdup(def->varName);
+    fn->entry = -1;
+    fn->line = def->line_number;
+    for (ASTNode *param = def->left; param; param = param->next) {
+        int before = fn->local_count;
+        add_local(cg, fn, param->varName);
+        if (fn->local_count == before && !cg->failed) {
+            codegen_error(cg, param, "parameter '%s' appears twice", param->varName);
+        }
+    }
+    fn->params = fn->local_count;
+}
+
+/* Register the definitions at the top level; node->value marks them */
+static void declare_functions(Codegen *cg, ASTNode *node) {
+    if (!node) return;
+    if (node->type == NODE_SEQ) {
+        declare_functions(cg, node->left);
+        declare_functions(cg, node->right);
+    } else if (node->type == NODE_FUNC) {
+        node->value = 1;
+        add_function(cg, node);
+    }
+}
+
+static void declare_locals(Codegen *cg, FunctionInfo *fn, ASTNode *node) {
+    if (!node || node->type == NODE_FUNC) return;
+    if (node->type == NODE_DECL) add_local(cg, fn, node->varName);
+    declare_locals(cg, fn, node->left);
+    declare_locals(cg, fn, node->right);
+    declare_locals(cg, fn, node->extra);
+}
+
+static void collect(Codegen *cg, ASTNode *node, CollectContext ctx);
+
+static void collect_function(Codegen *cg, ASTNode *def) {
+    if (cg->fn || !def->value) {
+        codegen_error(cg, def, "functions can only be defined at the top level");
+        return;
+    }
+    cg->fn = find_function(cg->prog, def->varName);
+    if (!cg->fn) return;    /* rejected by add_function() */
+    declare_locals(cg, cg->fn, def->right);
+    collect(cg, def->right, CTX_STATEMENT);
+    cg->fn = NULL;
+}
+
+/* ===== Natives =====
+ *
+ * A call that names neither a function of the program nor a builtin
+ * resolves to a host function of the library given at submit (see
+ * native.h). Each native the program calls gets the next OP_NATIVE
+ * index, and the program manager registers them on the VM in that order.
+ * A bare array name as an argument passes the array's base slot, so a
+ * native can work on the elements through vm->memory.
+ */
+static int native_index(const BytecodeProgram *p, const char *name) {
+    for (int i = 0; i < p->native_count; i++) {
+        if (strcmp(p->native_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void add_native(Codegen *cg, const char *name) {
+    BytecodeProgram *p = cg->prog;
+    if (native_index(p, name) >= 0) return;
+    char **names = realloc(p->native_names, (p->native_count + 1) * sizeof(char *));
+    if (!names) {
+        codegen_oom(cg, "natives");
+        return;
+    }
+    p->native_names = names;
+    p->native_names[p->native_count++] = strdup(name);
+}
+
+/* `arg` is a global array passed whole: its base slot is the value */
+static int array_argument(Codegen *cg, ASTNode *arg, int32_t *base) {
+    if (arg->type != NODE_VAR || local_index(cg, arg->varName) >= 0) return 0;
+    ArrayInfo *arr = find_array(cg->prog, arg->varName);
+    if (!arr) return 0;
+    if (base) *base = arr->base;
+    return 1;
+}
+
+static void collect_native(Codegen *cg, ASTNode *node, CollectContext ctx) {
+    const NativeDef *def = native_find(cg->natives, node->varName);
+    if (!def) {
+        codegen_error(cg, node, "unknown function '%s'", node->varName);
+        return;
+    }
+    if (call_argument_count(node) != def->arity) {
+        codegen_error(cg, node, "%s() takes %d argument%s", def->name, def->arity,
+                      def->arity == 1 ? "" : "s");
+        return;
+    }
+    for (ASTNode *a = node->left; a; a = a->next) {
+        if (!array_argument(cg, a, NULL)) collect(cg, a, CTX_PUSHED);
+    }
+    add_native(cg, node->varName);
+    node->value = ctx == CTX_STATEMENT;     /* the result is dropped */
+}
+
+static void collect_call(Codegen *cg, ASTNode *node, CollectContext ctx) {
+    FunctionInfo *fn = find_function(cg->prog, node->varName);
+    if (fn) {
+        int argc = call_argument_count(node);
+        if (argc != fn->params) {
+            codegen_error(cg, node, "%s() takes %d argument%s", fn->name, fn->params,
+                          fn->params == 1 ? "" : "s");
+            return;
+        }
+        for (ASTNode *a = node->left; a; a = a->next) collect(cg, a, CTX_PUSHED);
+        node->value = ctx == CTX_STATEMENT;     /* the result is dropped */
+        return;
+    }
+
+    const Builtin *b = find_builtin(node->varName);
+    if (!b) {
+        collect_native(cg, node, ctx);
+        return;
+    }
+    int argc = b->arrays + b->values;
+    if (call_argument_count(node) != argc) {
+        codegen_error(cg, node, "%s() takes %d argument%s", b->name, argc, argc == 1 ? "" : "s");
+        return;
+    }
+    if (!b->has_value && ctx != CTX_STATEMENT) {
+        codegen_error(cg, node, "%s() has no value", b->name);
+        return;
+    }
+    for (int i = 0; i < b->arrays; i++) {
+        if (!check_array(cg, call_argument(node, i))) return;
+    }
+    if (b->arrays == 2 &&
+        find_array(cg->prog, node->left->varName)->length !=
+        find_array(cg->prog, node->left->next->varName)->length) {
+        codegen_error(cg, node, "%s() needs arrays of the same length", b->name);
+        return;
+    }
+    for (int i = 0; i < b->values; i++) {
+        collect(cg, call_argument(node, b->arrays + i), CTX_PUSHED);
+    }
+    node->value = ctx == CTX_STATEMENT && b->has_value;    /* dropped */
+
+    int32_t len;
+    if (b->opcode == 0 && ctx != CTX_PUSHED && reg_operands(cg) &&
+        constant_value(cg, node, &len)) {
+        reg_const_index(cg, len);
+    }
+}
+
+static void collect(Codegen *cg, ASTNode *node, CollectContext ctx) {
+    if (!node) return;
+    switch (node->type) {
+        case NODE_INT:
+            if (ctx != CTX_PUSHED && reg_operands(cg)) {
+                reg_const_index(cg, node->value);
+            }
+            return;
+        case NODE_VAR:
+            check_scalar(cg, node);
+            return;
+        case NODE_DECL:
+        case NODE_ASSIGN:
+            check_scalar(cg, node);
+            collect(cg, node->left, CTX_PUSHED);
+            return;
+        case NODE_ARRAY_DECL:
+            if (cg->fn) {
+                codegen_error(cg, node, "arrays must be declared outside functions");
+                return;
+            }
+            add_array(cg, node);
+            return;
+        case NODE_FUNC:
+            collect_function(cg, node);
+            return;
+        case NODE_RETURN:
+            if (!cg->fn) codegen_error(cg, node, "return outside a function");
+            collect(cg, node->left, CTX_PUSHED);
+            return;
+        case NODE_INDEX:
+            check_array(cg, node);
+            collect(cg, node->left, CTX_PUSHED);
+            return;
+        case NODE_INDEX_ASSIGN:
+            check_array(cg, node);
+            collect(cg, node->left, CTX_PUSHED);
+            collect(cg, node->right, CTX_PUSHED);
+            return;
+        case NODE_CALL:
+            collect_call(cg, node, ctx);
+            return;
+        case NODE_OP: {
+            int32_t k;
+            reduce_strength(node);
+            collect(cg, node->left, CTX_VALUE);
+            /* the divisor of a POW2 opcode is an immediate */
+            if (!pow2_divide(node, &k, 0)) collect(cg, node->right, CTX_VALUE);
+            return;
+        }
+        case NODE_IF:
+        case NODE_WHILE:
+        case NODE_SEQ:
+            collect(cg, node->left, node->type == NODE_SEQ ? CTX_STATEMENT : CTX_VALUE);
+            collect(cg, node->right, CTX_STATEMENT);
+            collect(cg, node->extra, CTX_STATEMENT);
+            return;
+        default:
+            collect(cg, node->left, CTX_VALUE);
+            collect(cg, node->right, CTX_VALUE);
+            collect(cg, node->extra, CTX_VALUE);
+            return;
+    }
+}
+
+/* Arrays go after the variables, whose count is now final */
+static void place_arrays(Codegen *cg) {
+    for (int i = 0; i < cg->prog->array_count; i++) {
+        cg->prog->arrays[i].base += cg->prog->var_count;
+    }
+}
+
+/* Bulk and element opcodes carry the array as (base, length) */
+static void emit_array_op(Codegen *cg, uint8_t op, const ArrayInfo *arr) {
+    emit_byte(cg, op);
+    emit_int32(cg, arr->base);
+    emit_int32(cg, arr->length);
+}
+
+/* Stack effect of a builtin call; the operands are already pushed */
+static void emit_builtin(Codegen *cg, ASTNode *node) {
+    const Builtin *b = find_builtin(node->varName);
+    ArrayInfo *x = b->arrays ? find_array(cg->prog, node->left->varName) : NULL;
+    if (b->arrays == 0) {
+        emit_byte(cg, b->opcode);
+    } else if (b->opcode == 0) {
+        emit_byte(cg, EMIT_PUSH);
+        emit_int32(cg, x->length);
+    } else if (b->arrays == 2) {
+        ArrayInfo *y = find_array(cg->prog, node->left->next->varName);
+        emit_byte(cg, b->opcode);
+        emit_int32(cg, x->base);
+        emit_int32(cg, y->base);
+        emit_int32(cg, x->length);
+    } else {
+        emit_array_op(cg, b->opcode, x);
+    }
+    stack_change(cg, (b->has_value ? 1 : 0) - b->values);
+}
+
+/*
+ * Bounds-check hoisting (stack lowering). A loop of the form
+ *
+ *     i = c0; ...; while (i < n) { ...; i = i + k; ... }
+ *
+ * where n is a literal or len(x), the code between the two statements is
+ * straight-line and leaves i alone, and i is written in the body only by
+ * top-level steps in the loop's direction, keeps i in a window known at compile time
+ * until the first step. Accesses a[i] inside the window, with the window
+ * inside a, use the unchecked OP_LOAD_ELEM / OP_STORE_ELEM. The VM
+ * re-proves every such access when it verifies the program.
+ */
+static int writes_var(ASTNode *node, const char *name) {
+    if (!node) return 0;
+    if ((node->type == NODE_DECL || node->type == NODE_ASSIGN) &&
+        strcmp(node->varName, name) == 0) {
+        return 1;
+    }
+    if (node->type == NODE_CALL && !find_builtin(node->varName)) return 1;   /* a function */
+    return writes_var(node->left, name) || writes_var(node->right, name) ||
+           writes_var(node->extra, name) || writes_var(node->next, name);
+}
+
+/* Every write to `name` in the loop body is a top-level step with the
+   sign of `dir`, and the steps cannot overflow from inside [lo, hi] */
+static int index_steps(ASTNode *body, const char *name, int dir,
+                       int64_t lo, int64_t hi, int64_t *total) {
+    if (!body) return 1;
+    if (body->type == NODE_SEQ) {
+        return index_steps(body->left, name, dir, lo, hi, total) &&
+               index_steps(body->right, name, dir, lo, hi, total);
+    }
+    if ((body->type == NODE_DECL || body->type == NODE_ASSIGN) &&
+        strcmp(body->varName, name) == 0) {
+        int32_t k;
+        if (!body->left || !fused_increment(name, body->left, &k)) return 0;
+        if (dir > 0 ? k <= 0 : k >= 0) return 0;
+        *total += k;
+        return hi + *total <= INT32_MAX && lo + *total >= INT32_MIN;
+    }
+    return !writes_var(body, name);
+}
+
+static int loop_index_window(Codegen *cg, ASTNode *loop, IndexWindow *w) {
+    ASTNode *cond = loop->left;
+    int32_t c;
+    if (cg->fn) return 0;   /* the verifier proves ranges for main only */
+    if (!is_comparison(cond) || cond->left->type != NODE_VAR ||
+        !constant_value(cg, cond->right, &c)) {
+        return 0;
+    }
+    /* Straight-line code since the PUSH_STORE: nothing jumps past it */
+    int slot = codegen_var_slot(cg->prog, cond->left->varName);
+    int i = cg->init_count - 1;
+    while (i >= 0 && cg->inits[i].slot != slot) i--;
+    if (i < 0 || cg->last_label >= cg->inits[i].end) return 0;
+
+    int64_t c0 = cg->inits[i].value, lo, hi;
+    int dir;
+    switch (cond->value) {
+        case OP_LT: lo = c0; hi = (int64_t)c - 1; dir = 1; break;
+        case OP_LE: lo = c0; hi = c; dir = 1; break;
+        case OP_GT: lo = (int64_t)c + 1; hi = c0; dir = -1; break;
+        case OP_GE: lo = c; hi = c0; dir = -1; break;
+        default: return 0;
+    }
+    int64_t total = 0;
+    if (lo > hi || !index_steps(loop->right, cond->left->varName, dir, lo, hi, &total)) {
+        return 0;
+    }
+    w->slot = slot;
+    w->lo = lo;
+    w->hi = hi;
+    w->open = 1;
+    return 1;
+}
+
+static void close_windows(Codegen *cg, int slot) {
+    for (int i = 0; i < cg->window_count; i++) {
+        if (cg->windows[i].slot == slot) cg->windows[i].open = 0;
+    }
+}
+
+/* a[index] may skip its bounds check: sets *slot to the index slot */
+static int index_in_window(Codegen *cg, ASTNode *index, const ArrayInfo *arr, int *slot) {
+    if (index->type != NODE_VAR) return 0;
+    int s = codegen_var_slot(cg->prog, index->varName);
+    int i = cg->window_count - 1;
+    while (i >= 0 && !(cg->windows[i].open && cg->windows[i].slot == s)) i--;
+    if (i < 0 || cg->windows[i].lo < 0 || cg->windows[i].hi >= arr->length) return 0;
+
+    /* The verifier tracks a bounded number of index slots */
+    int j = 0;
+    while (j < cg->element_slot_count && cg->element_slots[j] != s) j++;
+    if (j == cg->element_slot_count) {
+        if (j == VM_INDEX_SLOTS) return 0;
+        cg->element_slots[cg->element_slot_count++] = s;
+    }
+    *slot = s;
+    return 1;
+}
+
+static void codegen_element(Codegen *cg, ASTNode *node) {
+    ArrayInfo *arr = find_array(cg->prog, node->varName);
+    int slot;
+    int store = node->type == NODE_INDEX_ASSIGN;
+    if (index_in_window(cg, node->left, arr, &slot)) {
+        if (store) codegen_node(cg, node->right);
+        map_subtree(cg, node->left);
+        emit_array_op(cg, store ? EMIT_STORE_ELEM : EMIT_LOAD_ELEM, arr);
+        emit_int32(cg, slot);
+        stack_change(cg, store ? -1 : 1);
+        return;
+    }
+    codegen_node(cg, node->left);
+    if (store) codegen_node(cg, node->right);
+    emit_array_op(cg, store ? EMIT_STORE_IDX : EMIT_LOAD_IDX, arr);
+    stack_change(cg, store ? -2 : 0);
+}
+
+/*
+ * Counted loops. A while loop whose condition compares a global i with a
+ * constant or another global, and whose body ends by stepping i by one
+ * towards the limit, is lowered as
+ *
+ *             jump to done unless cond
+ *     top:    body without the step
+ *             LOOP_INC / LOOP_DEC top, i, limit
+ *     done:
+ *
+ * so the step, the test and the branch back cost one dispatch per
+ * iteration. A for loop desugars to exactly this shape. The LOOP forms
+ * compare strictly: i <= c becomes i < c + 1 and i >= c becomes
+ * i > c - 1, and a variable limit has to use < or >.
+ */
+typedef struct {
+    uint8_t opcode;
+    int slot;
+    int32_t limit;      /* the constant, or the limit's slot for the _M forms */
+    ASTNode *rest;      /* the body before the step, or NULL */
+    ASTNode *step;
+} CountedLoop;
+
+static int counted_loop(Codegen *cg, ASTNode *loop, CountedLoop *cl) {
+    ASTNode *cond = loop->left, *body = loop->right;
+    if (!body || !is_comparison(cond) || cond->left->type != NODE_VAR) return 0;
+    const char *name = cond->left->varName;
+    if (local_index(cg, name) >= 0) return 0;
+
+    ASTNode *step = body->type == NODE_SEQ ? body->right : body;
+    int32_t k, c;
+    if ((step->type != NODE_ASSIGN && step->type != NODE_DECL) ||
+        strcmp(step->varName, name) != 0 || !step->left ||
+        !fused_increment(name, step->left, &k) || (k != 1 && k != -1)) {
+        return 0;
+    }
+
+    if (constant_value(cg, cond->right, &c)) {
+        switch (cond->value) {
+            case OP_LT: if (k < 0) return 0; break;
+            case OP_LE: if (k < 0 || c == INT32_MAX) return 0; c++; break;
+            case OP_GT: if (k > 0) return 0; break;
+            case OP_GE: if (k > 0 || c == INT32_MIN) return 0; c--; break;
+            default: return 0;
+        }
+        cl->opcode = k > 0 ? EMIT_LOOP_INC : EMIT_LOOP_DEC;
+        cl->limit = c;
+    } else if (cond->right->type == NODE_VAR && local_index(cg, cond->right->varName) < 0 &&
+               cond->value == (k > 0 ? OP_LT : OP_GT)) {
+        cl->opcode = k > 0 ? EMIT_LOOP_INC_M : EMIT_LOOP_DEC_M;
+        cl->limit = find_or_add_var(cg, cond->right->varName);
+    } else {
+        return 0;
+    }
+    cl->slot = find_or_add_var(cg, name);
+    cl->rest = body->type == NODE_SEQ ? body->left : NULL;
+    cl->step = step;
+    return 1;
+}
+
+/* The step's source lines go on the LOOP record */
+static void emit_loop_op(Codegen *cg, const CountedLoop *cl, int top) {
+    map_subtree(cg, cl->step);
+    emit_byte(cg, cl->opcode);
+    emit_int32(cg, top);
+    emit_int32(cg, cl->slot);
+    emit_int32(cg, cl->limit);
+}
+
+/* CALL or TAIL to `fn` with its arguments pushed; the entry is patched
+   in by patch_calls(). The callee may write any global, so no PUSH_STORE
+   before the call still describes a loop index. */
+static void emit_call_op(Codegen *cg, uint8_t op, const FunctionInfo *fn) {
+    if (cg->call_count >= cg->call_capacity) {
+        int cap = cg->call_capacity ? cg->call_capacity * 2 : 16;
+        CallPatch *calls = realloc(cg->calls, cap * sizeof(CallPatch));
+        if (!calls) {
+            codegen_oom(cg, "calls");
+            return;
+        }
+        cg->calls = calls;
+        cg->call_capacity = cap;
+    }
+    emit_byte(cg, op);
+    cg->calls[cg->call_count].at = current_offset(cg);
+    cg->calls[cg->call_count++].function = (int)(fn - cg->prog->functions);
+    emit_int32(cg, 0);
+    cg->init_count = 0;
+    stack_change(cg, (op == EMIT_CALL) - fn->params);
+}
+
+static void codegen_call(Codegen *cg, ASTNode *call, const FunctionInfo *fn, uint8_t op) {
+    for (ASTNode *a = call->left; a; a = a->next) codegen_node(cg, a);
+    emit_call_op(cg, op, fn);
+}
+
+/* OP_NATIVE; the arguments are already pushed */
+static void emit_native(Codegen *cg, ASTNode *call) {
+    int argc = call_argument_count(call);
+    emit_byte(cg, EMIT_NATIVE);
+    emit_int32(cg, native_index(cg->prog, call->varName));
+    emit_int32(cg, argc);
+    stack_change(cg, 1 - argc);
+}
+
+/* Push an array argument's base slot; returns 0 for any other argument */
+static int push_array_argument(Codegen *cg, ASTNode *arg) {
+    int32_t base;
+    if (!array_argument(cg, arg, &base)) return 0;
+    emit_byte(cg, EMIT_PUSH);
+    emit_int32(cg, base);
+    stack_change(cg, 1);
+    return 1;
+}
+
+static void codegen_node(Codegen *cg, ASTNode *node) {
+    if (!node) return;
+
+    if (node->line_number > 0 && node->type != NODE_FUNC) {
+        add_source_map(cg, node->line_number);
     }
 
     switch (node->type) {
         case NODE_INT:
-            emit_byte(EMIT_PUSH);
-            emit_int32(node->value);
+            emit_byte(cg, EMIT_PUSH);
+            emit_int32(cg, node->value);
+            stack_change(cg, 1);
             break;
 
         case NODE_VAR: {
-            int slot = find_or_add_var(node->varName);
-            emit_byte(EMIT_LOAD);
-            emit_int32(slot);
+            int k = local_index(cg, node->varName);
+            if (k >= 0) {
+                emit_byte(cg, EMIT_LOAD_LOCAL);
+                emit_int32(cg, k);
+            } else {
+                emit_byte(cg, EMIT_LOAD);
+                emit_int32(cg, find_or_add_var(cg, node->varName));
+            }
+            stack_change(cg, 1);
             break;
         }
 
-        case NODE_OP:
-            codegen_node(node->left);
-            codegen_node(node->right);
+        case NODE_READ:
+        case NODE_EOF:
+            emit_byte(cg, node->type == NODE_READ ? EMIT_READ : EMIT_EOF);
+            stack_change(cg, 1);
+            break;
+
+        case NODE_OP: {
+            int32_t k;
+            uint8_t pow2 = (uint8_t)pow2_divide(node, &k, 0);
+            if (pow2) {
+                codegen_node(cg, node->left);
+                emit_byte(cg, pow2);
+                emit_int32(cg, k);
+                break;
+            }
+            if (try_load2_op(cg, node)) break;
+            codegen_node(cg, node->left);
+            codegen_node(cg, node->right);
             switch (node->value) {
-                case OP_ADD: emit_byte(EMIT_ADD); break;
-                case OP_SUB: emit_byte(EMIT_SUB); break;
-                case OP_MUL: emit_byte(EMIT_MUL); break;
-                case OP_DIV: emit_byte(EMIT_DIV); break;
-                case OP_LT:  emit_byte(EMIT_CMP); break;
-                case OP_GT:  emit_byte(EMIT_CMP_GT); break;
-                case OP_LE:  emit_byte(EMIT_CMP_LE); break;
-                case OP_GE:  emit_byte(EMIT_CMP_GE); break;
-                case OP_EQ:  emit_byte(EMIT_CMP_EQ); break;
-                case OP_NEQ: emit_byte(EMIT_CMP_NE); break;
+                case OP_ADD: emit_byte(cg, EMIT_ADD); break;
+                case OP_SUB: emit_byte(cg, EMIT_SUB); break;
+                case OP_MUL: emit_byte(cg, EMIT_MUL); break;
+                case OP_DIV: emit_byte(cg, EMIT_DIV); break;
+                case OP_MOD: emit_byte(cg, EMIT_MOD); break;
+                case OP_AND: emit_byte(cg, EMIT_AND); break;
+                case OP_OR:  emit_byte(cg, EMIT_OR); break;
+                case OP_XOR: emit_byte(cg, EMIT_XOR); break;
+                case OP_SHL: emit_byte(cg, EMIT_SHL); break;
+                case OP_SHR: emit_byte(cg, EMIT_SHR); break;
+                case OP_LT:  emit_byte(cg, EMIT_CMP); break;
+                case OP_GT:  emit_byte(cg, EMIT_CMP_GT); break;
+                case OP_LE:  emit_byte(cg, EMIT_CMP_LE); break;
+                case OP_GE:  emit_byte(cg, EMIT_CMP_GE); break;
+                case OP_EQ:  emit_byte(cg, EMIT_CMP_EQ); break;
+                case OP_NEQ: emit_byte(cg, EMIT_CMP_NE); break;
             }
+            stack_change(cg, -1);
             break;
+        }
 
         case NODE_DECL: {
-            int slot = find_or_add_var(node->varName);
+            int k = local_index(cg, node->varName);
+            if (k >= 0) {
+                if (node->left) {
+                    codegen_node(cg, node->left);
+                } else {
+                    emit_byte(cg, EMIT_PUSH);
+                    emit_int32(cg, 0);
+                    stack_change(cg, 1);
+                }
+                emit_byte(cg, EMIT_STORE_LOCAL);
+                emit_int32(cg, k);
+                stack_change(cg, -1);
+                break;
+            }
+            int slot = find_or_add_var(cg, node->varName);
+            close_windows(cg, slot);
+            forget_init(cg, slot);
+            if (node->left && try_fused_store(cg, node->varName, node->left)) break;
             if (node->left) {
-                codegen_node(node->left);
+                codegen_node(cg, node->left);
             } else {
-                emit_byte(EMIT_PUSH);
-                emit_int32(0);
+                emit_byte(cg, EMIT_PUSH);
+                emit_int32(cg, 0);
+                stack_change(cg, 1);
             }
-            emit_byte(EMIT_STORE);
-            emit_int32(slot);
+            emit_byte(cg, EMIT_STORE);
+            emit_int32(cg, slot);
+            stack_change(cg, -1);
             break;
         }
 
         case NODE_ASSIGN: {
-            int slot = find_or_add_var(node->varName);
-            codegen_node(node->left);
-            emit_byte(EMIT_STORE);
-            emit_int32(slot);
+            int k = local_index(cg, node->varName);
+            if (k >= 0) {
+                codegen_node(cg, node->left);
+                emit_byte(cg, EMIT_STORE_LOCAL);
+                emit_int32(cg, k);
+                stack_change(cg, -1);
+                break;
+            }
+            int slot = find_or_add_var(cg, node->varName);
+            close_windows(cg, slot);
+            forget_init(cg, slot);
+            if (try_fused_store(cg, node->varName, node->left)) break;
+            codegen_node(cg, node->left);
+            emit_byte(cg, EMIT_STORE);
+            emit_int32(cg, slot);
+            stack_change(cg, -1);
             break;
         }
 
         case NODE_PRINT:
-            codegen_node(node->left);
-            emit_byte(EMIT_PRINT);
+            codegen_node(cg, node->left);
+            emit_byte(cg, EMIT_PRINT);
+            stack_change(cg, -1);
             break;
 
         case NODE_IF: {
-            codegen_node(node->left);  /* condition */
-            emit_byte(EMIT_JZ);
-            int jz_patch = current_offset();
-            emit_int32(0);  /* placeholder */
+            int jz_patch = emit_jump_if_false(cg, node->left);  /* condition */
+            int entry_depth = cg->depth;
 
-            codegen_node(node->right);  /* then branch */
+            codegen_node(cg, node->right);  /* then branch */
+            int then_depth = cg->depth;
 
             if (node->extra) {
-                emit_byte(EMIT_JMP);
-                int jmp_patch = current_offset();
-                emit_int32(0);
-                patch_int32(jz_patch, current_offset());
-                codegen_node(node->extra);  /* else branch */
-                patch_int32(jmp_patch, current_offset());
+                emit_byte(cg, EMIT_JMP);
+                int jmp_patch = current_offset(cg);
+                emit_int32(cg, 0);
+                patch_here(cg, jz_patch);
+                cg->depth = entry_depth;
+                codegen_node(cg, node->extra);  /* else branch */
+                patch_here(cg, jmp_patch);
             } else {
-                patch_int32(jz_patch, current_offset());
+                patch_here(cg, jz_patch);
+                cg->depth = entry_depth;
             }
+            /* Branches leaving different depths only happen with
+               expression statements; keep the larger as the bound */
+            if (then_depth > cg->depth) cg->depth = then_depth;
             break;
         }
 
         case NODE_WHILE: {
-            int loop_start = current_offset();
-            codegen_node(node->left);  /* condition */
-            emit_byte(EMIT_JZ);
-            int jz_patch = current_offset();
-            emit_int32(0);
+            IndexWindow w;
+            CountedLoop cl;
+            int counted = counted_loop(cg, node, &cl);
+            int windowed = cg->window_count < MAX_INDEX_WINDOWS &&
+                           loop_index_window(cg, node, &w);
+            int loop_start = current_offset(cg);
+            int entry_depth = cg->depth;
+            int jz_patch = emit_jump_if_false(cg, node->left);  /* condition */
 
-            codegen_node(node->right);  /* body */
-            emit_byte(EMIT_JMP);
-            emit_int32(loop_start);
+            if (counted) {
+                loop_start = current_offset(cg);
+                cg->last_label = loop_start;
+            }
+            if (windowed) cg->windows[cg->window_count++] = w;
+            codegen_node(cg, counted ? cl.rest : node->right);  /* body */
+            if (windowed) cg->window_count--;
+            if (counted) {
+                emit_loop_op(cg, &cl, loop_start);
+                close_windows(cg, cl.slot);
+                forget_init(cg, cl.slot);
+            } else {
+                emit_byte(cg, EMIT_JMP);
+                emit_int32(cg, loop_start);
+            }
+            if (cg->depth > entry_depth) cg->unbounded = 1;
 
-            patch_int32(jz_patch, current_offset());
+            patch_here(cg, jz_patch);
             break;
         }
 
         case NODE_SEQ:
-            codegen_node(node->left);
-            codegen_node(node->right);
+            codegen_node(cg, node->left);
+            codegen_node(cg, node->right);
+            break;
+
+        case NODE_ARRAY_DECL: {
+            ArrayInfo *arr = find_array(cg->prog, node->varName);
+            emit_byte(cg, EMIT_PUSH);
+            emit_int32(cg, 0);
+            stack_change(cg, 1);
+            emit_array_op(cg, EMIT_FILL, arr);
+            stack_change(cg, -1);
             break;
+        }
+
+        case NODE_INDEX:
+        case NODE_INDEX_ASSIGN:
+            codegen_element(cg, node);
+            break;
+
+        case NODE_CALL: {
+            const FunctionInfo *fn = find_function(cg->prog, node->varName);
+            if (fn) {
+                codegen_call(cg, node, fn, EMIT_CALL);
+                if (node->value) {      /* statement: drop the result */
+                    emit_byte(cg, EMIT_POP);
+                    stack_change(cg, -1);
+                }
+                break;
+            }
+            const Builtin *b = find_builtin(node->varName);
+            if (b) {
+                for (ASTNode *a = call_argument(node, b->arrays); a; a = a->next) {
+                    codegen_node(cg, a);
+                }
+                emit_builtin(cg, node);
+            } else {
+                for (ASTNode *a = node->left; a; a = a->next) {
+                    if (!push_array_argument(cg, a)) codegen_node(cg, a);
+                }
+                emit_native(cg, node);
+            }
+            if (node->value) {          /* statement: drop the result */
+                emit_byte(cg, EMIT_POP);
+                stack_change(cg, -1);
+            }
+            break;
+        }
+
+        case NODE_FUNC:     /* emitted after HALT by emit_functions() */
+            break;
+
+        case NODE_RETURN: {
+            ASTNode *value = node->left;
+            const FunctionInfo *callee =
+                value && value->type == NODE_CALL ? find_function(cg->prog, value->varName) : NULL;
+            if (callee) {
+                if (value->line_number > 0) add_source_map(cg, value->line_number);
+                codegen_call(cg, value, callee, EMIT_TAIL);
+                break;
+            }
+            if (value) {
+                codegen_node(cg, value);
+            } else {
+                emit_byte(cg, EMIT_PUSH);
+                emit_int32(cg, 0);
+                stack_change(cg, 1);
+            }
+            emit_byte(cg, EMIT_RETURN);
+            stack_change(cg, -1);
+            break;
+        }
+    }
+}
+
+static int ends_with_return(ASTNode *body) {
+    while (body && body->type == NODE_SEQ) body = body->right;
+    return body && body->type == NODE_RETURN;
+}
+
+/* Bodies go after the main program, always in the stack forms. Depths
+   inside count from fp, so a frame starts with its locals in place. */
+static void emit_functions(Codegen *cg, ASTNode *node) {
+    if (!node) return;
+    if (node->type == NODE_SEQ) {
+        emit_functions(cg, node->left);
+        emit_functions(cg, node->right);
+        return;
+    }
+    if (node->type != NODE_FUNC || !node->value) return;
+
+    FunctionInfo *fn = find_function(cg->prog, node->varName);
+    fn->entry = current_offset(cg);
+    cg->fn = fn;
+    cg->depth = fn->local_count;
+    cg->init_count = 0;
+    if (node->line_number > 0) add_source_map(cg, node->line_number);
+    emit_byte(cg, EMIT_ENTER);
+    emit_int32(cg, fn->params);
+    emit_int32(cg, fn->local_count - fn->params);
+    codegen_node(cg, node->right);
+    if (!ends_with_return(node->right)) {
+        emit_byte(cg, EMIT_PUSH);
+        emit_int32(cg, 0);
+        emit_byte(cg, EMIT_RETURN);
+    }
+    cg->fn = NULL;
+}
+
+static void patch_calls(Codegen *cg) {
+    for (int i = 0; i < cg->call_count; i++) {
+        patch_int32(cg, cg->calls[i].at, cg->prog->functions[cg->calls[i].function].entry);
+    }
+    free(cg->calls);
+}
+
+BytecodeProgram *codegen_compile(ASTNode *root, const NativeLib *natives) {
+    Codegen state = {0};
+    Codegen *cg = &state;
+    cg->natives = natives;
+    cg->prog = calloc(1, sizeof(BytecodeProgram));
+    if (!cg->prog) return NULL;
+    cg->prog->code = malloc(MAX_CODE_SIZE);
+    if (!cg->prog->code) {
+        codegen_free(cg->prog);
+        return NULL;
+    }
+    cg->last_label = -1;
+
+    declare_functions(cg, root);
+    collect(cg, root, CTX_STATEMENT);
+    if (cg->failed) {
+        codegen_free(cg->prog);
+        return NULL;
+    }
+    place_arrays(cg);
+
+    codegen_node(cg, root);
+    emit_byte(cg, EMIT_HALT);
+    cg->prog->max_stack_depth = cg->unbounded ? -1 : cg->max_depth;
+    emit_functions(cg, root);
+    patch_calls(cg);
+
+    if (cg->failed) {
+        codegen_free(cg->prog);
+        return NULL;
+    }
+    cg->prog->memory_slots = cg->prog->var_count + cg->array_slots;
+    return cg->prog;
+}
+
+/* ===== Register engine lowering =====
+ *
+ * Memory slots are laid out as [variables][arrays][constants][temporaries].
+ * collect(cg) gives every integer literal used as an operand a constant
+ * slot, initialised by a prologue of R_MOVI instructions. Temporaries are
+ * allocated stack-wise and released at the end of each statement. Array
+ * accesses and builtins have no register forms: they go through the
+ * operand stack, always with their bounds checked.
+ */
+static int reg_const_index(Codegen *cg, int32_t value) {
+    for (int i = 0; i < cg->const_count; i++) {
+        if (cg->consts[i] == value) return i;
+    }
+    if (cg->const_count >= cg->const_capacity) {
+        int cap = cg->const_capacity ? cg->const_capacity * 2 : 16;
+        int32_t *consts = realloc(cg->consts, cap * sizeof(int32_t));
+        if (!consts) {
+            cg->failed = 1;
+            return 0;
+        }
+        cg->consts = consts;
+        cg->const_capacity = cap;
+    }
+    cg->consts[cg->const_count] = value;
+    return cg->const_count++;
+}
+
+/* Only valid after collect(cg), once var_count is final */
+static int reg_const_slot(Codegen *cg, int32_t value) {
+    return cg->prog->var_count + cg->array_slots + reg_const_index(cg, value);
+}
+
+static int reg_first_temp(Codegen *cg) {
+    return cg->prog->var_count + cg->array_slots + cg->const_count;
+}
+
+static int reg_new_temp(Codegen *cg) {
+    int slot = reg_first_temp(cg) + cg->temp_top++;
+    if (cg->temp_top > cg->temp_max) cg->temp_max = cg->temp_top;
+    return slot;
+}
+
+static void emit_reg3(Codegen *cg, uint8_t op, int a, int b, int c) {
+    emit_byte(cg, op);
+    emit_int32(cg, a);
+    emit_int32(cg, b);
+    emit_int32(cg, c);
+}
+
+static uint8_t reg_binary_opcode(int op) {
+    switch (op) {
+        case OP_ADD: return EMIT_R_ADD;
+        case OP_SUB: return EMIT_R_SUB;
+        case OP_MUL: return EMIT_R_MUL;
+        case OP_DIV: return EMIT_R_DIV;
+        case OP_MOD: return EMIT_R_MOD;
+        case OP_AND: return EMIT_R_AND;
+        case OP_OR:  return EMIT_R_OR;
+        case OP_XOR: return EMIT_R_XOR;
+        case OP_SHL: return EMIT_R_SHL;
+        case OP_SHR: return EMIT_R_SHR;
+        case OP_LT:  return EMIT_R_LT;
+        case OP_GT:  return EMIT_R_GT;
+        case OP_LE:  return EMIT_R_LE;
+        case OP_GE:  return EMIT_R_GE;
+        case OP_EQ:  return EMIT_R_EQ;
+        default:     return EMIT_R_NE;
     }
 }
 
-BytecodeProgram *codegen_compile(ASTNode *root) {
-    prog = calloc(1, sizeof(BytecodeProgram));
+static int reg_expr(Codegen *cg, ASTNode *node, int dst);
+static void reg_push(Codegen *cg, ASTNode *node);
+
+/* Calls keep the stack forms: arguments pushed, the result left on top */
+static void reg_call(Codegen *cg, ASTNode *call, const FunctionInfo *fn) {
+    int saved_top = cg->temp_top;
+    for (ASTNode *a = call->left; a; a = a->next) reg_push(cg, a);
+    cg->temp_top = saved_top;
+    emit_call_op(cg, EMIT_CALL, fn);
+}
+
+/* Natives take their arguments on the stack like calls */
+static void reg_native(Codegen *cg, ASTNode *call) {
+    int saved_top = cg->temp_top;
+    for (ASTNode *a = call->left; a; a = a->next) {
+        if (!push_array_argument(cg, a)) reg_push(cg, a);
+    }
+    cg->temp_top = saved_top;
+    emit_native(cg, call);
+}
+
+/* Push a value for the stack forms of the array opcodes */
+static void reg_push(Codegen *cg, ASTNode *node) {
+    int32_t value;
+    if (constant_value(cg, node, &value)) {
+        if (node->line_number > 0) add_source_map(cg, node->line_number);
+        emit_byte(cg, EMIT_PUSH);
+        emit_int32(cg, value);
+    } else {
+        int s = reg_expr(cg, node, -1);
+        emit_byte(cg, EMIT_LOAD);
+        emit_int32(cg, s);
+    }
+    stack_change(cg, 1);
+}
+
+/* Pop the value a stack form left into dst, or a new temporary */
+static int reg_pop(Codegen *cg, int dst) {
+    int d = dst >= 0 ? dst : reg_new_temp(cg);
+    emit_byte(cg, EMIT_STORE);
+    emit_int32(cg, d);
+    stack_change(cg, -1);
+    return d;
+}
+
+/* Evaluate an expression and return the slot holding its value. If dst
+   is >= 0 the final result is written there. */
+static int reg_expr(Codegen *cg, ASTNode *node, int dst) {
+    if (node->line_number > 0) add_source_map(cg, node->line_number);
+
+    int32_t value;
+    switch (node->type) {
+        case NODE_INT:
+        case NODE_CALL: {
+            const FunctionInfo *fn = node->type == NODE_CALL ?
+                find_function(cg->prog, node->varName) : NULL;
+            if (fn) {
+                reg_call(cg, node, fn);
+                return reg_pop(cg, dst);
+            }
+            if (constant_value(cg, node, &value)) {
+                if (dst >= 0) {
+                    emit_byte(cg, EMIT_R_MOVI);
+                    emit_int32(cg, dst);
+                    emit_int32(cg, value);
+                    return dst;
+                }
+                return reg_const_slot(cg, value);
+            }
+            if (!find_builtin(node->varName)) {
+                reg_native(cg, node);
+                return reg_pop(cg, dst);
+            }
+            /* sum(), dot() take no operands; pair() and left() take
+               their values on the stack */
+            int saved_top = cg->temp_top;
+            for (ASTNode *a = call_argument(node, find_builtin(node->varName)->arrays); a;
+                 a = a->next) {
+                reg_push(cg, a);
+            }
+            cg->temp_top = saved_top;
+            emit_builtin(cg, node);
+            return reg_pop(cg, dst);
+        }
+
+        case NODE_INDEX: {
+            int saved_top = cg->temp_top;
+            reg_push(cg, node->left);
+            emit_array_op(cg, EMIT_LOAD_IDX, find_array(cg->prog, node->varName));
+            cg->temp_top = saved_top;
+            return reg_pop(cg, dst);
+        }
+
+        case NODE_VAR: {
+            int slot = find_or_add_var(cg, node->varName);
+            if (dst >= 0 && dst != slot) {
+                emit_byte(cg, EMIT_R_MOV);
+                emit_int32(cg, dst);
+                emit_int32(cg, slot);
+                return dst;
+            }
+            return slot;
+        }
+
+        case NODE_READ:
+        case NODE_EOF: {
+            int d = dst >= 0 ? dst : reg_new_temp(cg);
+            emit_byte(cg, node->type == NODE_READ ? EMIT_R_READ : EMIT_R_EOF);
+            emit_int32(cg, d);
+            return d;
+        }
+
+        case NODE_OP: {
+            int saved_top = cg->temp_top;
+            int32_t k;
+            uint8_t pow2 = (uint8_t)pow2_divide(node, &k, 1);
+            int a = reg_expr(cg, node->left, -1);
+            if (pow2) {
+                cg->temp_top = saved_top;
+                int d = dst >= 0 ? dst : reg_new_temp(cg);
+                emit_reg3(cg, pow2, d, a, k);
+                return d;
+            }
+            int b = reg_expr(cg, node->right, -1);
+            /* Operands are read before the result is written, so the
+               result may reuse this node's temporaries. */
+            cg->temp_top = saved_top;
+            int d = dst >= 0 ? dst : reg_new_temp(cg);
+            emit_reg3(cg, reg_binary_opcode(node->value), d, a, b);
+            return d;
+        }
+
+        default:
+            /* Statements are not expressions; lower them for effect */
+            fprintf(stderr, "codegen: unexpected node in expression\n");
+            cg->failed = 1;
+            return 0;
+    }
+}
+
+static void reg_node(Codegen *cg, ASTNode *node);
+
+/* Jump over the block when `cond` is false; returns the patch offset */
+static int reg_jump_if_false(Codegen *cg, ASTNode *cond) {
+    int saved_top = cg->temp_top;
+    int patch;
+    if (is_comparison(cond)) {
+        if (cond->line_number > 0) add_source_map(cg, cond->line_number);
+        int a = reg_expr(cg, cond->left, -1);
+        int b = reg_expr(cg, cond->right, -1);
+        uint8_t op;
+        switch (cond->value) {
+            case OP_LT:  op = EMIT_R_JZ_LT; break;
+            case OP_GT:  op = EMIT_R_JZ_GT; break;
+            case OP_LE:  op = EMIT_R_JZ_LE; break;
+            case OP_GE:  op = EMIT_R_JZ_GE; break;
+            case OP_EQ:  op = EMIT_R_JZ_EQ; break;
+            default:     op = EMIT_R_JZ_NE; break;
+        }
+        emit_byte(cg, op);
+        patch = current_offset(cg);
+        emit_int32(cg, 0);
+        emit_int32(cg, a);
+        emit_int32(cg, b);
+    } else {
+        int s = reg_expr(cg, cond, -1);
+        emit_byte(cg, EMIT_R_JZ);
+        patch = current_offset(cg);
+        emit_int32(cg, 0);
+        emit_int32(cg, s);
+    }
+    cg->temp_top = saved_top;
+    return patch;
+}
+
+static void reg_node(Codegen *cg, ASTNode *node) {
+    if (!node) return;
+
+    switch (node->type) {
+        case NODE_INT:
+        case NODE_VAR:
+        case NODE_OP:
+        case NODE_READ:
+        case NODE_EOF:
+        case NODE_INDEX:
+            /* Expression statement: evaluate for its effects (read()) */
+            reg_expr(cg, node, -1);
+            cg->temp_top = 0;
+            return;
+        case NODE_FUNC:
+            return;
+        case NODE_CALL:
+            if (find_function(cg->prog, node->varName)) {
+                if (node->line_number > 0) add_source_map(cg, node->line_number);
+                reg_call(cg, node, find_function(cg->prog, node->varName));
+                emit_byte(cg, EMIT_POP);
+                stack_change(cg, -1);
+                cg->temp_top = 0;
+                return;
+            }
+            if (!find_builtin(node->varName)) {
+                if (node->line_number > 0) add_source_map(cg, node->line_number);
+                reg_native(cg, node);
+                emit_byte(cg, EMIT_POP);
+                stack_change(cg, -1);
+                cg->temp_top = 0;
+                return;
+            }
+            if (find_builtin(node->varName)->has_value) {
+                reg_expr(cg, node, -1);
+                cg->temp_top = 0;
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (node->line_number > 0) {
+        add_source_map(cg, node->line_number);
+    }
+
+    switch (node->type) {
+        case NODE_DECL:
+        case NODE_ASSIGN: {
+            int slot = find_or_add_var(cg, node->varName);
+            if (node->left) {
+                reg_expr(cg, node->left, slot);
+            } else {
+                emit_byte(cg, EMIT_R_MOVI);
+                emit_int32(cg, slot);
+                emit_int32(cg, 0);
+            }
+            cg->temp_top = 0;
+            break;
+        }
+
+        case NODE_PRINT: {
+            int s = reg_expr(cg, node->left, -1);
+            emit_byte(cg, EMIT_R_PRINT);
+            emit_int32(cg, s);
+            cg->temp_top = 0;
+            break;
+        }
+
+        case NODE_IF: {
+            int jz_patch = reg_jump_if_false(cg, node->left);
+            reg_node(cg, node->right);
+            if (node->extra) {
+                emit_byte(cg, EMIT_JMP);
+                int jmp_patch = current_offset(cg);
+                emit_int32(cg, 0);
+                patch_here(cg, jz_patch);
+                reg_node(cg, node->extra);
+                patch_here(cg, jmp_patch);
+            } else {
+                patch_here(cg, jz_patch);
+            }
+            break;
+        }
+
+        case NODE_WHILE: {
+            CountedLoop cl;
+            int counted = counted_loop(cg, node, &cl);
+            int loop_start = current_offset(cg);
+            int jz_patch = reg_jump_if_false(cg, node->left);
+            if (counted) {
+                loop_start = current_offset(cg);
+                reg_node(cg, cl.rest);
+                emit_loop_op(cg, &cl, loop_start);
+            } else {
+                reg_node(cg, node->right);
+                emit_byte(cg, EMIT_JMP);
+                emit_int32(cg, loop_start);
+            }
+            patch_here(cg, jz_patch);
+            break;
+        }
+
+        case NODE_SEQ:
+            reg_node(cg, node->left);
+            reg_node(cg, node->right);
+            break;
+
+        case NODE_ARRAY_DECL:
+            emit_byte(cg, EMIT_PUSH);
+            emit_int32(cg, 0);
+            stack_change(cg, 1);
+            emit_array_op(cg, EMIT_FILL, find_array(cg->prog, node->varName));
+            stack_change(cg, -1);
+            break;
+
+        case NODE_INDEX_ASSIGN:
+            reg_push(cg, node->left);
+            reg_push(cg, node->right);
+            emit_array_op(cg, EMIT_STORE_IDX, find_array(cg->prog, node->varName));
+            stack_change(cg, -2);
+            cg->temp_top = 0;
+            break;
+
+        case NODE_CALL:     /* fill(), copy(), add(), mul(), set_left(), set_right() */
+            for (ASTNode *a = call_argument(node, find_builtin(node->varName)->arrays); a;
+                 a = a->next) {
+                reg_push(cg, a);
+            }
+            emit_builtin(cg, node);
+            cg->temp_top = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+BytecodeProgram *codegen_compile_regs(ASTNode *root, const NativeLib *natives) {
+    Codegen state = {0};
+    Codegen *cg = &state;
+    cg->natives = natives;
+    BytecodeProgram *prog = calloc(1, sizeof(BytecodeProgram));
+    if (!prog) return NULL;
     prog->code = malloc(MAX_CODE_SIZE);
-    prog->code_size = 0;
-    prog->var_count = 0;
-    prog->source_map_count = 0;
+    if (!prog->code) {
+        codegen_free(prog);
+        return NULL;
+    }
+    prog->engine = ENGINE_REG;
+    cg->prog = prog;
+
+    declare_functions(cg, root);
+    collect(cg, root, CTX_STATEMENT);
+    if (cg->failed) {
+        free(cg->consts);
+        codegen_free(prog);
+        return NULL;
+    }
+    place_arrays(cg);
+
+    /* Prologue: load constant slots */
+    for (int i = 0; i < cg->const_count; i++) {
+        emit_byte(cg, EMIT_R_MOVI);
+        emit_int32(cg, prog->var_count + cg->array_slots + i);
+        emit_int32(cg, cg->consts[i]);
+    }
+    int body_start = current_offset(cg);
+
+    reg_node(cg, root);
+    emit_byte(cg, EMIT_HALT);
 
-    codegen_node(root);
-    emit_byte(EMIT_HALT);
+    prog->memory_slots = prog->var_count + cg->array_slots + cg->const_count + cg->temp_max;
+    prog->max_stack_depth = cg->max_depth;   /* only array accesses and calls use the stack */
+    emit_functions(cg, root);
+    patch_calls(cg);
 
-    BytecodeProgram *result = prog;
-    prog = NULL;
-    return result;
+    free(cg->consts);
+
+    if (cg->failed) {
+        codegen_free(prog);
+        return NULL;
+    }
+
+    /* Attribute the prologue to the first statement's line so the
+       debugger starts on the same line as with the stack lowering. */
+    if (body_start > 0 && prog->source_map_count > 0 &&
+        prog->source_map_count < MAX_SOURCE_MAP) {
+        int first_line = codegen_line_for_pc(prog, body_start);
+        memmove(&prog->source_map[1], &prog->source_map[0],
+                prog->source_map_count * sizeof(SourceMapEntry));
+        prog->source_map[0].bytecode_offset = 0;
+        prog->source_map[0].source_line = first_line;
+        prog->source_map_count++;
+    }
+    return prog;
 }
 
 void codegen_free(BytecodeProgram *p) {
     if (!p) return;
     for (int i = 0; i < p->var_count; i++) free(p->var_names[i]);
+    free(p->var_names);
+    for (int i = 0; i < p->array_count; i++) free(p->arrays[i].name);
+    free(p->arrays);
+    for (int i = 0; i < p->function_count; i++) {
+        for (int k = 0; k < p->functions[i].local_count; k++) free(p->functions[i].local_names[k]);
+        free(p->functions[i].local_names);
+        free(p->functions[i].name);
+    }
+    free(p->functions);
+    for (int i = 0; i < p->native_count; i++) free(p->native_names[i]);
+    free(p->native_names);
     free(p->code);
     free(p);
 }
@@ -231,9 +1962,36 @@ const char *codegen_var_name(BytecodeProgram *p, int slot) {
     return p->var_names[slot];
 }
 
+/* The function whose code holds `pc`, or NULL in the main program */
+const FunctionInfo *codegen_function_at(const BytecodeProgram *p, int pc) {
+    const FunctionInfo *best = NULL;
+    for (int i = 0; i < p->function_count; i++) {
+        const FunctionInfo *fn = &p->functions[i];
+        if (fn->entry >= 0 && fn->entry <= pc && (!best || fn->entry > best->entry)) best = fn;
+    }
+    return best;
+}
+
 int codegen_var_slot(BytecodeProgram *p, const char *name) {
     for (int i = 0; i < p->var_count; i++) {
         if (strcmp(p->var_names[i], name) == 0) return i;
     }
     return -1;
 }
+
+/*
+ * Per-program VM region sizes: memory for the slots the program uses and
+ * an operand stack as deep as codegen proved it can get. Programs whose
+ * loops leave values on the stack get the default STACK_SIZE and will
+ * overflow it. Recursion has no static bound, so programs with functions
+ * get CALL_STACK_SIZE and CALL_RETURN_SIZE (two entries per frame).
+ */
+void codegen_vm_limits(const BytecodeProgram *p, VMLimits *limits) {
+    limits->memory_size = p->memory_slots;
+    limits->stack_size = p->max_stack_depth < 0 ? STACK_SIZE : p->max_stack_depth;
+    limits->return_stack_size = 0;
+    if (p->function_count > 0) {
+        limits->stack_size = CALL_STACK_SIZE;
+        limits->return_stack_size = CALL_RETURN_SIZE;
+    }
+}
@@ -10,34 +10,78 @@
 
 #include <stdint.h>
 #include "ast.h"
+#include "vm.h"
+#include "native.h"
 
 #define MAX_CODE_SIZE 4096
-#define MAX_CODEGEN_VARS 128
 #define MAX_SOURCE_MAP 1024
+#define MAX_ARRAY_SLOTS (1 << 22)   /* elements over all arrays of a program */
 
 typedef struct {
     int bytecode_offset;
     int source_line;
 } SourceMapEntry;
 
+/* An array: `length` consecutive memory slots from `base` */
+typedef struct {
+    char *name;
+    int base;
+    int length;
+} ArrayInfo;
+
+/* A function. Its code starts with OP_ENTER at `entry`; frame slot k
+   holds local_names[k], the parameters first */
+typedef struct {
+    char *name;
+    int params;
+    char **local_names;
+    int local_count;        /* parameters + variables declared in the body */
+    int entry;
+    int line;
+} FunctionInfo;
+
+/* Instruction set a program was lowered to (chosen at submit time) */
+typedef enum {
+    ENGINE_STACK,   /* operand-stack bytecode (codegen_compile) */
+    ENGINE_REG      /* three-address register forms (codegen_compile_regs) */
+} CodegenEngine;
+
 typedef struct {
     uint8_t *code;
     int code_size;
+    CodegenEngine engine;
 
-    char *var_names[MAX_CODEGEN_VARS];
+    char **var_names;
     int var_count;
+    int var_capacity;
+
+    ArrayInfo *arrays;      /* slots after the variables, in declaration order */
+    int array_count;
+
+    FunctionInfo *functions;    /* in definition order, after the main code */
+    int function_count;
+
+    char **native_names;    /* natives called, by OP_NATIVE index */
+    int native_count;
+
+    int memory_slots;       /* slots addressed: vars, arrays (+ constants, temps for ENGINE_REG) */
+    int max_stack_depth;    /* operand stack bound; -1 if a loop grows the stack */
 
     SourceMapEntry source_map[MAX_SOURCE_MAP];
     int source_map_count;
 } BytecodeProgram;
 
-BytecodeProgram *codegen_compile(ASTNode *root);
+BytecodeProgram *codegen_compile(ASTNode *root, const NativeLib *natives);
+BytecodeProgram *codegen_compile_regs(ASTNode *root, const NativeLib *natives);
 void codegen_free(BytecodeProgram *prog);
 
 int codegen_line_for_pc(BytecodeProgram *prog, int pc);
 int codegen_pc_for_line(BytecodeProgram *prog, int line);
 
 const char *codegen_var_name(BytecodeProgram *prog, int slot);
+const FunctionInfo *codegen_function_at(const BytecodeProgram *prog, int pc);
 int codegen_var_slot(BytecodeProgram *prog, const char *name);
 
+void codegen_vm_limits(const BytecodeProgram *prog, VMLimits *limits);
+
 #endif
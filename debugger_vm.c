@@ -128,6 +128,7 @@ void debugger_print_regs(Debugger *dbg) {
     printf("PC:  %d\n", dbg->vm->pc);
     printf("SP:  %d\n", dbg->vm->sp);
     printf("RSP: %d\n", dbg->vm->rsp);
+    if (dbg->prog->function_count > 0) printf("FP:  %d\n", dbg->vm->fp);
     int line = codegen_line_for_pc(dbg->prog, dbg->vm->pc);
     printf("Line: %d\n", line);
     printf("Running: %s\n", dbg->vm->running ? "yes" : "no");
@@ -144,8 +145,12 @@ void debugger_print_stack(Debugger *dbg) {
     }
 }
 
+/* Arrays show their first DEBUG_ARRAY_SHOWN elements */
+#define DEBUG_ARRAY_SHOWN 8
+
 void debugger_print_vars(Debugger *dbg) {
-    if (dbg->prog->var_count == 0) {
+    if (dbg->prog->var_count == 0 && dbg->prog->array_count == 0 &&
+        dbg->prog->function_count == 0) {
         printf("No variables\n");
         return;
     }
@@ -154,12 +159,40 @@ void debugger_print_vars(Debugger *dbg) {
         printf("  %s = %d (slot %d)\n",
                dbg->prog->var_names[i], dbg->vm->memory[i], i);
     }
+    for (int i = 0; i < dbg->prog->array_count; i++) {
+        const ArrayInfo *arr = &dbg->prog->arrays[i];
+        printf("  %s[%d] = {", arr->name, arr->length);
+        for (int k = 0; k < arr->length && k < DEBUG_ARRAY_SHOWN; k++) {
+            printf("%s%d", k ? ", " : "", dbg->vm->memory[arr->base + k]);
+        }
+        printf("%s} (slots %d-%d)\n", arr->length > DEBUG_ARRAY_SHOWN ? ", ..." : "",
+               arr->base, arr->base + arr->length - 1);
+    }
+
+    /* Inside a function, past its ENTER: the frame at fp */
+    const FunctionInfo *fn = codegen_function_at(dbg->prog, dbg->vm->pc);
+    if (fn && dbg->vm->pc > fn->entry) {
+        printf("Locals of %s():\n", fn->name);
+        for (int k = 0; k < fn->local_count && dbg->vm->fp + k < dbg->vm->sp; k++) {
+            printf("  %s = %d (fp+%d)\n", fn->local_names[k], dbg->vm->stack[dbg->vm->fp + k], k);
+        }
+    }
 }
 
 void debugger_print_memstat(Debugger *dbg) {
     printf("GC Objects: %d\n", dbg->vm->num_objects);
     printf("GC Threshold: %d\n", dbg->vm->max_objects);
     printf("Auto GC: %s\n", dbg->vm->auto_gc ? "enabled" : "disabled");
+    if (dbg->vm->gc_runs > 0) {
+        printf("GC Runs: %llu (%llu freed, %.3f ms)\n",
+               (unsigned long long)dbg->vm->gc_runs, (unsigned long long)dbg->vm->gc_freed,
+               dbg->vm->gc_ns / 1e6);
+    }
+    for (int i = 0; i < dbg->vm->native_count; i++) {
+        const VMNative *n = &dbg->vm->natives[i];
+        printf("Native %s(): %llu calls, %.3f ms\n", n->name,
+               (unsigned long long)n->calls, n->ns / 1e6);
+    }
 }
 
 void debugger_interactive(Debugger *dbg) {
@@ -190,7 +223,7 @@ void debugger_interactive(Debugger *dbg) {
             printf("  step           - step one instruction\n");
             printf("  next           - step one source line\n");
             printf("  continue       - run until breakpoint or end\n");
-            printf("  regs           - show PC, SP, RSP\n");
+            printf("  regs           - show PC, SP, RSP (and FP)\n");
             printf("  stack          - show stack contents\n");
             printf("  vars           - show variable values\n");
             printf("  memstat        - show GC statistics\n");
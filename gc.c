@@ -1,9 +1,50 @@
-/* Complete GC implementation with closure support */
+/*
+ * gc.c - Mark-and-sweep collector with closure support
+ *
+ * The roots are the words on the operand stack and in memory (see gc.h);
+ * pair fields are words too. Marking works through an explicit gray
+ * stack, so a list of any length is marked without deep recursion.
+ * gc_collect() prints nothing: it counts collections, freed objects and
+ * the time spent, which memstat reports.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "vm.h"  /* Includes gc.h automatically */
 
+/* Room for `need` reference indices, and as many free ones */
+static bool grow_refs(VM *vm, int need) {
+    int cap = vm->ref_capacity ? vm->ref_capacity : 64;
+    while (cap < need) cap *= 2;
+    if (cap > GC_MAX_OBJECTS) cap = GC_MAX_OBJECTS;
+    Object **refs = realloc(vm->refs, cap * sizeof(Object *));
+    if (!refs) return false;
+    vm->refs = refs;
+    int32_t *free_refs = realloc(vm->free_refs, cap * sizeof(int32_t));
+    if (!free_refs) return false;
+    vm->free_refs = free_refs;
+    vm->ref_capacity = cap;
+    return true;
+}
+
+/* Give obj a reference index, reusing a freed one first */
+static bool take_ref(VM *vm, Object *obj) {
+    int32_t ref;
+    if (vm->free_ref_count > 0) {
+        ref = vm->free_refs[--vm->free_ref_count];
+    } else {
+        if (vm->ref_count >= GC_MAX_OBJECTS) return false;
+        if (vm->ref_count >= vm->ref_capacity && !grow_refs(vm, vm->ref_count + 1)) {
+            return false;
+        }
+        ref = vm->ref_count++;
+    }
+    vm->refs[ref] = obj;
+    obj->ref = ref;
+    return true;
+}
+
 Object* gc_alloc_object(VM *vm, ObjectType type) {
     /* Trigger GC if threshold reached and auto_gc is enabled */
     if (vm->auto_gc && vm->num_objects >= vm->max_objects) {
@@ -15,14 +56,18 @@ Object* gc_alloc_object(VM *vm, ObjectType type) {
         fprintf(stderr, "Error: Failed to allocate object\n");
         return NULL;
     }
+    if (!take_ref(vm, obj)) {
+        free(obj);
+        return NULL;
+    }
 
     obj->marked = false;
     obj->type = type;
 
     switch (type) {
         case OBJ_PAIR:
-            obj->pair.left = NULL;
-            obj->pair.right = NULL;
+            obj->pair.left = 0;
+            obj->pair.right = 0;
             break;
         case OBJ_FUNCTION:
             obj->function.function_ptr = NULL;
@@ -44,8 +89,18 @@ void gc_init(VM *vm) {
     vm->first_object = NULL;
     vm->num_objects = 0;
     vm->max_objects = 8;
-    vm->stack_count = 0;
     vm->auto_gc = true;  /* Enable automatic GC by default */
+    vm->refs = NULL;
+    vm->free_refs = NULL;
+    vm->ref_count = 0;
+    vm->ref_capacity = 0;
+    vm->free_ref_count = 0;
+    vm->gray = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gc_runs = 0;
+    vm->gc_freed = 0;
+    vm->gc_ns = 0;
 }
 
 void gc_cleanup(VM *vm) {
@@ -57,9 +112,59 @@ void gc_cleanup(VM *vm) {
     }
     vm->first_object = NULL;
     vm->num_objects = 0;
+
+    free(vm->refs);
+    free(vm->free_refs);
+    free(vm->gray);
+    vm->refs = NULL;
+    vm->free_refs = NULL;
+    vm->ref_count = 0;
+    vm->ref_capacity = 0;
+    vm->free_ref_count = 0;
+    vm->gray = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+}
+
+/* The live object a word names, or NULL for an integer */
+Object* gc_deref(VM *vm, int32_t word) {
+    uint32_t ref = (uint32_t)word - GC_REF_BASE;
+    return ref < (uint32_t)vm->ref_count ? vm->refs[ref] : NULL;
 }
 
-Object* new_pair(VM *vm, Object *left, Object *right) {
+/*
+ * Rebuild the reference table from the object list after the objects
+ * were put back with their old indices (vm_restore()). Returns false if
+ * two objects claim the same index.
+ */
+bool gc_rebuild_refs(VM *vm) {
+    int count = 0;
+    for (Object *obj = vm->first_object; obj; obj = obj->next) {
+        if (obj->ref < 0 || obj->ref >= GC_MAX_OBJECTS) return false;
+        if (obj->ref >= count) count = obj->ref + 1;
+    }
+    vm->ref_count = 0;
+    vm->free_ref_count = 0;
+    if (count > vm->ref_capacity && !grow_refs(vm, count)) return false;
+    for (int i = 0; i < count; i++) vm->refs[i] = NULL;
+    for (Object *obj = vm->first_object; obj; obj = obj->next) {
+        if (vm->refs[obj->ref]) return false;
+        vm->refs[obj->ref] = obj;
+    }
+    vm->ref_count = count;
+    for (int i = count - 1; i >= 0; i--) {
+        if (!vm->refs[i]) vm->free_refs[vm->free_ref_count++] = i;
+    }
+    return true;
+}
+
+Object* new_pair(VM *vm, int32_t left, int32_t right) {
+    /* The fields are off the operand stack by now: keep what they name */
+    if (vm->auto_gc && vm->num_objects >= vm->max_objects) {
+        gc_mark_object(vm, gc_deref(vm, left));
+        gc_mark_object(vm, gc_deref(vm, right));
+        gc_collect(vm);
+    }
     Object *pair = gc_alloc_object(vm, OBJ_PAIR);
     if (!pair) return NULL;
     pair->pair.left = left;
@@ -82,32 +187,56 @@ Object* new_closure(VM *vm, Object *fn, Object *env) {
     return closure;
 }
 
-void gc_mark_object(Object *obj) {
-    if (obj == NULL) return;
-    if (obj->marked) return;
+static void scan_object(VM *vm, Object *obj);
 
+/* Mark obj and queue it for scanning; with no room left on the gray
+   stack it is scanned right away */
+static void gray_object(VM *vm, Object *obj) {
+    if (obj == NULL || obj->marked) return;
     obj->marked = true;
 
+    if (vm->gray_count >= vm->gray_capacity) {
+        int cap = vm->gray_capacity ? vm->gray_capacity * 2 : 256;
+        Object **gray = realloc(vm->gray, cap * sizeof(Object *));
+        if (!gray) {
+            scan_object(vm, obj);
+            return;
+        }
+        vm->gray = gray;
+        vm->gray_capacity = cap;
+    }
+    vm->gray[vm->gray_count++] = obj;
+}
+
+static void scan_object(VM *vm, Object *obj) {
     switch (obj->type) {
         case OBJ_PAIR:
-            gc_mark_object(obj->pair.left);
-            gc_mark_object(obj->pair.right);
+            gray_object(vm, gc_deref(vm, obj->pair.left));
+            gray_object(vm, gc_deref(vm, obj->pair.right));
             break;
         case OBJ_CLOSURE:
-            gc_mark_object(obj->closure.fn);
-            gc_mark_object(obj->closure.env);
+            gray_object(vm, obj->closure.fn);
+            gray_object(vm, obj->closure.env);
             break;
         case OBJ_FUNCTION:
             break;
     }
 }
 
+/* Marks are only kept until the next gc_sweep() */
+void gc_mark_object(VM *vm, Object *obj) {
+    gray_object(vm, obj);
+}
+
 void gc_mark_roots(VM *vm) {
-    for (int i = 0; i < vm->stack_count; i++) {
-        Value *val = &vm->value_stack[i];
-        if (val->type == VAL_OBJ) {
-            gc_mark_object(val->obj_val);
-        }
+    for (int i = 0; i < vm->sp; i++) {
+        gray_object(vm, gc_deref(vm, vm->stack[i]));
+    }
+    for (int i = 0; i < vm->memory_size; i++) {
+        gray_object(vm, gc_deref(vm, vm->memory[i]));
+    }
+    while (vm->gray_count > 0) {
+        scan_object(vm, vm->gray[--vm->gray_count]);
     }
 }
 
@@ -118,6 +247,8 @@ void gc_sweep(VM *vm) {
         if (!(*obj_ptr)->marked) {
             Object *unreached = *obj_ptr;
             *obj_ptr = unreached->next;
+            vm->refs[unreached->ref] = NULL;
+            vm->free_refs[vm->free_ref_count++] = unreached->ref;
             free(unreached);
             vm->num_objects--;
         } else {
@@ -128,34 +259,23 @@ void gc_sweep(VM *vm) {
 }
 
 void gc_collect(VM *vm) {
+    struct timespec start, end;
     int before_count = vm->num_objects;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     gc_mark_roots(vm);
     gc_sweep(vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
     vm->max_objects = vm->num_objects * 2;
     if (vm->max_objects < 8) {
         vm->max_objects = 8;
     }
 
-    printf("[GC] Collected %d objects, %d remaining\n",
-           before_count - vm->num_objects, vm->num_objects);
-}
-
-void push(VM *vm, Value val) {
-    if (vm->stack_count >= VM_STACK_MAX) {
-        fprintf(stderr, "Error: Stack overflow\n");
-        return;
-    }
-    vm->value_stack[vm->stack_count++] = val;
-}
-
-Value pop(VM *vm) {
-    if (vm->stack_count <= 0) {
-        fprintf(stderr, "Error: Stack underflow\n");
-        return VAL_INT(0);
-    }
-    return vm->value_stack[--vm->stack_count];
+    vm->gc_runs++;
+    vm->gc_freed += (uint64_t)(before_count - vm->num_objects);
+    vm->gc_ns += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000LL +
+                            (end.tv_nsec - start.tv_nsec));
 }
 
 void gc(VM *vm) {
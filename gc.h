@@ -13,15 +13,30 @@ typedef enum {
     OBJ_CLOSURE
 } ObjectType;
 
+/*
+ * Heap references are words like any other: the operand stack, memory
+ * and pair fields all hold int32 words, and a reference is
+ * GC_REF_BASE + the object's index in the VM's reference table. A word in
+ * that range is a reference only while it names a live object, so the
+ * collector treats the stack and memory as conservative roots: an integer
+ * that happens to equal a live reference keeps that object alive, and
+ * nothing is ever freed while a word still names it.
+ */
+#define GC_REF_BASE    0x70000000
+#define GC_MAX_OBJECTS (1 << 24)
+
+#define GC_REF(obj) (GC_REF_BASE + (obj)->ref)
+
 typedef struct Object {
     bool marked;
     ObjectType type;
+    int32_t ref;            /* index in the reference table */
     struct Object *next;
 
     union {
         struct {
-            struct Object *left;
-            struct Object *right;
+            int32_t left;   /* words: integers or references */
+            int32_t right;
         } pair;
 
         struct {
@@ -35,35 +50,19 @@ typedef struct Object {
     };
 } Object;
 
-typedef enum {
-    VAL_INT,
-    VAL_OBJ
-} ValueType;
-
-typedef struct Value {
-    ValueType type;
-    union {
-        int32_t int_val;
-        Object *obj_val;
-    };
-} Value;
-
-#define VAL_OBJ(obj) ((Value){.type = VAL_OBJ, .obj_val = (obj)})
-#define VAL_INT(val) ((Value){.type = VAL_INT, .int_val = (val)})
-
 /* GC functions - use struct VM* to avoid typedef issues */
 Object* gc_alloc_object(struct VM *vm, ObjectType type);
 void gc_init(struct VM *vm);
 void gc_cleanup(struct VM *vm);
-Object* new_pair(struct VM *vm, Object *left, Object *right);
+Object* new_pair(struct VM *vm, int32_t left, int32_t right);
 Object* new_function(struct VM *vm);
 Object* new_closure(struct VM *vm, Object *fn, Object *env);
-void gc_mark_object(Object *obj);
+Object* gc_deref(struct VM *vm, int32_t word);
+bool gc_rebuild_refs(struct VM *vm);
+void gc_mark_object(struct VM *vm, Object *obj);
 void gc_mark_roots(struct VM *vm);
 void gc_sweep(struct VM *vm);
 void gc_collect(struct VM *vm);
-void push(struct VM *vm, Value val);
-Value pop(struct VM *vm);
 void gc(struct VM *vm);
 
 /* Control automatic GC triggering */
@@ -0,0 +1,146 @@
+/*
+ * input.c - Integer input for read() and eof() (see input.h)
+ *
+ * Binary files are mapped read-only and advised as sequential, so the
+ * kernel reads ahead and read() is a load from the page cache. Text is
+ * read with read(2) into one INPUT_BLOCK buffer; refill() moves the
+ * held-back tail of the previous block to the front and reads behind it,
+ * so a number is never split and the inline parser never checks for the
+ * end of the buffer inside a number.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "input.h"
+
+static bool is_binary_path(const char *path) {
+    size_t n = strlen(path);
+    return n > 4 && strcmp(path + n - 4, ".bin") == 0;
+}
+
+/* A byte that ends a number and cannot start one */
+static bool is_separator(char c) {
+    return !input_is_digit(c) && c != '-';
+}
+
+static bool map_binary(VMInput *in, const char *path) {
+    struct stat st;
+    if (fstat(in->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: binary input '%s' must be a regular file\n", path);
+        return false;
+    }
+    in->map_len = (size_t)st.st_size;
+    if (in->map_len > 0) {
+        in->map = mmap(NULL, in->map_len, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (in->map == MAP_FAILED) {
+            in->map = NULL;
+            fprintf(stderr, "Error: cannot map '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        madvise(in->map, in->map_len, MADV_SEQUENTIAL);
+    }
+    /* A trailing partial value is ignored */
+    in->cur = in->map;
+    in->limit = in->cur + in->map_len / sizeof(int32_t) * sizeof(int32_t);
+    return true;
+}
+
+VMInput *input_open(const char *path) {
+    VMInput *in = calloc(1, sizeof(VMInput));
+    if (!in) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    in->binary = is_binary_path(path);
+    in->fd = open(path, O_RDONLY);
+    if (in->fd < 0) {
+        fprintf(stderr, "Error: cannot open input '%s': %s\n", path, strerror(errno));
+        free(in);
+        return NULL;
+    }
+
+    if (in->binary) {
+        if (!map_binary(in, path)) {
+            input_close(in);
+            return NULL;
+        }
+        return in;
+    }
+
+    in->buf = calloc(1, INPUT_BLOCK + INPUT_PAD);
+    if (!in->buf) {
+        fprintf(stderr, "Error: out of memory\n");
+        input_close(in);
+        return NULL;
+    }
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    in->buf[0] = '\n';
+    in->cur = in->limit = in->buf;
+    return in;
+}
+
+void input_close(VMInput *in) {
+    if (!in) return;
+    if (in->map) munmap(in->map, in->map_len);
+    if (in->fd >= 0) close(in->fd);
+    free(in->buf);
+    free(in);
+}
+
+/*
+ * Read the next block behind the unread tail. The window ends after the
+ * last separator; at the end of the file (or if a whole block holds no
+ * separator) it covers everything. Returns false once nothing is left.
+ */
+static bool refill(VMInput *in) {
+    size_t held = (size_t)(in->buf + in->len - in->limit);
+    memmove(in->buf, in->limit, held);
+    in->len = held;
+    in->cur = in->limit = in->buf;
+
+    while (!in->at_end) {
+        ssize_t n = read(in->fd, in->buf + in->len, INPUT_BLOCK - in->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            in->at_end = true;
+            break;
+        }
+        size_t old = in->len;
+        in->len += (size_t)n;
+
+        size_t end = in->len;
+        while (end > old && !is_separator(in->buf[end - 1])) end--;
+        if (end > old) {
+            in->limit = in->buf + end;
+            break;
+        }
+        if (in->len == INPUT_BLOCK) {
+            in->limit = in->buf + in->len;
+            break;
+        }
+    }
+    if (in->at_end) in->limit = in->buf + in->len;
+    in->buf[in->len] = '\n';
+    return in->len > 0;
+}
+
+int32_t input_read_slow(VMInput *in) {
+    while (in->cur >= in->limit) {
+        if (!refill(in)) return 0;
+        if (!input_skip(in) && in->at_end) return 0;
+    }
+    return input_read(in);
+}
+
+bool input_eof_slow(VMInput *in) {
+    while (in->cur >= in->limit) {
+        if (!refill(in)) return true;
+        if (!input_skip(in) && in->at_end) return true;
+    }
+    return false;
+}
@@ -0,0 +1,126 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Integer input for read() and eof(). A binary file (".bin": native
+ * int32 values back to back) is mapped and read in place. Anything else
+ * is text, read in INPUT_BLOCK-sized blocks; every run of digits, with an
+ * optional '-' in front, is one value and all other bytes separate them.
+ *
+ * [cur, limit) only ever holds whole values: for text, a number cut off
+ * at the end of a block is held back until the next block arrives. The
+ * inline functions below handle that window and leave the rest to
+ * input_read_slow() and input_eof_slow().
+ */
+#define INPUT_BLOCK (1 << 20)
+#define INPUT_PAD   8     /* readable bytes after the end of the text buffer */
+
+typedef struct VMInput {
+    const char *cur;        /* next unread byte */
+    const char *limit;      /* end of the whole values available */
+    bool binary;
+    int fd;
+
+    /* Binary: the mapped file */
+    void *map;
+    size_t map_len;
+
+    /* Text: block buffer, with a separator stored after the last byte
+       and INPUT_PAD bytes of padding */
+    char *buf;
+    size_t len;             /* bytes in buf */
+    bool at_end;            /* fd has no more data */
+} VMInput;
+
+VMInput *input_open(const char *path);
+void input_close(VMInput *in);
+int32_t input_read_slow(VMInput *in);
+bool input_eof_slow(VMInput *in);
+
+static inline bool input_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/* Step over separators; true if a value starts at cur */
+static inline bool input_skip(VMInput *in) {
+    const char *p = in->cur;
+    while (p < in->limit && !input_is_digit(*p) &&
+           !(*p == '-' && input_is_digit(p[1]))) {
+        p++;
+    }
+    in->cur = p;
+    return p < in->limit;
+}
+
+/*
+ * Digits at p, eight at a time on little-endian machines: find how many
+ * of the eight bytes loaded are digits, shift them to the top so the
+ * missing leading ones read as zeros, and combine neighbouring pairs of
+ * digits, then of 2-digit and of 4-digit values. The buffer is padded, so
+ * the load may run past the end of the number.
+ */
+static inline uint32_t input_parse_digits(const char **pp) {
+    const char *p = *pp;
+    uint32_t u = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    static const uint32_t scale[9] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+    };
+    for (;;) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        /* Per byte: nonzero unless the byte is '0'..'9' */
+        uint64_t bad = ((w & 0xF0F0F0F0F0F0F0F0ull) ^ 0x3030303030303030ull) |
+                       (((w + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) ^
+                        0x3030303030303030ull);
+        uint64_t stop = (((bad & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | bad) &
+                        0x8080808080808080ull;
+        int n = stop ? __builtin_ctzll(stop) >> 3 : 8;
+        if (n == 0) break;
+
+        uint64_t v = (w & 0x0F0F0F0F0F0F0F0Full) << (8 * (8 - n));
+        v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFull;
+        v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFull;
+        v = (v * 10000 + (v >> 32)) & 0xFFFFFFFFull;
+        u = u * scale[n] + (uint32_t)v;
+        p += n;
+        if (n < 8) break;
+    }
+#else
+    while (input_is_digit(*p)) u = u * 10 + (uint32_t)(*p++ - '0');
+#endif
+    *pp = p;
+    return u;
+}
+
+/* Next value, or 0 once the input is used up; out-of-range text wraps */
+static inline int32_t input_read(VMInput *in) {
+    if (in->binary) {
+        if (in->cur >= in->limit) return 0;
+        int32_t v;
+        memcpy(&v, in->cur, sizeof(v));
+        in->cur += sizeof(v);
+        return v;
+    }
+    if (!input_skip(in)) return input_read_slow(in);
+
+    /* Signs come in random order in real data: negate without a branch */
+    const char *p = in->cur;
+    uint32_t negative = *p == '-';
+    p += negative;
+    uint32_t u = input_parse_digits(&p);
+    in->cur = p;
+    return (int32_t)((u ^ (0u - negative)) + negative);
+}
+
+static inline bool input_eof(VMInput *in) {
+    if (in->binary) return in->cur >= in->limit;
+    return !input_skip(in) && input_eof_slow(in);
+}
+
+#endif
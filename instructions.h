@@ -18,6 +18,15 @@
 #define OP_CMP_LE  0x18
 #define OP_CMP_GE  0x19
 
+/* Remainder, bitwise and shift operators: pop b, a; push a op b. Shift
+   counts are taken mod 32 and OP_SHR shifts arithmetically. */
+#define OP_MOD   0x1A
+#define OP_AND   0x1B
+#define OP_OR    0x1C
+#define OP_XOR   0x1D
+#define OP_SHL   0x1E
+#define OP_SHR   0x1F
+
 #define OP_JMP   0x20
 #define OP_JZ    0x21
 #define OP_JNZ   0x22
@@ -28,9 +37,143 @@
 #define OP_CALL  0x40
 #define OP_RET   0x41
 
+/* Call frames. A frame lives on the operand stack: the arguments the
+   caller pushed, then the callee's locals, then its temporaries, all
+   addressed from the frame pointer fp. CALL pushes the return address
+   and ENTER the caller's fp on the return stack; RETURN pops both. */
+#define OP_ENTER        0x42  /* args, locals: fp = sp - args; push locals zeros */
+#define OP_RETURN       0x43  /* pop v; drop the frame; return; push v */
+#define OP_TAIL         0x44  /* target: replace the frame by the callee's (an
+                                 ENTER) using the arguments on top; jump */
+#define OP_LOAD_LOCAL   0x48  /* k: push stack[fp + k] */
+#define OP_STORE_LOCAL  0x49  /* k: pop into stack[fp + k] */
+
 /* LAB6 CHANGE: print opcode for output support */
 #define OP_PRINT 0x50
 
+/* Input: push the next value from the VM's input (0 once it is used up),
+   or 1 if there is none left, 0 otherwise */
+#define OP_READ  0x51
+#define OP_EOF   0x52
+
+/* Counted loops: step M[slot] by one, then jump back to target while it
+   has not reached the limit. Codegen puts one at the end of a loop body
+   whose condition is already tested on entry. */
+#define OP_LOOP_INC    0x58  /* target, slot, imm: jump if ++M[slot] < imm */
+#define OP_LOOP_DEC    0x59  /* target, slot, imm: jump if --M[slot] > imm */
+#define OP_LOOP_INC_M  0x5A  /* target, slot, lim: jump if ++M[slot] < M[lim] */
+#define OP_LOOP_DEC_M  0x5B  /* target, slot, lim: jump if --M[slot] > M[lim] */
+
+/* Superinstructions selected by codegen for common sequences.
+   Operands are int32; the two-operand forms take slot first. */
+#define OP_INC_SLOT    0x60  /* slot, imm:  M[slot] += imm    (LOAD/PUSH/ADD/STORE) */
+#define OP_PUSH_STORE  0x61  /* slot, imm:  M[slot] = imm     (PUSH/STORE) */
+#define OP_LOAD2_ADD   0x62  /* slot, slot: push M[a] + M[b]  (LOAD/LOAD/ADD) */
+#define OP_LOAD2_SUB   0x63  /* slot, slot: push M[a] - M[b]  (LOAD/LOAD/SUB) */
+#define OP_LOAD2_MUL   0x64  /* slot, slot: push M[a] * M[b]  (LOAD/LOAD/MUL) */
+#define OP_DIV_POW2    0x65  /* k: pop a; push a / 2^k        (PUSH/DIV) */
+#define OP_MOD_POW2    0x66  /* k: pop a; push a % 2^k        (PUSH/MOD) */
+
+/* Compare-and-branch (CMP_xx + JZ): pop b, a; jump if !(a op b) */
+#define OP_JZ_LT  0x68
+#define OP_JZ_EQ  0x69
+#define OP_JZ_NE  0x6A
+#define OP_JZ_GT  0x6B
+#define OP_JZ_LE  0x6C
+#define OP_JZ_GE  0x6D
+
+/* Register engine: three-address forms that operate directly on memory
+   slots (variables, then constants, then temporaries). Emitted by
+   codegen_compile_regs(); jump targets are always the first operand. */
+#define OP_R_MOV    0x70  /* dst, src */
+#define OP_R_MOVI   0x71  /* dst, imm */
+#define OP_R_ADD    0x72  /* dst, a, b */
+#define OP_R_SUB    0x73
+#define OP_R_MUL    0x74
+#define OP_R_DIV    0x75
+#define OP_R_LT     0x78  /* dst, a, b: dst = (a < b) */
+#define OP_R_EQ     0x79
+#define OP_R_NE     0x7A
+#define OP_R_GT     0x7B
+#define OP_R_LE     0x7C
+#define OP_R_GE     0x7D
+#define OP_R_JZ     0x80  /* target, src: jump if M[src] == 0 */
+#define OP_R_JZ_LT  0x81  /* target, a, b: jump if !(M[a] < M[b]) */
+#define OP_R_JZ_EQ  0x82
+#define OP_R_JZ_NE  0x83
+#define OP_R_JZ_GT  0x84
+#define OP_R_JZ_LE  0x85
+#define OP_R_JZ_GE  0x86
+#define OP_R_PRINT  0x88  /* src */
+#define OP_R_READ   0x89  /* dst */
+#define OP_R_EOF    0x8A  /* dst */
+
+/* Arrays: each one is the memory slots [base, base + len). The indexed
+   forms fail with VM_ERROR_INDEX_BOUNDS unless 0 <= i < len; the element
+   forms take the index from a slot and are only emitted where codegen
+   proved it in range, which verify_program() checks again. The bulk
+   forms run the SIMD kernels in vec.c. */
+#define OP_LOAD_IDX   0x90  /* base, len: pop i; push M[base + i] */
+#define OP_STORE_IDX  0x91  /* base, len: pop v, pop i; M[base + i] = v */
+#define OP_LOAD_ELEM  0x92  /* base, len, slot: push M[base + M[slot]] */
+#define OP_STORE_ELEM 0x93  /* base, len, slot: pop v; M[base + M[slot]] = v */
+#define OP_FILL       0x98  /* base, len: pop v; every element = v */
+#define OP_COPY       0x99  /* dst, src, len */
+#define OP_SUM        0x9A  /* base, len: push the sum of the elements */
+#define OP_DOT        0x9B  /* a, b, len: push the sum of a[k] * b[k] */
+#define OP_VADD       0x9C  /* dst, src, len: dst[k] += src[k] */
+#define OP_VMUL       0x9D  /* dst, src, len: dst[k] *= src[k] */
+
+/* Register forms of the remainder, bitwise and shift operators, and of
+   division and remainder by a power of two (k is an immediate) */
+#define OP_R_MOD       0xA0  /* dst, a, b */
+#define OP_R_AND       0xA1
+#define OP_R_OR        0xA2
+#define OP_R_XOR       0xA3
+#define OP_R_SHL       0xA4
+#define OP_R_SHR       0xA5
+#define OP_R_DIV_POW2  0xA6  /* dst, src, k: dst = M[src] / 2^k */
+#define OP_R_MOD_POW2  0xA7  /* dst, src, k: dst = M[src] % 2^k */
+
+/* Heap pairs. A pair is named by a reference word (see gc.h); the field
+   forms fail with VM_ERROR_NOT_PAIR on any other word. OP_PAIR may run
+   the collector, which scans the operand stack and memory for roots. */
+#define OP_PAIR       0xB0  /* pop b, pop a; push a new pair (a, b) */
+#define OP_LEFT       0xB1  /* pop p; push p.left */
+#define OP_RIGHT      0xB2  /* pop p; push p.right */
+#define OP_SET_LEFT   0xB3  /* pop v, pop p; p.left = v */
+#define OP_SET_RIGHT  0xB4  /* pop v, pop p; p.right = v */
+
+/* Host calls. The index names an entry of the VM's native table (see
+   vm_register_native()); its arity must equal argc. The arguments stay
+   on the stack while the native runs and are replaced by its result. */
+#define OP_NATIVE     0xB8  /* index, argc: pop argc args, push natives[index](args) */
+
 #define OP_HALT  0xFF
 
+/* Internal: never emitted by codegen. vm_load_program() appends it after
+   the last decoded instruction and points out-of-range jumps at it. */
+#define OP_END_OF_CODE 0xFE
+
+/* Internal: quickened forms written over hot loop bodies by the verified
+   interpreter loop (see quicken_region() in vm.c). Each one executes the
+   records it was fused from; the records after it are left intact. */
+#define OP_Q_JZ_LT_IMM 0xE0  /* LOAD s; PUSH k; JZ_LT t  ->  s, k, t */
+#define OP_Q_JZ_EQ_IMM 0xE1
+#define OP_Q_JZ_NE_IMM 0xE2
+#define OP_Q_JZ_GT_IMM 0xE3
+#define OP_Q_JZ_LE_IMM 0xE4
+#define OP_Q_JZ_GE_IMM 0xE5
+#define OP_Q_ADDI      0xE8  /* PUSH k; ADD  ->  k */
+#define OP_Q_SUBI      0xE9
+#define OP_Q_MULI      0xEA
+#define OP_Q_DIVI      0xEB  /* k != 0 */
+#define OP_Q_LOAD_ADD  0xEC  /* LOAD s; ADD  ->  s */
+#define OP_Q_LOAD_SUB  0xED
+#define OP_Q_LOAD_MUL  0xEE
+#define OP_Q_LOOP_INC   0xF0  /* OP_LOOP_* whose body is already quickened */
+#define OP_Q_LOOP_DEC   0xF1
+#define OP_Q_LOOP_INC_M 0xF2
+#define OP_Q_LOOP_DEC_M 0xF3
+
 #endif
@@ -0,0 +1,744 @@
+/*
+ * jit.c - x86-64 template JIT for verified programs
+ *
+ * Every pre-decoded record becomes a fixed machine-code template. The
+ * verifier already proved the operand stack depth at each record, so
+ * stack entries are addressed as fixed offsets from vm->stack and memory
+ * slots as fixed offsets from vm->memory; no stack pointer is kept at run
+ * time. Jumps are patched to the native label of their target record.
+ *
+ * Register use inside generated code:
+ *   rbx  vm->memory            rbp  vm->stack
+ *   r12  instructions executed  r13  JitExit * for the epilogue
+ *   eax, ecx, edx, esi, edi scratch (caller-saved, so printing and reading
+ *   input are plain calls)
+ *
+ * instr_count stays exact: each basic block adds its length to r12 once,
+ * at the branch that ends it (or when falling into the next block).
+ *
+ * Verified programs cannot overflow the stack or touch a bad slot, so the
+ * only run-time errors are division by zero and a checked array index out
+ * of bounds; they exit with the same pc, sp and VMError the interpreter
+ * would report. Bulk array opcodes call the kernels vec_kernels() picked,
+ * and OP_NATIVE calls vm_call_native() with the arguments in place.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "jit.h"
+#include "instructions.h"
+#include "vec.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* Filled in by the generated epilogue */
+typedef struct {
+    int32_t index;         /* record to resume at (becomes vm->pc) */
+    int32_t sp;
+    int32_t error;
+    int32_t unused;
+    uint64_t count;
+} JitExit;
+
+typedef void (*JitEntry)(int32_t *memory, int32_t *stack, JitExit *out,
+                         const void *start);
+
+struct JitCode {
+    uint8_t *mem;
+    size_t size;           /* mapped bytes */
+    size_t used;           /* bytes of generated code */
+    int *label;            /* record index -> code offset, -1 if not a leader */
+};
+
+bool jit_available(void) {
+#ifdef JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t jit_code_size(const JitCode *code) {
+    return code ? code->used : 0;
+}
+
+void jit_free(JitCode *code) {
+    if (!code) return;
+#ifdef JIT_X86_64
+    if (code->mem) munmap(code->mem, code->size);
+#endif
+    free(code->label);
+    free(code);
+}
+
+#ifdef JIT_X86_64
+
+#define REG_EAX 0
+#define REG_ECX 1
+#define REG_EDX 2
+#define REG_ESI 6
+#define BASE_MEM 3         /* rbx */
+#define BASE_STK 5         /* rbp */
+
+/* x86 condition codes; cc ^ 1 is the negation */
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G  0xF
+
+/* Worst case bytes for one record's template plus its error stub */
+#define JIT_MAX_INSN_BYTES 64
+#define JIT_HEADER_BYTES   64
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} JitBuf;
+
+typedef struct {
+    size_t at;             /* offset of the rel32 to patch */
+    int target;            /* record index */
+} JitPatch;
+
+/* Out-of-line error exit (division by zero, index out of bounds) */
+typedef struct {
+    size_t at;
+    int index;
+    int sp;
+    int count;
+    VMError error;
+} JitStub;
+
+static void emit8(JitBuf *b, uint8_t v) {
+    b->buf[b->len++] = v;
+}
+
+static void emit32(JitBuf *b, int32_t v) {
+    uint32_t u = (uint32_t)v;
+    for (int i = 0; i < 4; i++) emit8(b, (uint8_t)(u >> (8 * i)));
+}
+
+static void emit64(JitBuf *b, uint64_t v) {
+    for (int i = 0; i < 8; i++) emit8(b, (uint8_t)(v >> (8 * i)));
+}
+
+static void patch32(JitBuf *b, size_t at, int32_t v) {
+    uint32_t u = (uint32_t)v;
+    for (int i = 0; i < 4; i++) b->buf[at + i] = (uint8_t)(u >> (8 * i));
+}
+
+/* ModRM for [base + disp]; neither rbx nor rbp needs a SIB byte */
+static void emit_modrm(JitBuf *b, int reg, int base, int32_t disp) {
+    if (disp >= -128 && disp <= 127) {
+        emit8(b, (uint8_t)(0x40 | (reg << 3) | base));
+        emit8(b, (uint8_t)disp);
+    } else {
+        emit8(b, (uint8_t)(0x80 | (reg << 3) | base));
+        emit32(b, disp);
+    }
+}
+
+/* op r32, [base + disp] (mov 8B, add 03, sub 2B, cmp 3B) */
+static void emit_op_load(JitBuf *b, uint8_t op, int reg, int base, int32_t disp) {
+    emit8(b, op);
+    emit_modrm(b, reg, base, disp);
+}
+
+static void emit_imul_load(JitBuf *b, int reg, int base, int32_t disp) {
+    emit8(b, 0x0F);
+    emit8(b, 0xAF);
+    emit_modrm(b, reg, base, disp);
+}
+
+static void emit_store(JitBuf *b, int base, int32_t disp, int reg) {
+    emit8(b, 0x89);
+    emit_modrm(b, reg, base, disp);
+}
+
+static void emit_store_imm(JitBuf *b, int base, int32_t disp, int32_t imm) {
+    emit8(b, 0xC7);
+    emit_modrm(b, 0, base, disp);
+    emit32(b, imm);
+}
+
+static void emit_add_imm(JitBuf *b, int base, int32_t disp, int32_t imm) {
+    emit8(b, 0x81);
+    emit_modrm(b, 0, base, disp);
+    emit32(b, imm);
+}
+
+static void emit_cmp_zero(JitBuf *b, int base, int32_t disp) {
+    emit8(b, 0x83);
+    emit_modrm(b, 7, base, disp);
+    emit8(b, 0x00);
+}
+
+/*
+ * eax = eax / 2^k or eax % 2^k, truncating like idiv: ecx = 2^k - 1 for
+ * a negative eax, 0 otherwise, is added before the shift or mask (and
+ * taken off again after the mask).
+ */
+static void emit_pow2_eax(JitBuf *b, bool mod, int32_t k) {
+    int32_t m = (int32_t)((1u << (k & 31)) - 1);
+    emit8(b, 0x89); emit8(b, 0xC1);                 /* mov ecx, eax */
+    emit8(b, 0xC1); emit8(b, 0xF9); emit8(b, 31);   /* sar ecx, 31 */
+    emit8(b, 0x81); emit8(b, 0xE1); emit32(b, m);   /* and ecx, m */
+    emit8(b, 0x01); emit8(b, 0xC8);                 /* add eax, ecx */
+    if (mod) {
+        emit8(b, 0x25); emit32(b, m);               /* and eax, m */
+        emit8(b, 0x29); emit8(b, 0xC8);             /* sub eax, ecx */
+    } else {
+        emit8(b, 0xC1); emit8(b, 0xF8); emit8(b, (uint8_t)(k & 31)); /* sar eax, k */
+    }
+}
+
+/* setcc al; movzx eax, al */
+static void emit_setcc_eax(JitBuf *b, int cc) {
+    emit8(b, 0x0F); emit8(b, (uint8_t)(0x90 | cc)); emit8(b, 0xC0);
+    emit8(b, 0x0F); emit8(b, 0xB6); emit8(b, 0xC0);
+}
+
+/* jcc rel32 / jmp rel32; returns the offset of the rel32 */
+static size_t emit_jcc(JitBuf *b, int cc) {
+    emit8(b, 0x0F);
+    emit8(b, (uint8_t)(0x80 | cc));
+    emit32(b, 0);
+    return b->len - 4;
+}
+
+static size_t emit_jmp(JitBuf *b) {
+    emit8(b, 0xE9);
+    emit32(b, 0);
+    return b->len - 4;
+}
+
+static void emit_count(JitBuf *b, int n) {
+    if (n == 0) return;
+    emit8(b, 0x49); emit8(b, 0x81); emit8(b, 0xC4);   /* add r12, imm32 */
+    emit32(b, n);
+}
+
+/* mov rdi, vm; mov esi, src; mov rax, vm_print_int; call rax */
+static void emit_print_call(JitBuf *b, VM *vm, int base, int32_t disp) {
+    emit8(b, 0x48); emit8(b, 0xBF);
+    emit64(b, (uint64_t)(uintptr_t)vm);
+    emit_op_load(b, 0x8B, REG_ESI, base, disp);
+    emit8(b, 0x48); emit8(b, 0xB8);
+    emit64(b, (uint64_t)(uintptr_t)vm_print_int);
+    emit8(b, 0xFF); emit8(b, 0xD0);
+}
+
+/* mov rdi, vm; mov rax, fn; call rax; mov [base+disp], eax */
+static void emit_input_call(JitBuf *b, VM *vm, int32_t (*fn)(VM *),
+                            int base, int32_t disp) {
+    emit8(b, 0x48); emit8(b, 0xBF);
+    emit64(b, (uint64_t)(uintptr_t)vm);
+    emit8(b, 0x48); emit8(b, 0xB8);
+    emit64(b, (uint64_t)(uintptr_t)fn);
+    emit8(b, 0xFF); emit8(b, 0xD0);
+    emit_store(b, base, disp, REG_EAX);
+}
+
+/* mov eax, [rbx + rax*4 + disp] / mov [rbx + rax*4 + disp], ecx: an
+   element of the array at slot disp / 4, index in eax */
+static void emit_element_load(JitBuf *b, int32_t disp) {
+    emit8(b, 0x8B); emit8(b, 0x84); emit8(b, 0x83);
+    emit32(b, disp);
+}
+
+static void emit_element_store(JitBuf *b, int32_t disp) {
+    emit8(b, 0x89); emit8(b, 0x8C); emit8(b, 0x83);
+    emit32(b, disp);
+}
+
+/* lea rdi/rsi, [rbx + disp] */
+static void emit_lea_rdi(JitBuf *b, int32_t disp) {
+    emit8(b, 0x48); emit8(b, 0x8D); emit8(b, 0xBB);
+    emit32(b, disp);
+}
+
+static void emit_lea_rsi(JitBuf *b, int32_t disp) {
+    emit8(b, 0x48); emit8(b, 0x8D); emit8(b, 0xB3);
+    emit32(b, disp);
+}
+
+/* mov rax, fn; call rax */
+static void emit_call(JitBuf *b, const void *fn) {
+    emit8(b, 0x48); emit8(b, 0xB8);
+    emit64(b, (uint64_t)(uintptr_t)fn);
+    emit8(b, 0xFF); emit8(b, 0xD0);
+}
+
+/* mov rdi, vm; mov esi, index; lea rdx, [rbp + disp]; call
+   vm_call_native; mov [rbp + disp], eax: the arguments start at disp and
+   the result replaces the first */
+static void emit_native_call(JitBuf *b, VM *vm, int32_t index, int32_t disp) {
+    emit8(b, 0x48); emit8(b, 0xBF);
+    emit64(b, (uint64_t)(uintptr_t)vm);
+    emit8(b, 0xBE); emit32(b, index);
+    emit8(b, 0x48); emit8(b, 0x8D); emit8(b, 0x95);
+    emit32(b, disp);
+    emit_call(b, (const void *)vm_call_native);
+    emit_store(b, BASE_STK, disp, REG_EAX);
+}
+
+/* mov eax, index; mov ecx, sp; mov edx, error; jmp epilogue */
+static void emit_exit(JitBuf *b, size_t epilogue, int index, int sp, VMError err) {
+    emit8(b, 0xB8); emit32(b, index);
+    emit8(b, 0xB9); emit32(b, sp);
+    emit8(b, 0xBA); emit32(b, (int32_t)err);
+    size_t at = emit_jmp(b);
+    patch32(b, at, (int32_t)(epilogue - (at + 4)));
+}
+
+/*
+ * Prologue: save callee-saved registers (keeping rsp 16-byte aligned for
+ * the print calls), load the base registers and jump to the entry record
+ * passed in rcx. The shared epilogue follows and stores eax/ecx/edx/r12
+ * into the JitExit. Returns the epilogue offset.
+ */
+static size_t emit_header(JitBuf *b) {
+    static const uint8_t prologue[] = {
+        0x53,                           /* push rbx */
+        0x55,                           /* push rbp */
+        0x41, 0x54,                     /* push r12 */
+        0x41, 0x55,                     /* push r13 */
+        0x48, 0x83, 0xEC, 0x08,         /* sub rsp, 8 */
+        0x48, 0x89, 0xFB,               /* mov rbx, rdi */
+        0x48, 0x89, 0xF5,               /* mov rbp, rsi */
+        0x49, 0x89, 0xD5,               /* mov r13, rdx */
+        0x45, 0x31, 0xE4,               /* xor r12d, r12d */
+        0xFF, 0xE1,                     /* jmp rcx */
+    };
+    static const uint8_t epilogue[] = {
+        0x41, 0x89, 0x45, 0x00,         /* mov [r13+0], eax */
+        0x41, 0x89, 0x4D, 0x04,         /* mov [r13+4], ecx */
+        0x41, 0x89, 0x55, 0x08,         /* mov [r13+8], edx */
+        0x4D, 0x89, 0x65, 0x10,         /* mov [r13+16], r12 */
+        0x48, 0x83, 0xC4, 0x08,         /* add rsp, 8 */
+        0x41, 0x5D,                     /* pop r13 */
+        0x41, 0x5C,                     /* pop r12 */
+        0x5D,                           /* pop rbp */
+        0x5B,                           /* pop rbx */
+        0xC3,                           /* ret */
+    };
+    memcpy(b->buf + b->len, prologue, sizeof(prologue));
+    b->len += sizeof(prologue);
+    size_t epi = b->len;
+    memcpy(b->buf + b->len, epilogue, sizeof(epilogue));
+    b->len += sizeof(epilogue);
+    return epi;
+}
+
+static int compare_cc(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CMP:    case OP_JZ_LT: case OP_R_LT: case OP_R_JZ_LT: return CC_L;
+        case OP_CMP_EQ: case OP_JZ_EQ: case OP_R_EQ: case OP_R_JZ_EQ: return CC_E;
+        case OP_CMP_NE: case OP_JZ_NE: case OP_R_NE: case OP_R_JZ_NE: return CC_NE;
+        case OP_CMP_GT: case OP_JZ_GT: case OP_R_GT: case OP_R_JZ_GT: return CC_G;
+        case OP_CMP_LE: case OP_JZ_LE: case OP_R_LE: case OP_R_JZ_LE: return CC_LE;
+        default:                                                      return CC_GE;
+    }
+}
+
+static bool ends_block(uint8_t opcode) {
+    switch (opcode) {
+        case OP_JMP: case OP_JZ: case OP_JNZ:
+        case OP_JZ_LT: case OP_JZ_EQ: case OP_JZ_NE:
+        case OP_JZ_GT: case OP_JZ_LE: case OP_JZ_GE:
+        case OP_R_JZ:
+        case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+        case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+        case OP_LOOP_INC: case OP_LOOP_DEC: case OP_LOOP_INC_M: case OP_LOOP_DEC_M:
+        case OP_HALT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_branch(uint8_t opcode) {
+    return ends_block(opcode) && opcode != OP_HALT;
+}
+
+#define STK(d)  (4 * (d))
+#define SLOT(s) (4 * (s))
+
+static JitCode *jit_compile(VM *vm) {
+    int n = vm->insn_count;
+    const VMInstr *insns = vm->insns;
+    const int *depth = vm->insn_depth;
+    JitCode *jc = calloc(1, sizeof(JitCode));
+    bool *leader = calloc(n + 1, sizeof(bool));
+    JitPatch *patches = malloc((n + 1) * sizeof(JitPatch));
+    JitStub *stubs = malloc((n + 1) * sizeof(JitStub));
+    int npatch = 0, nstub = 0;
+    bool ok = jc && leader && patches && stubs;
+
+    JitBuf b = { NULL, 0, 0 };
+    if (ok) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t need = JIT_HEADER_BYTES + (size_t)(n + 1) * JIT_MAX_INSN_BYTES;
+        b.cap = (need + page - 1) / page * page;
+        b.buf = mmap(NULL, b.cap, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        jc->label = malloc((n + 1) * sizeof(int));
+        if (b.buf == MAP_FAILED) b.buf = NULL;
+        ok = b.buf && jc->label;
+    }
+
+    if (ok) {
+        leader[0] = true;
+        for (int i = 0; i < n; i++) {
+            if (depth[i] < 0) continue;
+            if (is_branch(insns[i].opcode)) leader[insns[i].operand] = true;
+            if (ends_block(insns[i].opcode)) leader[i + 1] = true;
+        }
+    }
+
+    size_t epi = ok ? emit_header(&b) : 0;
+    int pending = 0;   /* records executed since the last emit_count */
+
+    for (int i = 0; ok && i < n; i++) {
+        const VMInstr *ins = &insns[i];
+        int d = depth[i];
+
+        jc->label[i] = -1;
+        if (d < 0) continue;               /* unreachable */
+        if (leader[i]) {
+            emit_count(&b, pending);
+            pending = 0;
+            jc->label[i] = (int)b.len;
+        }
+        pending++;
+        if (ends_block(ins->opcode)) {
+            emit_count(&b, pending);
+            pending = 0;
+        }
+
+        switch (ins->opcode) {
+            case OP_PUSH:
+                emit_store_imm(&b, BASE_STK, STK(d), ins->operand);
+                break;
+            case OP_POP:
+                break;
+            case OP_DUP:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 1));
+                emit_store(&b, BASE_STK, STK(d), REG_EAX);
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 2));
+                if (ins->opcode == OP_MUL) emit_imul_load(&b, REG_EAX, BASE_STK, STK(d - 1));
+                else emit_op_load(&b, ins->opcode == OP_ADD ? 0x03 : 0x2B, REG_EAX, BASE_STK, STK(d - 1));
+                emit_store(&b, BASE_STK, STK(d - 2), REG_EAX);
+                break;
+            case OP_AND: case OP_OR: case OP_XOR:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 2));
+                emit_op_load(&b, ins->opcode == OP_AND ? 0x23 : ins->opcode == OP_OR ? 0x0B : 0x33,
+                             REG_EAX, BASE_STK, STK(d - 1));
+                emit_store(&b, BASE_STK, STK(d - 2), REG_EAX);
+                break;
+            case OP_SHL: case OP_SHR:
+                /* the hardware masks the count in cl to 5 bits, like the VM */
+                emit_op_load(&b, 0x8B, REG_ECX, BASE_STK, STK(d - 1));
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 2));
+                emit8(&b, 0xD3); emit8(&b, ins->opcode == OP_SHL ? 0xE0 : 0xF8);
+                emit_store(&b, BASE_STK, STK(d - 2), REG_EAX);
+                break;
+            case OP_DIV_POW2: case OP_MOD_POW2:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 1));
+                emit_pow2_eax(&b, ins->opcode == OP_MOD_POW2, ins->operand);
+                emit_store(&b, BASE_STK, STK(d - 1), REG_EAX);
+                break;
+            case OP_DIV: case OP_R_DIV: case OP_MOD: case OP_R_MOD: {
+                bool reg = ins->opcode == OP_R_DIV || ins->opcode == OP_R_MOD;
+                bool mod = ins->opcode == OP_MOD || ins->opcode == OP_R_MOD;
+                int base_a = BASE_STK, base_b = BASE_STK;
+                int32_t off_a = STK(d - 2), off_b = STK(d - 1), off_dst = STK(d - 2);
+                if (reg) {
+                    base_a = base_b = BASE_MEM;
+                    off_a = SLOT(ins->operand2);
+                    off_b = SLOT(ins->operand3);
+                    off_dst = SLOT(ins->operand);
+                }
+                emit_op_load(&b, 0x8B, REG_ECX, base_b, off_b);
+                emit8(&b, 0x85); emit8(&b, 0xC9);          /* test ecx, ecx */
+                stubs[nstub].at = emit_jcc(&b, CC_E);
+                stubs[nstub].index = i + 1;
+                /* the interpreter has already popped b when it fails */
+                stubs[nstub].sp = reg ? d : d - 1;
+                stubs[nstub].count = pending;
+                stubs[nstub].error = VM_ERROR_DIVISION_BY_ZERO;
+                nstub++;
+                emit_op_load(&b, 0x8B, REG_EAX, base_a, off_a);
+                /* idiv traps on INT32_MIN / -1: a / -1 is -a, a % -1 is 0 */
+                emit8(&b, 0x83); emit8(&b, 0xF9); emit8(&b, 0xFF); /* cmp ecx, -1 */
+                emit8(&b, 0x75); emit8(&b, 4);             /* jne +4 */
+                if (mod) { emit8(&b, 0x31); emit8(&b, 0xD2); }     /* xor edx, edx */
+                else     { emit8(&b, 0xF7); emit8(&b, 0xD8); }     /* neg eax */
+                emit8(&b, 0xEB); emit8(&b, 3);             /* jmp +3 */
+                emit8(&b, 0x99);                           /* cdq */
+                emit8(&b, 0xF7); emit8(&b, 0xF9);          /* idiv ecx */
+                emit_store(&b, base_a, off_dst, mod ? REG_EDX : REG_EAX);
+                break;
+            }
+            case OP_CMP: case OP_CMP_EQ: case OP_CMP_NE:
+            case OP_CMP_GT: case OP_CMP_LE: case OP_CMP_GE:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 2));
+                emit_op_load(&b, 0x3B, REG_EAX, BASE_STK, STK(d - 1));
+                emit_setcc_eax(&b, compare_cc(ins->opcode));
+                emit_store(&b, BASE_STK, STK(d - 2), REG_EAX);
+                break;
+            case OP_JMP:
+                patches[npatch].at = emit_jmp(&b);
+                patches[npatch++].target = ins->operand;
+                break;
+            case OP_JZ: case OP_JNZ:
+                emit_cmp_zero(&b, BASE_STK, STK(d - 1));
+                patches[npatch].at = emit_jcc(&b, ins->opcode == OP_JZ ? CC_E : CC_NE);
+                patches[npatch++].target = ins->operand;
+                break;
+            case OP_STORE:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 1));
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_LOAD:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand));
+                emit_store(&b, BASE_STK, STK(d), REG_EAX);
+                break;
+            case OP_INC_SLOT:
+                emit_add_imm(&b, BASE_MEM, SLOT(ins->operand), ins->operand2);
+                break;
+            case OP_PUSH_STORE:
+            case OP_R_MOVI:
+                emit_store_imm(&b, BASE_MEM, SLOT(ins->operand), ins->operand2);
+                break;
+            case OP_LOAD2_ADD: case OP_LOAD2_SUB: case OP_LOAD2_MUL:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand));
+                if (ins->opcode == OP_LOAD2_MUL) emit_imul_load(&b, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                else emit_op_load(&b, ins->opcode == OP_LOAD2_ADD ? 0x03 : 0x2B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit_store(&b, BASE_STK, STK(d), REG_EAX);
+                break;
+            case OP_JZ_LT: case OP_JZ_EQ: case OP_JZ_NE:
+            case OP_JZ_GT: case OP_JZ_LE: case OP_JZ_GE:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(d - 2));
+                emit_op_load(&b, 0x3B, REG_EAX, BASE_STK, STK(d - 1));
+                patches[npatch].at = emit_jcc(&b, compare_cc(ins->opcode) ^ 1);
+                patches[npatch++].target = ins->operand;
+                break;
+            case OP_R_MOV:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_R_ADD: case OP_R_SUB: case OP_R_MUL:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                if (ins->opcode == OP_R_MUL) emit_imul_load(&b, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                else emit_op_load(&b, ins->opcode == OP_R_ADD ? 0x03 : 0x2B, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_R_AND: case OP_R_OR: case OP_R_XOR:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit_op_load(&b, ins->opcode == OP_R_AND ? 0x23 : ins->opcode == OP_R_OR ? 0x0B : 0x33,
+                             REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_R_SHL: case OP_R_SHR:
+                emit_op_load(&b, 0x8B, REG_ECX, BASE_MEM, SLOT(ins->operand3));
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit8(&b, 0xD3); emit8(&b, ins->opcode == OP_R_SHL ? 0xE0 : 0xF8);
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_R_DIV_POW2: case OP_R_MOD_POW2:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit_pow2_eax(&b, ins->opcode == OP_R_MOD_POW2, ins->operand3);
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+            case OP_R_GT: case OP_R_LE: case OP_R_GE:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit_op_load(&b, 0x3B, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                emit_setcc_eax(&b, compare_cc(ins->opcode));
+                emit_store(&b, BASE_MEM, SLOT(ins->operand), REG_EAX);
+                break;
+            case OP_R_JZ:
+                emit_cmp_zero(&b, BASE_MEM, SLOT(ins->operand2));
+                patches[npatch].at = emit_jcc(&b, CC_E);
+                patches[npatch++].target = ins->operand;
+                break;
+            case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+            case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                emit_op_load(&b, 0x3B, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                patches[npatch].at = emit_jcc(&b, compare_cc(ins->opcode) ^ 1);
+                patches[npatch++].target = ins->operand;
+                break;
+            case OP_LOOP_INC: case OP_LOOP_DEC:
+            case OP_LOOP_INC_M: case OP_LOOP_DEC_M: {
+                bool inc = ins->opcode == OP_LOOP_INC || ins->opcode == OP_LOOP_INC_M;
+                emit_add_imm(&b, BASE_MEM, SLOT(ins->operand2), inc ? 1 : -1);
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand2));
+                if (ins->opcode == OP_LOOP_INC || ins->opcode == OP_LOOP_DEC) {
+                    emit8(&b, 0x3D); emit32(&b, ins->operand3);     /* cmp eax, imm32 */
+                } else {
+                    emit_op_load(&b, 0x3B, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                }
+                patches[npatch].at = emit_jcc(&b, inc ? CC_L : CC_G);
+                patches[npatch++].target = ins->operand;
+                break;
+            }
+            case OP_PRINT:
+                emit_print_call(&b, vm, BASE_STK, STK(d - 1));
+                break;
+            case OP_R_PRINT:
+                emit_print_call(&b, vm, BASE_MEM, SLOT(ins->operand));
+                break;
+            case OP_READ: case OP_EOF:
+                emit_input_call(&b, vm, ins->opcode == OP_READ ? vm_read_int : vm_input_eof,
+                                BASE_STK, STK(d));
+                break;
+            case OP_R_READ: case OP_R_EOF:
+                emit_input_call(&b, vm, ins->opcode == OP_R_READ ? vm_read_int : vm_input_eof,
+                                BASE_MEM, SLOT(ins->operand));
+                break;
+            case OP_LOAD_IDX: case OP_STORE_IDX: {
+                /* cmp eax, len; jae: negative indices compare above too */
+                bool store = ins->opcode == OP_STORE_IDX;
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_STK, STK(store ? d - 2 : d - 1));
+                emit8(&b, 0x3D); emit32(&b, ins->operand2);
+                stubs[nstub].at = emit_jcc(&b, 0x3);
+                stubs[nstub].index = i + 1;
+                stubs[nstub].sp = store ? d - 2 : d - 1;
+                stubs[nstub].count = pending;
+                stubs[nstub].error = VM_ERROR_INDEX_BOUNDS;
+                nstub++;
+                if (store) {
+                    emit_op_load(&b, 0x8B, REG_ECX, BASE_STK, STK(d - 1));
+                    emit_element_store(&b, SLOT(ins->operand));
+                } else {
+                    emit_element_load(&b, SLOT(ins->operand));
+                    emit_store(&b, BASE_STK, STK(d - 1), REG_EAX);
+                }
+                break;
+            }
+            case OP_LOAD_ELEM:
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                emit_element_load(&b, SLOT(ins->operand));
+                emit_store(&b, BASE_STK, STK(d), REG_EAX);
+                break;
+            case OP_STORE_ELEM:
+                emit_op_load(&b, 0x8B, REG_ECX, BASE_STK, STK(d - 1));
+                emit_op_load(&b, 0x8B, REG_EAX, BASE_MEM, SLOT(ins->operand3));
+                emit_element_store(&b, SLOT(ins->operand));
+                break;
+            case OP_FILL:
+                emit_lea_rdi(&b, SLOT(ins->operand));
+                emit_op_load(&b, 0x8B, REG_ESI, BASE_STK, STK(d - 1));
+                emit8(&b, 0xBA); emit32(&b, ins->operand2);       /* mov edx, len */
+                emit_call(&b, (const void *)vec_kernels()->fill);
+                break;
+            case OP_SUM:
+                emit_lea_rdi(&b, SLOT(ins->operand));
+                emit8(&b, 0xBE); emit32(&b, ins->operand2);       /* mov esi, len */
+                emit_call(&b, (const void *)vec_kernels()->sum);
+                emit_store(&b, BASE_STK, STK(d), REG_EAX);
+                break;
+            case OP_COPY: case OP_DOT: case OP_VADD: case OP_VMUL: {
+                const VecKernels *vk = vec_kernels();
+                const void *fn = ins->opcode == OP_COPY ? (const void *)vk->copy :
+                                 ins->opcode == OP_DOT  ? (const void *)vk->dot :
+                                 ins->opcode == OP_VADD ? (const void *)vk->add :
+                                                          (const void *)vk->mul;
+                emit_lea_rdi(&b, SLOT(ins->operand));
+                emit_lea_rsi(&b, SLOT(ins->operand2));
+                emit8(&b, 0xBA); emit32(&b, ins->operand3);       /* mov edx, len */
+                emit_call(&b, fn);
+                if (ins->opcode == OP_DOT) emit_store(&b, BASE_STK, STK(d), REG_EAX);
+                break;
+            }
+            case OP_NATIVE:
+                emit_native_call(&b, vm, ins->operand, STK(d - ins->operand2));
+                break;
+            case OP_HALT:
+                emit_exit(&b, epi, i + 1, d, VM_OK);
+                break;
+            default:
+                /* OP_RET never passes verification; call frames
+                   (OP_CALL, OP_ENTER ..) and the heap opcodes, which
+                   may run the collector, stay on the interpreter */
+                ok = false;
+                break;
+        }
+    }
+
+    for (int k = 0; ok && k < nstub; k++) {
+        patch32(&b, stubs[k].at, (int32_t)(b.len - (stubs[k].at + 4)));
+        emit_count(&b, stubs[k].count);
+        emit_exit(&b, epi, stubs[k].index, stubs[k].sp, stubs[k].error);
+    }
+    for (int k = 0; ok && k < npatch; k++) {
+        int target = jc->label[patches[k].target];
+        patch32(&b, patches[k].at, (int32_t)(target - (int)(patches[k].at + 4)));
+    }
+
+    if (ok && mprotect(b.buf, b.cap, PROT_READ | PROT_EXEC) != 0) ok = false;
+
+    free(leader);
+    free(patches);
+    free(stubs);
+    if (!ok) {
+        if (b.buf) munmap(b.buf, b.cap);
+        jit_free(jc);
+        return NULL;
+    }
+    jc->label[n] = -1;
+    jc->mem = b.buf;
+    jc->size = b.cap;
+    jc->used = b.len;
+    return jc;
+}
+
+#undef STK
+#undef SLOT
+
+bool jit_run(VM *vm) {
+    if (!vm->verified || !vm->insns || !vm->insn_depth) return false;
+    if (vm->pc < 0 || vm->pc > vm->code_size) return false;
+    int index = vm->insn_at[vm->pc];
+    if (index < 0 || index >= vm->insn_count) return false;
+
+    if (!vm->jit) {
+        vm->jit = jit_compile(vm);
+        if (!vm->jit) return false;
+    }
+    /* Resume only at a block start with the depth the code was built for */
+    int entry = vm->jit->label[index];
+    if (entry < 0 || vm->insn_depth[index] != vm->sp) return false;
+
+    JitExit out = { 0, 0, VM_OK, 0, 0 };
+    JitEntry fn = (JitEntry)(void *)vm->jit->mem;
+    fn(vm->memory, vm->stack, &out, vm->jit->mem + entry);
+
+    vm->pc = vm->insn_offset[out.index];
+    vm->sp = out.sp;
+    vm->error = (VMError)out.error;
+    vm->instr_count += out.count;
+    vm->running = false;
+    return true;
+}
+
+#else
+
+bool jit_run(VM *vm) {
+    (void)vm;
+    return false;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "vm.h"
+
+/*
+ * Template JIT for verified programs (x86-64 only).
+ *
+ * jit_run() translates vm->insns into native code on first use and runs
+ * it from vm->pc. It returns false without touching the VM when it cannot
+ * run the program (other architecture, unverified program, unsupported
+ * opcode, resume point inside a basic block); the caller then falls back
+ * to the interpreter.
+ */
+typedef struct JitCode JitCode;
+
+bool jit_available(void);
+bool jit_run(VM *vm);
+size_t jit_code_size(const JitCode *code);
+void jit_free(JitCode *code);
+
+#endif
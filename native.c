@@ -0,0 +1,90 @@
+/*
+ * native.c - Loading native function libraries (see native.h)
+ *
+ * The library stays open for as long as a submitted program may call
+ * into it; the VM's native table holds its function pointers, so a VM
+ * must not run a program after the program's library was freed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "native.h"
+
+struct NativeLib {
+    void *handle;
+    const NativeDef *defs;
+    int count;
+    char *path;
+};
+
+/* Prints an error and returns NULL if path is not a usable library */
+NativeLib *native_load(const char *path) {
+    /* "./" keeps dlopen() off the search path, as for AOT objects */
+    const char *prefix = strchr(path, '/') ? "" : "./";
+    size_t len = strlen(prefix) + strlen(path) + 1;
+    char *full = malloc(len);
+    if (!full) {
+        fprintf(stderr, "Error: out of memory\n");
+        return NULL;
+    }
+    snprintf(full, len, "%s%s", prefix, path);
+
+    void *handle = dlopen(full, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "Error: cannot load '%s': %s\n", path, dlerror());
+        free(full);
+        return NULL;
+    }
+    const NativeDef *defs = (const NativeDef *)dlsym(handle, NATIVE_TABLE_SYMBOL);
+    if (!defs) {
+        fprintf(stderr, "Error: '%s' has no %s table\n", path, NATIVE_TABLE_SYMBOL);
+        dlclose(handle);
+        free(full);
+        return NULL;
+    }
+
+    int count = 0;
+    for (; defs[count].name; count++) {
+        const NativeDef *d = &defs[count];
+        if (!d->fn || d->arity < 0 || d->arity > NATIVE_MAX_ARITY) {
+            fprintf(stderr, "Error: '%s': native '%s' has no function or a bad arity\n",
+                    path, d->name);
+            dlclose(handle);
+            free(full);
+            return NULL;
+        }
+    }
+
+    NativeLib *lib = malloc(sizeof(NativeLib));
+    if (!lib) {
+        fprintf(stderr, "Error: out of memory\n");
+        dlclose(handle);
+        free(full);
+        return NULL;
+    }
+    lib->handle = handle;
+    lib->defs = defs;
+    lib->count = count;
+    lib->path = full;
+    return lib;
+}
+
+const NativeDef *native_find(const NativeLib *lib, const char *name) {
+    if (!lib) return NULL;
+    for (int i = 0; i < lib->count; i++) {
+        if (strcmp(lib->defs[i].name, name) == 0) return &lib->defs[i];
+    }
+    return NULL;
+}
+
+const char *native_path(const NativeLib *lib) {
+    return lib->path;
+}
+
+void native_free(NativeLib *lib) {
+    if (!lib) return;
+    dlclose(lib->handle);
+    free(lib->path);
+    free(lib);
+}
@@ -0,0 +1,43 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "vm.h"
+
+/*
+ * Libraries of host functions for OP_NATIVE. A library is a shared object
+ * that exports a table named lab_natives, ended by an entry with a NULL
+ * name:
+ *
+ *     #include "native.h"
+ *
+ *     static int32_t mix(VM *vm, const int32_t *args) {
+ *         (void)vm;
+ *         return args[0] * 31 + args[1];
+ *     }
+ *
+ *     const NativeDef lab_natives[] = {
+ *         { "mix", mix, 2 },
+ *         { NULL, NULL, 0 }
+ *     };
+ *
+ * `submit <file> [stack|reg] <lib.so>` loads it, and codegen resolves a call that
+ * names neither a function of the program nor a builtin against the
+ * table. See VMNativeFn in vm.h for what a native may do.
+ */
+typedef struct {
+    const char *name;
+    VMNativeFn fn;
+    int arity;
+} NativeDef;
+
+#define NATIVE_TABLE_SYMBOL "lab_natives"
+#define NATIVE_MAX_ARITY 255
+
+typedef struct NativeLib NativeLib;
+
+NativeLib *native_load(const char *path);
+const NativeDef *native_find(const NativeLib *lib, const char *name);
+const char *native_path(const NativeLib *lib);
+void native_free(NativeLib *lib);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * optimize.c - Constant folding and dead-branch elimination on the AST
+ *
+ * One walk over the tree, in execution order, rewrites it for codegen
+ * (see optimize.h for the levels). An expression is folded in place:
+ * the node becomes a NODE_INT and keeps its line_number and its `next`
+ * link, so the source map and call argument chains are unchanged. A
+ * statement that can never run is freed, and its parent takes whatever
+ * is left.
+ *
+ * Folding follows the VM: arithmetic wraps, shift counts are taken mod
+ * 32, >> is arithmetic, a / -1 is the wrapping negation and a % -1 is 0.
+ * Division by zero is left for the program to hit at run time.
+ *
+ * Branches that declare something are kept even when they cannot run:
+ * a `var` anywhere in a function body makes the name local to the whole
+ * body, and arrays must stay declared for the code that uses them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "optimize.h"
+
+/* A variable known to hold a literal from here on (-O2) */
+typedef struct {
+    const char *name;
+    int32_t value;
+} Constant;
+
+typedef struct {
+    ASTNode *root;
+    int level;
+    ASTNode *params;        /* of the function being optimized */
+    int scope;              /* consts[scope..] are visible */
+    Constant *consts;
+    int const_count;
+    int const_capacity;
+} Optimizer;
+
+/* `l op r` as the VM computes it; 0 if the VM would stop the program */
+static int fold_op(int op, int32_t l, int32_t r, int32_t *out) {
+    uint32_t a = (uint32_t)l, b = (uint32_t)r;
+    switch (op) {
+        case OP_ADD: *out = (int32_t)(a + b); return 1;
+        case OP_SUB: *out = (int32_t)(a - b); return 1;
+        case OP_MUL: *out = (int32_t)(a * b); return 1;
+        case OP_DIV:
+        case OP_MOD:
+            if (r == 0) return 0;
+            if (r == -1) *out = op == OP_DIV ? (int32_t)(0u - a) : 0;
+            else *out = op == OP_DIV ? l / r : l % r;
+            return 1;
+        case OP_AND: *out = l & r; return 1;
+        case OP_OR:  *out = l | r; return 1;
+        case OP_XOR: *out = l ^ r; return 1;
+        case OP_SHL: *out = (int32_t)(a << (r & 31)); return 1;
+        case OP_SHR: *out = l >> (r & 31); return 1;
+        case OP_LT:  *out = l < r; return 1;
+        case OP_GT:  *out = l > r; return 1;
+        case OP_LE:  *out = l <= r; return 1;
+        case OP_GE:  *out = l >= r; return 1;
+        case OP_EQ:  *out = l == r; return 1;
+        case OP_NEQ: *out = l != r; return 1;
+    }
+    return 0;
+}
+
+/* Turn an expression node into a literal, in place */
+static void make_literal(ASTNode *node, int32_t value) {
+    ast_free(node->left);
+    ast_free(node->right);
+    ast_free(node->extra);
+    free(node->varName);
+    node->type = NODE_INT;
+    node->value = value;
+    node->varName = NULL;
+    node->left = node->right = node->extra = NULL;
+}
+
+static int declares(const ASTNode *node) {
+    if (!node) return 0;
+    if (node->type == NODE_DECL || node->type == NODE_ARRAY_DECL || node->type == NODE_FUNC) {
+        return 1;
+    }
+    return declares(node->left) || declares(node->right) || declares(node->extra);
+}
+
+/* Declarations of and writes to `name` anywhere in the program, in any
+   scope: a name qualifies for propagation only if it has no other */
+static void count_writes(const ASTNode *node, const char *name, int *decls, int *writes) {
+    if (!node) return;
+    if (node->varName && strcmp(node->varName, name) == 0) {
+        if (node->type == NODE_DECL) (*decls)++;
+        else if (node->type == NODE_ASSIGN || node->type == NODE_ARRAY_DECL ||
+                 node->type == NODE_INDEX_ASSIGN) (*writes)++;
+    }
+    count_writes(node->left, name, decls, writes);
+    count_writes(node->right, name, decls, writes);
+    count_writes(node->extra, name, decls, writes);
+}
+
+static int is_param(const Optimizer *o, const char *name) {
+    for (const ASTNode *p = o->params; p; p = p->next) {
+        if (strcmp(p->varName, name) == 0) return 1;
+    }
+    return 0;
+}
+
+static void add_constant(Optimizer *o, ASTNode *decl) {
+    int decls = 0, writes = 0;
+    if (is_param(o, decl->varName)) return;
+    count_writes(o->root, decl->varName, &decls, &writes);
+    if (decls != 1 || writes != 0) return;
+
+    if (o->const_count >= o->const_capacity) {
+        int cap = o->const_capacity ? o->const_capacity * 2 : 16;
+        Constant *consts = realloc(o->consts, cap * sizeof(Constant));
+        if (!consts) return;    /* only a missed optimization */
+        o->consts = consts;
+        o->const_capacity = cap;
+    }
+    o->consts[o->const_count].name = decl->varName;
+    o->consts[o->const_count].value = decl->left->value;
+    o->const_count++;
+}
+
+static const Constant *find_constant(const Optimizer *o, const char *name) {
+    for (int i = o->scope; i < o->const_count; i++) {
+        if (strcmp(o->consts[i].name, name) == 0) return &o->consts[i];
+    }
+    return NULL;
+}
+
+/*
+ * Optimize `node` and return what replaces it. `top` is set for the
+ * statements of the main program or a function body that are not inside
+ * an if or a loop: those run once, in order, so a declaration there holds
+ * for every statement after it.
+ */
+static ASTNode *optimize_node(Optimizer *o, ASTNode *node, int top) {
+    if (!node) return NULL;
+
+    switch (node->type) {
+        case NODE_VAR: {
+            const Constant *c = o->level >= 2 ? find_constant(o, node->varName) : NULL;
+            if (c) make_literal(node, c->value);
+            return node;
+        }
+
+        case NODE_OP: {
+            int32_t value;
+            node->left = optimize_node(o, node->left, 0);
+            node->right = optimize_node(o, node->right, 0);
+            if (node->left->type == NODE_INT && node->right->type == NODE_INT &&
+                fold_op(node->value, node->left->value, node->right->value, &value)) {
+                make_literal(node, value);
+            }
+            return node;
+        }
+
+        case NODE_CALL:     /* arguments are folded in place: the chain stays */
+            for (ASTNode *a = node->left; a; a = a->next) optimize_node(o, a, 0);
+            return node;
+
+        case NODE_DECL:
+            node->left = optimize_node(o, node->left, 0);
+            if (top && o->level >= 2 && node->left && node->left->type == NODE_INT) {
+                add_constant(o, node);
+            }
+            return node;
+
+        case NODE_ASSIGN:
+        case NODE_INDEX:
+        case NODE_PRINT:
+        case NODE_RETURN:
+            node->left = optimize_node(o, node->left, 0);
+            return node;
+
+        case NODE_INDEX_ASSIGN:
+            node->left = optimize_node(o, node->left, 0);
+            node->right = optimize_node(o, node->right, 0);
+            return node;
+
+        case NODE_IF: {
+            node->left = optimize_node(o, node->left, 0);
+            node->right = optimize_node(o, node->right, 0);
+            node->extra = optimize_node(o, node->extra, 0);
+            if (node->left->type != NODE_INT) return node;
+
+            ASTNode **taken = node->left->value ? &node->right : &node->extra;
+            ASTNode *dead = node->left->value ? node->extra : node->right;
+            if (declares(dead)) return node;
+            ASTNode *arm = *taken;
+            *taken = NULL;
+            ast_free(node);
+            return arm;
+        }
+
+        case NODE_WHILE:
+            node->left = optimize_node(o, node->left, 0);
+            if (node->left->type == NODE_INT && node->left->value == 0 && !declares(node->right)) {
+                ast_free(node);
+                return NULL;
+            }
+            node->right = optimize_node(o, node->right, 0);
+            return node;
+
+        case NODE_SEQ: {
+            node->left = optimize_node(o, node->left, top);
+            node->right = optimize_node(o, node->right, top);
+            if (node->left && node->right) return node;
+            ASTNode *rest = node->left ? node->left : node->right;
+            node->left = node->right = NULL;
+            ast_free(node);
+            return rest;
+        }
+
+        case NODE_FUNC: {
+            /* A body sees its own locals only: it may run before any
+               statement of the main program */
+            int saved_scope = o->scope, saved_count = o->const_count;
+            ASTNode *saved_params = o->params;
+            o->scope = o->const_count;
+            o->params = node->left;
+            node->right = optimize_node(o, node->right, 1);
+            o->scope = saved_scope;
+            o->const_count = saved_count;
+            o->params = saved_params;
+            return node;
+        }
+
+        default:
+            return node;
+    }
+}
+
+ASTNode *ast_optimize(ASTNode *root, int level) {
+    if (level <= 0) return root;
+    Optimizer o = {0};
+    o.root = root;
+    o.level = level;
+    root = optimize_node(&o, root, 1);
+    free(o.consts);
+    return root;
+}
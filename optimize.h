@@ -0,0 +1,23 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "ast.h"
+
+/*
+ * AST optimizations run between the parser and codegen, chosen by the
+ * -O level given to `submit`:
+ *
+ *   0  none: codegen sees the tree as parsed
+ *   1  fold operators on literals; drop if arms and while loops that a
+ *      literal condition never runs (the default)
+ *   2  also replace a variable that is declared once with a literal and
+ *      never assigned by that literal, after its declaration
+ */
+#define OPT_LEVEL_DEFAULT 1
+#define OPT_LEVEL_MAX     2
+
+/* Returns the new root, which is NULL if nothing is left to run; nodes
+   that are dropped are freed */
+ASTNode *ast_optimize(ASTNode *root, int level);
+
+#endif
@@ -1,40 +1,59 @@
-%{
+/* LAB6 CHANGE: pure parser. The scanner state and the parse result are
+   passed in by the caller instead of living in globals (yyin, yylineno,
+   root), so several files can be parsed at once. */
+%code requires {
+#include "ast.h"
+typedef void *yyscan_t;
+}
+
+%code {
 #include <stdio.h>
 #include <stdlib.h>
-#include "ast.h"
 
-extern ASTNode* root;
-extern int yylineno; // Get line number from Lexer
-int yylex();
-void yyerror(const char* s);
-%}
+int yylex(YYSTYPE *lvalp, yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
+void yyerror(yyscan_t scanner, ASTNode **result, const char *s);
+}
 
+%define api.pure full
 %define api.value.type {ASTNode*}
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {ASTNode **result}
 
 %token INTEGER IDENTIFIER VAR
-%token IF ELSE WHILE
+%token IF ELSE WHILE FOR
 %token PRINT
-%token PLUS MINUS MULT DIV ASSIGN SEMICOLON
+%token READ EOF_CHECK
+%token FUNC RETURN
+%token PLUS MINUS MULT DIV MOD ASSIGN SEMICOLON
 %token EQ NEQ LT GT LE GE
+%token BAND BOR BXOR SHL SHR
 %token LBRACE RBRACE LPAREN RPAREN
+%token LBRACKET RBRACKET COMMA
 
 %expect 1
 
+/* As in C, the bitwise operators bind more loosely than comparisons and
+   the shifts more tightly */
+%left BOR
+%left BXOR
+%left BAND
 %left EQ NEQ LT GT LE GE
+%left SHL SHR
 %left PLUS MINUS
-%left MULT DIV
+%left MULT DIV MOD
 
 %%
 
 program:
-    statement_list { root = $1; }
+    statement_list { *result = $1; }
     ;
 
 statement_list:
     statement { $$ = $1; }
     | statement_list statement {
         $$ = createNode(NODE_SEQ, $1, $2);
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
     }
     ;
 
@@ -43,7 +62,10 @@ statement:
     | assignment
     | if_statement
     | while_statement
+    | for_statement
     | print_statement
+    | function_def
+    | return_statement
     | block
     | expression SEMICOLON { $$ = $1; }
     ;
@@ -56,12 +78,19 @@ variable_decl:
     VAR IDENTIFIER ASSIGN expression SEMICOLON {
         $$ = createNode(NODE_DECL, $4, NULL);
         $$->varName = $2->varName;
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
     }
     | VAR IDENTIFIER SEMICOLON {
         $$ = createNode(NODE_DECL, createIntNode(0), NULL);
         $$->varName = $2->varName;
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
+    }
+    | VAR IDENTIFIER LBRACKET INTEGER RBRACKET SEMICOLON {
+        $$ = createNode(NODE_ARRAY_DECL, NULL, NULL);
+        $$->varName = $2->varName;
+        $$->value = $4->value;
+        ast_free($4);
+        $$->line_number = yyget_lineno(scanner);
     }
     ;
 
@@ -69,26 +98,60 @@ assignment:
     IDENTIFIER ASSIGN expression SEMICOLON {
         $$ = createNode(NODE_ASSIGN, $3, NULL);
         $$->varName = $1->varName;
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
+    }
+    | IDENTIFIER LBRACKET expression RBRACKET ASSIGN expression SEMICOLON {
+        $$ = createNode(NODE_INDEX_ASSIGN, $3, $6);
+        $$->varName = $1->varName;
+        $$->line_number = yyget_lineno(scanner);
     }
     ;
 
 if_statement:
     IF LPAREN expression RPAREN statement {
         $$ = createNode(NODE_IF, $3, $5);
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
     }
     | IF LPAREN expression RPAREN statement ELSE statement {
         $$ = createNode(NODE_IF, $3, $5);
         $$->extra = $7;
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
     }
     ;
 
 while_statement:
     WHILE LPAREN expression RPAREN statement {
         $$ = createNode(NODE_WHILE, $3, $5);
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
+    }
+    ;
+
+/* for (init; cond; step) body is sugar for init; while (cond) { body step }.
+   The header's line goes on the loop, so the step maps back to it. */
+for_statement:
+    FOR LPAREN for_init SEMICOLON expression SEMICOLON for_step RPAREN statement {
+        ASTNode *loop = createNode(NODE_WHILE, $5, createNode(NODE_SEQ, $9, $7));
+        loop->line_number = $7->line_number;
+        loop->right->line_number = $7->line_number;
+        $$ = createNode(NODE_SEQ, $3, loop);
+        $$->line_number = $3->line_number;
+    }
+    ;
+
+for_init:
+    VAR IDENTIFIER ASSIGN expression {
+        $$ = createNode(NODE_DECL, $4, NULL);
+        $$->varName = $2->varName;
+        $$->line_number = yyget_lineno(scanner);
+    }
+    | for_step
+    ;
+
+for_step:
+    IDENTIFIER ASSIGN expression {
+        $$ = createNode(NODE_ASSIGN, $3, NULL);
+        $$->varName = $1->varName;
+        $$->line_number = yyget_lineno(scanner);
     }
     ;
 
@@ -96,30 +159,94 @@ while_statement:
 print_statement:
     PRINT LPAREN expression RPAREN SEMICOLON {
         $$ = make_print($3);
-        $$->line_number = yylineno;
+        $$->line_number = yyget_lineno(scanner);
+    }
+    ;
+
+/* Parameters are chained through `next`; codegen checks that functions
+   are only defined at the top level */
+function_def:
+    FUNC IDENTIFIER LPAREN parameters RPAREN block {
+        $$ = createNode(NODE_FUNC, $4, $6);
+        $$->varName = $2->varName;
+        $$->line_number = $2->line_number;      /* the header, not the closing brace */
+    }
+    ;
+
+parameters:
+    %empty                      { $$ = NULL; }
+    | parameter_list            { $$ = $1; }
+    ;
+
+parameter_list:
+    IDENTIFIER                  { $$ = $1; }
+    | IDENTIFIER COMMA parameter_list { $$ = $1; $$->next = $3; }
+    ;
+
+return_statement:
+    RETURN expression SEMICOLON {
+        $$ = createNode(NODE_RETURN, $2, NULL);
+        $$->line_number = yyget_lineno(scanner);
+    }
+    | RETURN SEMICOLON {
+        $$ = createNode(NODE_RETURN, NULL, NULL);
+        $$->line_number = yyget_lineno(scanner);
     }
     ;
 
 expression:
-    expression PLUS expression  { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_ADD; $$->line_number = yylineno; }
-    | expression MINUS expression { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_SUB; $$->line_number = yylineno; }
-    | expression MULT expression  { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_MUL; $$->line_number = yylineno; }
-    | expression DIV expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_DIV; $$->line_number = yylineno; }
-
-    | expression EQ expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_EQ; $$->line_number = yylineno; }
-    | expression NEQ expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_NEQ; $$->line_number = yylineno; }
-    | expression LT expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_LT; $$->line_number = yylineno; }
-    | expression GT expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_GT; $$->line_number = yylineno; }
-    | expression LE expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_LE; $$->line_number = yylineno; }
-    | expression GE expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_GE; $$->line_number = yylineno; }
+    expression PLUS expression  { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_ADD; $$->line_number = yyget_lineno(scanner); }
+    | expression MINUS expression { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_SUB; $$->line_number = yyget_lineno(scanner); }
+    | expression MULT expression  { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_MUL; $$->line_number = yyget_lineno(scanner); }
+    | expression DIV expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_DIV; $$->line_number = yyget_lineno(scanner); }
+    | expression MOD expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_MOD; $$->line_number = yyget_lineno(scanner); }
+
+    | expression BAND expression  { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_AND; $$->line_number = yyget_lineno(scanner); }
+    | expression BOR expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_OR; $$->line_number = yyget_lineno(scanner); }
+    | expression BXOR expression  { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_XOR; $$->line_number = yyget_lineno(scanner); }
+    | expression SHL expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_SHL; $$->line_number = yyget_lineno(scanner); }
+    | expression SHR expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_SHR; $$->line_number = yyget_lineno(scanner); }
+
+    | expression EQ expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_EQ; $$->line_number = yyget_lineno(scanner); }
+    | expression NEQ expression   { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_NEQ; $$->line_number = yyget_lineno(scanner); }
+    | expression LT expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_LT; $$->line_number = yyget_lineno(scanner); }
+    | expression GT expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_GT; $$->line_number = yyget_lineno(scanner); }
+    | expression LE expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_LE; $$->line_number = yyget_lineno(scanner); }
+    | expression GE expression    { $$ = createNode(NODE_OP, $1, $3); $$->value = OP_GE; $$->line_number = yyget_lineno(scanner); }
+
+    | READ LPAREN RPAREN        { $$ = createNode(NODE_READ, NULL, NULL); $$->line_number = yyget_lineno(scanner); }
+    | EOF_CHECK LPAREN RPAREN   { $$ = createNode(NODE_EOF, NULL, NULL); $$->line_number = yyget_lineno(scanner); }
+
+    | IDENTIFIER LBRACKET expression RBRACKET {
+        $$ = createNode(NODE_INDEX, $3, NULL);
+        $$->varName = $1->varName;
+        $$->line_number = yyget_lineno(scanner);
+    }
+    | IDENTIFIER LPAREN arguments RPAREN {
+        $$ = createNode(NODE_CALL, $3, NULL);
+        $$->varName = $1->varName;
+        $$->line_number = yyget_lineno(scanner);
+    }
 
     | LPAREN expression RPAREN  { $$ = $2; }
     | INTEGER                   { $$ = $1; }
     | IDENTIFIER                { $$ = $1; }
     ;
 
+/* Call arguments, chained through `next` */
+arguments:
+    %empty                      { $$ = NULL; }
+    | argument_list             { $$ = $1; }
+    ;
+
+argument_list:
+    expression                  { $$ = $1; }
+    | expression COMMA argument_list { $$ = $1; $$->next = $3; }
+    ;
+
 %%
 
-void yyerror(const char* s) {
-    fprintf(stderr, "Syntax Error at line %d: %s\n", yylineno, s);
+void yyerror(yyscan_t scanner, ASTNode **result, const char *s) {
+    (void)result;
+    fprintf(stderr, "Syntax Error at line %d: %s\n", yyget_lineno(scanner), s);
 }
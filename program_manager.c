@@ -1,20 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 #include "program_manager.h"
 #include "debugger_vm.h"
+#include "jit.h"
+#include "snapshot.h"
+#include "workers.h"
 #include "ast.h"
+#include "optimize.h"
+#include "input.h"
 
-/* Parser interface */
-extern ASTNode *root;
-extern int yylineno;
-extern FILE *yyin;
-int yyparse(void);
-int yylex_destroy(void);
+/* Parser interface (reentrant; see parser.y and lexer.l) */
+typedef void *yyscan_t;
+int yyparse(yyscan_t scanner, ASTNode **result);
+int yylex_init(yyscan_t *scanner);
+void yyset_in(FILE *in, yyscan_t scanner);
+int yylex_destroy(yyscan_t scanner);
 
 ProgramManager *pm_create(void) {
     ProgramManager *pm = calloc(1, sizeof(ProgramManager));
     pm->next_pid = 1;
+    pm->quantum = PM_DEFAULT_QUANTUM;
     return pm;
 }
 
@@ -23,10 +32,44 @@ void pm_destroy(ProgramManager *pm) {
         if (pm->programs[i].filename) free(pm->programs[i].filename);
         if (pm->programs[i].bytecode) codegen_free(pm->programs[i].bytecode);
         if (pm->programs[i].vm) vm_destroy(pm->programs[i].vm);
+        if (pm->programs[i].native) aot_free(pm->programs[i].native);
+        ring_free(pm->programs[i].output);
     }
+    for (int i = 0; i < pm->vm_pool_count; i++) vm_destroy(pm->vm_pool[i]);
+    /* After every VM: pooled ones may still hold pointers into them */
+    for (int i = 0; i < pm->count; i++) native_free(pm->programs[i].natives);
     free(pm);
 }
 
+/*
+ * VM pool. Killed and replaced VMs go back to the pool instead of being
+ * destroyed; the next run takes any pooled VM whose regions are large
+ * enough for its program and vm_reset()s it, so a run normally costs no
+ * region allocations at all.
+ */
+static VM *acquire_vm(ProgramManager *pm, const BytecodeProgram *bc) {
+    VMLimits limits;
+    codegen_vm_limits(bc, &limits);
+
+    for (int i = pm->vm_pool_count - 1; i >= 0; i--) {
+        VM *vm = pm->vm_pool[i];
+        if (vm_reset(vm, &limits)) {
+            pm->vm_pool[i] = pm->vm_pool[--pm->vm_pool_count];
+            return vm;
+        }
+    }
+    return vm_create_sized(&limits);
+}
+
+static void release_vm(ProgramManager *pm, VM *vm) {
+    vm_set_input(vm, NULL);
+    if (pm->vm_pool_count < VM_POOL_SIZE) {
+        pm->vm_pool[pm->vm_pool_count++] = vm;
+    } else {
+        vm_destroy(vm);
+    }
+}
+
 static ProgramEntry *find_program(ProgramManager *pm, int pid) {
     for (int i = 0; i < pm->count; i++) {
         if (pm->programs[i].pid == pid) return &pm->programs[i];
@@ -45,40 +88,61 @@ static const char *state_str(ProgramState s) {
     return "UNKNOWN";
 }
 
-int pm_submit(ProgramManager *pm, const char *filename) {
+int pm_submit(ProgramManager *pm, const char *filename, CodegenEngine engine,
+              int opt_level, const char *natives_path) {
     if (pm->count >= MAX_PROGRAMS) {
         fprintf(stderr, "Error: max programs reached\n");
         return -1;
     }
 
+    NativeLib *natives = NULL;
+    if (natives_path) {
+        natives = native_load(natives_path);
+        if (!natives) return -1;
+    }
+
     FILE *f = fopen(filename, "r");
     if (!f) {
         fprintf(stderr, "Error: cannot open '%s'\n", filename);
+        native_free(natives);
         return -1;
     }
 
     /* Parse */
-    root = NULL;
-    yylineno = 1;
-    yyin = f;
-    int result = yyparse();
+    ASTNode *root = NULL;
+    yyscan_t scanner;
+    if (yylex_init(&scanner) != 0) {
+        fprintf(stderr, "Error: cannot create scanner\n");
+        fclose(f);
+        native_free(natives);
+        return -1;
+    }
+    yyset_in(f, scanner);
+    int result = yyparse(scanner, &root);
+    yylex_destroy(scanner);
     fclose(f);
-    yylex_destroy();
 
     if (result != 0 || !root) {
         fprintf(stderr, "Error: parse failed for '%s'\n", filename);
+        native_free(natives);
         return -1;
     }
 
     /* Compile */
-    BytecodeProgram *bc = codegen_compile(root);
+    root = ast_optimize(root, opt_level);
+    BytecodeProgram *bc = (engine == ENGINE_REG) ? codegen_compile_regs(root, natives)
+                                                 : codegen_compile(root, natives);
     ast_free(root);
-    root = NULL;
 
     if (!bc) {
         fprintf(stderr, "Error: codegen failed for '%s'\n", filename);
+        native_free(natives);
         return -1;
     }
+    if (bc->native_count == 0) {    /* nothing to keep the library open for */
+        native_free(natives);
+        natives = NULL;
+    }
 
     int pid = pm->next_pid++;
     ProgramEntry *entry = &pm->programs[pm->count++];
@@ -87,41 +151,178 @@ int pm_submit(ProgramManager *pm, const char *filename) {
     entry->state = PROG_SUBMITTED;
     entry->bytecode = bc;
     entry->vm = NULL;
-
-    printf("Program '%s' submitted as PID %d (%d bytes bytecode, %d vars)\n",
-           filename, pid, bc->code_size, bc->var_count);
+    entry->native = aot_load_cached(filename, bc);
+    entry->natives = natives;
+    entry->priority = 1;
+    entry->output = NULL;
+    entry->drop_output = false;
+
+    printf("Program '%s' submitted as PID %d (%d bytes bytecode, %d vars%s)\n",
+           filename, pid, bc->code_size, bc->var_count,
+           bc->engine == ENGINE_REG ? ", register engine" : "");
+    if (natives) {
+        printf("Calls %d native%s from '%s'\n", bc->native_count,
+               bc->native_count == 1 ? "" : "s", native_path(natives));
+    }
+    if (entry->native) {
+        printf("Using cached native code '%s'\n", aot_path(entry->native));
+    }
     return pid;
 }
 
-int pm_run(ProgramManager *pm, int pid) {
-    ProgramEntry *e = find_program(pm, pid);
-    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+/*
+ * Give vm e's program: the natives it calls are registered first, in
+ * OP_NATIVE index order, so the verifier can check every call. Prints an
+ * error and returns false if a native cannot be registered.
+ */
+static bool attach_entry(ProgramEntry *e, VM *vm) {
+    const BytecodeProgram *bc = e->bytecode;
+    for (int i = 0; i < bc->native_count; i++) {
+        const NativeDef *def = native_find(e->natives, bc->native_names[i]);
+        if (!def || vm_register_native(vm, def->name, def->fn, def->arity) != i) {
+            fprintf(stderr, "Error: cannot register native '%s'\n", bc->native_names[i]);
+            return false;
+        }
+    }
+    /* The VM borrows the bytecode; the entry outlives the VM's use of it */
+    vm_attach_program(vm, bc->code, bc->code_size);
+    return true;
+}
+
+/*
+ * VM for running e: a fresh one for a SUBMITTED program, or the existing
+ * one for a PAUSED program (left in the debugger, paused by the
+ * scheduler, or restored from a checkpoint), which continues where it
+ * stopped. Prints an error and returns NULL for any other state.
+ */
+static VM *prepare_vm(ProgramManager *pm, ProgramEntry *e) {
+    if (e->state == PROG_PAUSED && e->vm) return e->vm;
     if (e->state != PROG_SUBMITTED) {
-        fprintf(stderr, "Error: PID %d is %s (must be SUBMITTED)\n", pid, state_str(e->state));
-        return -1;
+        fprintf(stderr, "Error: PID %d is %s (must be SUBMITTED or PAUSED)\n",
+                e->pid, state_str(e->state));
+        return NULL;
     }
 
-    VM *vm = vm_create();
-    if (!vm) { fprintf(stderr, "Error: vm_create failed\n"); return -1; }
+    VM *vm = acquire_vm(pm, e->bytecode);
+    if (!vm) { fprintf(stderr, "Error: vm_create failed\n"); return NULL; }
+    if (!attach_entry(e, vm)) {
+        release_vm(pm, vm);
+        return NULL;
+    }
+    return vm;
+}
+
+static void finish_run(ProgramEntry *e, VMError err) {
+    vm_set_input(e->vm, NULL);   /* nothing reads it any more */
+    if (e->vm->out_dropped > 0) {
+        printf("(PID %d: %zu bytes of output lost: out of memory)\n",
+               e->pid, e->vm->out_dropped);
+        e->vm->out_dropped = 0;
+    }
+    if (err == VM_OK) {
+        e->state = PROG_FINISHED;
+        printf("PID %d finished successfully\n", e->pid);
+    } else {
+        e->state = PROG_ERROR;
+        fprintf(stderr, "PID %d error: %s\n", e->pid, vm_error_string(err));
+    }
+}
+
+/*
+ * Output channels. A program running in the background (start, runall)
+ * prints into its entry's ring instead of stdout, and tail/output/drop
+ * read it from the shell. When the ring is full the VM keeps the rest in
+ * its own buffer and the program is not run again until there is room,
+ * unless the entry drops output instead.
+ */
+static size_t ring_sink(void *ctx, const char *data, size_t len) {
+    ProgramEntry *e = ctx;
+    size_t n = ring_write(e->output, data, len);
+    if (n < len && e->drop_output) {
+        ring_count_dropped(e->output, len - n);
+        return len;
+    }
+    return n;
+}
+
+static bool attach_output(ProgramEntry *e) {
+    if (!e->output) e->output = ring_create(PM_OUTPUT_RING);
+    if (!e->output) {
+        fprintf(stderr, "Error: cannot allocate output buffer for PID %d\n", e->pid);
+        return false;
+    }
+    vm_set_output(e->vm, ring_sink, e);
+    return true;
+}
+
+/* Copy what is in e's ring to f; returns the byte count */
+static size_t drain_output(ProgramEntry *e, FILE *f) {
+    size_t total = 0;
+    const char *data;
+    size_t n;
+    if (!e->output) return 0;
+    while ((n = ring_peek(e->output, &data)) > 0) {
+        fwrite(data, 1, n, f);
+        ring_consume(e->output, n);
+        total += n;
+    }
+    return total;
+}
+
+/* Drain the ring and whatever the VM is still holding back */
+static size_t drain_all_output(ProgramEntry *e, FILE *f) {
+    size_t total = drain_output(e, f);
+    while (e->vm && e->vm->out_len > 0) {
+        vm_flush_output(e->vm);
+        total += drain_output(e, f);
+    }
+    return total;
+}
+
+static void report_dropped(ProgramEntry *e) {
+    size_t dropped = e->output ? ring_take_dropped(e->output) : 0;
+    if (dropped > 0) {
+        printf("(PID %d: %zu bytes of output dropped)\n", e->pid, dropped);
+    }
+}
+
+/* Open the file named by `run <pid> < file` or `start <pid> < file`; a
+   program run without one keeps the input it has (if any) */
+static bool open_input(const char *path, VMInput **in) {
+    *in = NULL;
+    if (!path) return true;
+    *in = input_open(path);
+    return *in != NULL;
+}
 
-    /* Copy bytecode so VM doesn't own it */
-    uint8_t *code_copy = malloc(e->bytecode->code_size);
-    memcpy(code_copy, e->bytecode->code, e->bytecode->code_size);
-    vm_load_program(vm, code_copy, e->bytecode->code_size);
+int pm_run(ProgramManager *pm, int pid, bool use_jit, const char *input) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    bool resume = e->state == PROG_PAUSED && e->vm;
+    VMInput *in;
+    if (!open_input(input, &in)) return -1;
+    VM *vm = prepare_vm(pm, e);
+    if (!vm) { input_close(in); return -1; }
+    if (in) vm_set_input(vm, in);
+    vm_set_output(vm, NULL, NULL);   /* foreground: straight to stdout */
+    if (use_jit && !jit_available()) {
+        fprintf(stderr, "Warning: no JIT on this platform, using the interpreter\n");
+    }
+    vm->jit_enabled = use_jit;
 
     e->vm = vm;
     e->state = PROG_RUNNING;
 
-    printf("Running PID %d...\n", pid);
-    VMError err = vm_run(vm);
-
-    if (err == VM_OK) {
-        e->state = PROG_FINISHED;
-        printf("PID %d finished successfully\n", pid);
+    VMError err;
+    if (resume) {
+        printf("Resuming PID %d at pc %d...\n", pid, vm->pc);
+        err = vm_run(vm);
     } else {
-        e->state = PROG_ERROR;
-        fprintf(stderr, "PID %d error: %s\n", pid, vm_error_string(err));
+        printf("Running PID %d...\n", pid);
+        err = e->native ? aot_run(e->native, vm) : vm_run(vm);
     }
+
+    finish_run(e, err);
     return 0;
 }
 
@@ -133,14 +334,14 @@ int pm_debug(ProgramManager *pm, int pid) {
         return -1;
     }
 
-    VM *vm = vm_create();
+    VM *vm = acquire_vm(pm, e->bytecode);
     if (!vm) { fprintf(stderr, "Error: vm_create failed\n"); return -1; }
+    if (!attach_entry(e, vm)) {
+        release_vm(pm, vm);
+        return -1;
+    }
 
-    uint8_t *code_copy = malloc(e->bytecode->code_size);
-    memcpy(code_copy, e->bytecode->code, e->bytecode->code_size);
-    vm_load_program(vm, code_copy, e->bytecode->code_size);
-
-    if (e->vm) vm_destroy(e->vm);
+    if (e->vm) release_vm(pm, e->vm);
     e->vm = vm;
     e->state = PROG_PAUSED;
 
@@ -154,13 +355,376 @@ int pm_debug(ProgramManager *pm, int pid) {
     return 0;
 }
 
+int pm_compile(ProgramManager *pm, int pid) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    if (e->native) {
+        printf("PID %d already has native code '%s'\n", pid, aot_path(e->native));
+        return 0;
+    }
+    if (e->bytecode->native_count > 0) {
+        fprintf(stderr, "Error: PID %d calls natives; run it on the interpreter or the JIT\n", pid);
+        return -1;
+    }
+
+    e->native = aot_compile(e->filename, e->bytecode);
+    if (!e->native) return -1;
+    printf("PID %d compiled to '%s'\n", pid, aot_path(e->native));
+    return 0;
+}
+
+int pm_checkpoint(ProgramManager *pm, int pid, const char *path) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    if (!e->vm) { fprintf(stderr, "Error: PID %d has no VM instance\n", pid); return -1; }
+    if (e->bytecode->native_count > 0) {
+        /* The natives' library is not part of the file */
+        fprintf(stderr, "Error: PID %d calls natives and cannot be checkpointed\n", pid);
+        return -1;
+    }
+
+    VMSnapshot *snap = vm_snapshot(e->vm);
+    if (!snap) { fprintf(stderr, "Error: out of memory\n"); return -1; }
+    long size = checkpoint_save(path, e->filename, e->bytecode, snap);
+    vm_snapshot_free(snap);
+    if (size < 0) return -1;
+
+    printf("PID %d checkpointed to '%s' (%ld bytes, pc %d)\n", pid, path, size, e->vm->pc);
+    return 0;
+}
+
+/* A restored program gets a new PID; native code is not reattached,
+   since it can only start a program from the beginning */
+int pm_restore(ProgramManager *pm, const char *path) {
+    if (pm->count >= MAX_PROGRAMS) {
+        fprintf(stderr, "Error: max programs reached\n");
+        return -1;
+    }
+
+    char *source = NULL;
+    BytecodeProgram *bc = NULL;
+    VMSnapshot *snap = NULL;
+    if (!checkpoint_load(path, &source, &bc, &snap)) return -1;
+
+    VM *vm = acquire_vm(pm, bc);
+    if (!vm) {
+        fprintf(stderr, "Error: vm_create failed\n");
+        free(source); codegen_free(bc); vm_snapshot_free(snap);
+        return -1;
+    }
+    vm_attach_program(vm, bc->code, bc->code_size);
+    bool ok = vm_restore(vm, snap);
+    vm_snapshot_free(snap);
+    if (!ok) {
+        fprintf(stderr, "Error: checkpoint '%s' does not match its program\n", path);
+        release_vm(pm, vm);
+        free(source); codegen_free(bc);
+        return -1;
+    }
+
+    int pid = pm->next_pid++;
+    ProgramEntry *entry = &pm->programs[pm->count++];
+    entry->pid = pid;
+    entry->filename = source;
+    entry->bytecode = bc;
+    entry->vm = vm;
+    entry->native = NULL;
+    entry->natives = NULL;
+    entry->priority = 1;
+    entry->output = NULL;
+    entry->drop_output = false;
+    if (vm->running) entry->state = PROG_PAUSED;
+    else entry->state = vm->error != VM_OK ? PROG_ERROR : PROG_FINISHED;
+
+    printf("Restored '%s' from '%s' as PID %d (%s at pc %d, %llu instructions)\n",
+           source, path, pid, state_str(entry->state), vm->pc,
+           (unsigned long long)vm->instr_count);
+    return pid;
+}
+
+/*
+ * Cooperative scheduler. pm_start() marks a program RUNNING; each call to
+ * pm_schedule() is one round in which every RUNNING program, in PID
+ * order, gets a vm_run_slice() of priority * quantum instructions. The
+ * shell runs rounds while it waits for input, and `wait` runs them until
+ * nothing is left RUNNING.
+ */
+int pm_start(ProgramManager *pm, int pid, int priority, const char *input) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    if (priority < 1) {
+        fprintf(stderr, "Error: priority must be at least 1\n");
+        return -1;
+    }
+
+    VMInput *in;
+    if (!open_input(input, &in)) return -1;
+    VM *vm = prepare_vm(pm, e);
+    if (!vm) { input_close(in); return -1; }
+    if (in) vm_set_input(vm, in);
+    if (e->vm != vm) {
+        e->vm = vm;
+        e->state = PROG_PAUSED;   /* has a VM now, even if the ring fails */
+    }
+    if (!attach_output(e)) return -1;
+    e->priority = priority;
+    e->state = PROG_RUNNING;
+    printf("PID %d started (priority %d)\n", pid, priority);
+    return 0;
+}
+
+int pm_pause(ProgramManager *pm, int pid) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    if (e->state != PROG_RUNNING) {
+        fprintf(stderr, "Error: PID %d is %s (must be RUNNING)\n", pid, state_str(e->state));
+        return -1;
+    }
+
+    e->state = PROG_PAUSED;
+    printf("PID %d paused at pc %d\n", pid, e->vm->pc);
+    return 0;
+}
+
+/* One round; returns how many programs are still RUNNING */
+int pm_schedule(ProgramManager *pm) {
+    int runnable = 0;
+    for (int i = 0; i < pm->count; i++) {
+        ProgramEntry *e = &pm->programs[i];
+        if (e->state != PROG_RUNNING) continue;
+        if (!vm_flush_output(e->vm)) continue;   /* ring full: hold back */
+
+        VMError err = vm_run_slice(e->vm, (uint64_t)e->priority * pm->quantum);
+        if (e->vm->running) runnable++;
+        else finish_run(e, err);
+    }
+    return runnable;
+}
+
+/* Rounds until nothing is RUNNING, or until *interrupted is set */
+void pm_wait(ProgramManager *pm, const volatile sig_atomic_t *interrupted) {
+    while (pm_schedule(pm) > 0 && !*interrupted) {
+    }
+    if (*interrupted) return;
+
+    int blocked = 0;
+    for (int i = 0; i < pm->count; i++) {
+        if (pm->programs[i].state == PROG_RUNNING) blocked++;
+    }
+    if (blocked > 0) {
+        printf("%d programs are waiting for their output to be read "
+               "(tail, output or drop)\n", blocked);
+    }
+}
+
+/*
+ * pm_run_all(): programs run in parallel on a work-stealing pool, one
+ * VM per task. Workers touch nothing but their task's VM and output ring;
+ * they report each program that ends through `finished`, and only the
+ * shell thread changes entry states and prints. Output is shown in PID
+ * order: the shell streams the lowest-numbered unfinished program's ring
+ * while the others fill theirs. A program whose ring is full is parked
+ * in the pool, and the shell wakes the parked programs whenever it has
+ * drained some output, so waiting for room costs no CPU. A program a worker was running
+ * when the run is interrupted is left RUNNING with its VM mid-slice, so
+ * the background scheduler picks it up from there.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    VMError *errors;            /* indexed like pm->programs */
+    bool *finished;
+    ProgramEntry *programs;
+    int quantum;
+    atomic_bool stop;
+} RunAll;
+
+static bool run_all_task(void *task, void *arg) {
+    ProgramEntry *e = task;
+    RunAll *ra = arg;
+    uint64_t budget = (uint64_t)e->priority * ra->quantum;
+
+    VMError err;
+    do {
+        if (!vm_flush_output(e->vm)) return false;   /* ring full: wait */
+        err = vm_run_slice(e->vm, budget);
+    } while (e->vm->running && !atomic_load(&ra->stop));
+    if (e->vm->running) return false;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->errors[e - ra->programs] = err;
+    ra->finished[e - ra->programs] = true;
+    pthread_cond_signal(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+    return true;
+}
+
+int pm_run_all(ProgramManager *pm, int nthreads,
+               const volatile sig_atomic_t *interrupted) {
+    if (nthreads < 1) nthreads = workers_default_count();
+
+    ProgramEntry **tasks = calloc(pm->count + 1, sizeof(ProgramEntry *));
+    int ntasks = 0;
+    for (int i = 0; i < pm->count; i++) {
+        ProgramEntry *e = &pm->programs[i];
+        if (e->state == PROG_SUBMITTED ||
+            (e->state == PROG_PAUSED && e->vm)) {
+            VM *vm = prepare_vm(pm, e);
+            if (!vm) continue;
+            e->vm = vm;
+            e->state = PROG_RUNNING;
+        }
+        if (e->state == PROG_RUNNING && attach_output(e)) tasks[ntasks++] = e;
+    }
+    if (ntasks == 0) {
+        printf("No programs to run\n");
+        free(tasks);
+        return 0;
+    }
+
+    RunAll ra = {0};
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.changed, NULL);
+    ra.errors = calloc(pm->count, sizeof(VMError));
+    ra.finished = calloc(pm->count, sizeof(bool));
+    ra.programs = pm->programs;
+    ra.quantum = pm->quantum;
+    atomic_init(&ra.stop, false);
+
+    WorkerPool *wp = workers_start(nthreads, (void **)tasks, ntasks,
+                                   run_all_task, &ra);
+    if (!wp) {
+        fprintf(stderr, "Error: cannot start worker threads\n");
+        free(ra.errors);
+        free(ra.finished);
+        free(tasks);
+        return -1;
+    }
+    printf("Running %d programs on %d workers\n", ntasks,
+           nthreads < ntasks ? nthreads : ntasks);
+    fflush(stdout);
+
+    /* Stream output in PID order. The wait times out so that new output
+       and Ctrl-C, neither of which signals the condition variable, are
+       still noticed. */
+    int current = 0;
+    while (current < ntasks && !*interrupted) {
+        ProgramEntry *e = tasks[current];
+        bool copied = drain_output(e, stdout) > 0;
+        if (copied) workers_wake(wp);
+
+        pthread_mutex_lock(&ra.lock);
+        bool done = ra.finished[e - pm->programs];
+        if (!done && !copied) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 10 * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ra.changed, &ra.lock, &until);
+        }
+        pthread_mutex_unlock(&ra.lock);
+
+        /* Its worker is done with the VM, so what is left in the VM's
+           own buffer can be moved through the ring here */
+        if (done && vm_flush_output(e->vm) && ring_used(e->output) == 0) {
+            report_dropped(e);
+            finish_run(e, ra.errors[e - pm->programs]);
+            fflush(stdout);
+            current++;
+        }
+    }
+
+    atomic_store(&ra.stop, true);
+    workers_stop(wp);
+    int steals = workers_join(wp);
+    int left = 0;
+    for (int i = current; i < ntasks; i++) {
+        if (ra.finished[tasks[i] - pm->programs]) {
+            finish_run(tasks[i], ra.errors[tasks[i] - pm->programs]);
+        } else {
+            left++;
+        }
+    }
+    if (left > 0) printf("Interrupted: %d programs left RUNNING\n", left);
+    if (current < ntasks) {
+        printf("Output not shown yet stays buffered (tail <pid>)\n");
+    }
+    if (steals > 0) printf("(%d programs moved between workers)\n", steals);
+
+    pthread_cond_destroy(&ra.changed);
+    pthread_mutex_destroy(&ra.lock);
+    free(ra.errors);
+    free(ra.finished);
+    free(tasks);
+    return 0;
+}
+
+int pm_tail(ProgramManager *pm, int pid) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    drain_all_output(e, stdout);
+    report_dropped(e);
+    return 0;
+}
+
+int pm_output(ProgramManager *pm, int pid, const char *path) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open '%s'\n", path);
+        return -1;
+    }
+    size_t n = drain_all_output(e, f);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error: writing '%s' failed\n", path);
+        return -1;
+    }
+    printf("Wrote %zu bytes of output from PID %d to '%s'\n", n, pid, path);
+    report_dropped(e);
+    return 0;
+}
+
+int pm_drop(ProgramManager *pm, int pid) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    size_t n = e->vm ? e->vm->out_len : 0;
+    if (e->vm) e->vm->out_len = 0;
+    if (e->output) {
+        n += ring_used(e->output);
+        ring_consume(e->output, ring_used(e->output));
+        ring_take_dropped(e->output);
+    }
+    printf("Dropped %zu bytes of output from PID %d\n", n, pid);
+    return 0;
+}
+
+int pm_set_output_policy(ProgramManager *pm, int pid, bool drop) {
+    ProgramEntry *e = find_program(pm, pid);
+    if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
+    e->drop_output = drop;
+    printf("PID %d %s output when its buffer is full\n", pid, drop ? "drops" : "waits with");
+    return 0;
+}
+
+void pm_set_quantum(ProgramManager *pm, int quantum) {
+    if (quantum < 1) {
+        fprintf(stderr, "Error: quantum must be at least 1\n");
+        return;
+    }
+    pm->quantum = quantum;
+}
+
 int pm_kill(ProgramManager *pm, int pid) {
     ProgramEntry *e = find_program(pm, pid);
     if (!e) { fprintf(stderr, "Error: PID %d not found\n", pid); return -1; }
 
     if (e->vm) {
         e->vm->running = false;
-        vm_destroy(e->vm);
+        release_vm(pm, e->vm);
         e->vm = NULL;
     }
     e->state = PROG_FINISHED;
@@ -177,8 +741,45 @@ int pm_memstat(ProgramManager *pm, int pid) {
     printf("GC Objects:    %d\n", e->vm->num_objects);
     printf("GC Threshold:  %d\n", e->vm->max_objects);
     printf("Auto GC:       %s\n", e->vm->auto_gc ? "enabled" : "disabled");
+    if (e->vm->gc_runs > 0) {
+        printf("GC Runs:       %llu (%llu freed, %.3f ms)\n",
+               (unsigned long long)e->vm->gc_runs, (unsigned long long)e->vm->gc_freed,
+               e->vm->gc_ns / 1e6);
+    }
     printf("Stack Depth:   %d\n", e->vm->sp);
     printf("Memory Slots:  %d used\n", e->bytecode->var_count);
+    if (e->bytecode->array_count > 0) {
+        int elements = 0;
+        for (int i = 0; i < e->bytecode->array_count; i++) elements += e->bytecode->arrays[i].length;
+        printf("Arrays:        %d (%d slots)\n", e->bytecode->array_count, elements);
+    }
+    if (e->bytecode->function_count > 0) {
+        printf("Functions:     %d (%d frames live)\n", e->bytecode->function_count, e->vm->rsp / 2);
+    }
+    printf("VM Regions:    %d memory slots, %d stack entries\n",
+           e->vm->memory_size, e->vm->stack_size);
+    printf("Instructions:  %llu\n", (unsigned long long)e->vm->instr_count);
+    if (e->vm->verified) {
+        printf("Verified:      yes (max stack depth %d", e->vm->max_stack_depth);
+        if (e->bytecode->function_count > 0) printf(", frame depth %d", e->vm->frame_depth);
+        printf(")\n");
+    } else {
+        printf("Verified:      no (checked interpreter)\n");
+    }
+    if (e->vm->quickened > 0) {
+        printf("Quickened:     %d records\n", e->vm->quickened);
+    }
+    if (e->native) {
+        printf("Native Code:   %s (aot)\n", aot_path(e->native));
+    }
+    if (e->vm->jit) {
+        printf("Native Code:   %zu bytes (jit)\n", jit_code_size(e->vm->jit));
+    }
+    for (int i = 0; i < e->vm->native_count; i++) {
+        const VMNative *n = &e->vm->natives[i];
+        printf("%-15s%s(): %llu calls, %.3f ms\n", i == 0 ? "Natives:" : "", n->name,
+               (unsigned long long)n->calls, n->ns / 1e6);
+    }
     return 0;
 }
 
@@ -188,7 +789,10 @@ int pm_gc(ProgramManager *pm, int pid) {
     if (!e->vm) { fprintf(stderr, "Error: PID %d has no VM instance\n", pid); return -1; }
 
     printf("Forcing GC on PID %d...\n", pid);
+    int before = e->vm->num_objects;
     gc_collect(e->vm);
+    printf("[GC] Collected %d objects, %d remaining\n",
+           before - e->vm->num_objects, e->vm->num_objects);
     return 0;
 }
 
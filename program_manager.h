@@ -1,10 +1,16 @@
 #ifndef PROGRAM_MANAGER_H
 #define PROGRAM_MANAGER_H
 
+#include <signal.h>
 #include "codegen.h"
 #include "vm.h"
+#include "aot.h"
+#include "ring.h"
 
-#define MAX_PROGRAMS 64
+#define MAX_PROGRAMS 1024
+#define VM_POOL_SIZE 8     /* idle VMs kept for reuse by pm_run()/pm_debug() */
+#define PM_DEFAULT_QUANTUM 10000   /* instructions per scheduler turn at priority 1 */
+#define PM_OUTPUT_RING (1 << 20)   /* bytes of output buffered per background program */
 
 typedef enum {
     PROG_SUBMITTED,
@@ -20,20 +26,43 @@ typedef struct {
     ProgramState state;
     BytecodeProgram *bytecode;
     VM *vm;
+    AotProgram *native;    /* set by pm_compile() or a cached object */
+    NativeLib *natives;    /* host functions the program calls, or NULL */
+    int priority;          /* scheduler turns are priority * quantum long */
+    ByteRing *output;      /* background output, read by tail/output/drop */
+    bool drop_output;      /* discard output that does not fit instead of waiting */
 } ProgramEntry;
 
 typedef struct {
     ProgramEntry programs[MAX_PROGRAMS];
     int count;
     int next_pid;
+    VM *vm_pool[VM_POOL_SIZE];
+    int vm_pool_count;
+    int quantum;
 } ProgramManager;
 
 ProgramManager *pm_create(void);
 void pm_destroy(ProgramManager *pm);
 
-int pm_submit(ProgramManager *pm, const char *filename);
-int pm_run(ProgramManager *pm, int pid);
+int pm_submit(ProgramManager *pm, const char *filename, CodegenEngine engine,
+              int opt_level, const char *natives_path);
+int pm_run(ProgramManager *pm, int pid, bool use_jit, const char *input);
 int pm_debug(ProgramManager *pm, int pid);
+int pm_compile(ProgramManager *pm, int pid);
+int pm_checkpoint(ProgramManager *pm, int pid, const char *path);
+int pm_restore(ProgramManager *pm, const char *path);
+int pm_start(ProgramManager *pm, int pid, int priority, const char *input);
+int pm_pause(ProgramManager *pm, int pid);
+int pm_schedule(ProgramManager *pm);
+void pm_wait(ProgramManager *pm, const volatile sig_atomic_t *interrupted);
+int pm_run_all(ProgramManager *pm, int nthreads,
+               const volatile sig_atomic_t *interrupted);
+int pm_tail(ProgramManager *pm, int pid);
+int pm_output(ProgramManager *pm, int pid, const char *path);
+int pm_drop(ProgramManager *pm, int pid);
+int pm_set_output_policy(ProgramManager *pm, int pid, bool drop);
+void pm_set_quantum(ProgramManager *pm, int quantum);
 int pm_kill(ProgramManager *pm, int pid);
 int pm_memstat(ProgramManager *pm, int pid);
 int pm_gc(ProgramManager *pm, int pid);
@@ -0,0 +1,91 @@
+/*
+ * ring.c - Lock-free single-producer/single-consumer byte ring (see ring.h)
+ *
+ * head and tail count bytes written and read since creation; the
+ * capacity is a power of two, so the buffer index is the count masked.
+ * Only the producer stores head and only the consumer stores tail. The
+ * release store of one pairs with the acquire load in the other, so the
+ * bytes a side sees announced are already in the buffer (or already
+ * copied out of it).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+struct ByteRing {
+    char *data;
+    size_t mask;
+    atomic_size_t head;       /* bytes written (producer) */
+    atomic_size_t tail;       /* bytes read (consumer) */
+    atomic_size_t dropped;    /* bytes the producer discarded */
+};
+
+ByteRing *ring_create(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity) cap <<= 1;
+
+    ByteRing *r = malloc(sizeof(ByteRing));
+    if (!r) return NULL;
+    r->data = malloc(cap);
+    if (!r->data) { free(r); return NULL; }
+    r->mask = cap - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->dropped, 0);
+    return r;
+}
+
+void ring_free(ByteRing *r) {
+    if (!r) return;
+    free(r->data);
+    free(r);
+}
+
+/* Copy as much of data as fits; returns the number of bytes taken */
+size_t ring_write(ByteRing *r, const char *data, size_t len) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t space = r->mask + 1 - (head - tail);
+    if (len > space) len = space;
+
+    size_t at = head & r->mask;
+    size_t first = r->mask + 1 - at;
+    if (first > len) first = len;
+    memcpy(r->data + at, data, first);
+    memcpy(r->data, data + first, len - first);
+
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    return len;
+}
+
+void ring_count_dropped(ByteRing *r, size_t len) {
+    atomic_fetch_add_explicit(&r->dropped, len, memory_order_relaxed);
+}
+
+size_t ring_used(ByteRing *r) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    return head - tail;
+}
+
+/* Point data at the oldest unread bytes; returns how many are contiguous
+   there (the rest, if any, wraps to the start of the buffer) */
+size_t ring_peek(ByteRing *r, const char **data) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t used = ring_used(r);
+    size_t at = tail & r->mask;
+    size_t first = r->mask + 1 - at;
+    *data = r->data + at;
+    return used < first ? used : first;
+}
+
+void ring_consume(ByteRing *r, size_t len) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+}
+
+/* Dropped byte count since the last call */
+size_t ring_take_dropped(ByteRing *r) {
+    return atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+}
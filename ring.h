@@ -0,0 +1,28 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/*
+ * Single-producer/single-consumer byte ring. One thread writes with
+ * ring_write() while another reads with ring_peek()/ring_consume(); no
+ * locks are taken. Neither side ever waits: a write takes only what fits
+ * and a read only what is there, and the caller decides what to do with
+ * the rest.
+ */
+typedef struct ByteRing ByteRing;
+
+ByteRing *ring_create(size_t capacity);
+void ring_free(ByteRing *r);
+
+/* Producer */
+size_t ring_write(ByteRing *r, const char *data, size_t len);
+void ring_count_dropped(ByteRing *r, size_t len);
+
+/* Consumer */
+size_t ring_used(ByteRing *r);
+size_t ring_peek(ByteRing *r, const char **data);
+void ring_consume(ByteRing *r, size_t len);
+size_t ring_take_dropped(ByteRing *r);
+
+#endif
@@ -4,7 +4,10 @@
  * Base: Lab 1 myshell.c (copied verbatim with original function names and style)
  * LAB6 CHANGES:
  *   - Extracted main() loop into shell_run(ProgramManager *pm)
- *   - Added builtin dispatch for: submit, run, debug, kill, memstat, gc, leaks, ps
+ *   - Added builtin dispatch for: submit, run, compile, debug, kill, memstat, gc, leaks, ps,
+ *     checkpoint, restore, start, pause, wait, quantum, runall, tail, output, drop
+ *   - `run`/`start` take `< file` as the program's input for read() and eof()
+ *   - Programs started with `start` run in scheduler rounds while the shell waits for input
  *   - Original builtins (cd, exit) and fork/exec/pipe logic preserved unchanged
  */
 #include <stdio.h>
@@ -16,15 +19,21 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include "shell.h"
+#include "optimize.h"
 
 #define MAX_CMD_LEN 1024
 #define MAX_ARGS 64
 
+/* LAB6 CHANGE: set by sigint_handler; stops a `wait` or `runall` */
+static volatile sig_atomic_t interrupted = 0;
+
 /* LAB6 CHANGE: sigint_handler adapted - no longer prints prompt
    (shell_run loop handles reprompting) */
 static void sigint_handler(int sig) {
     (void)sig;
+    interrupted = 1;
     write(STDOUT_FILENO, "\n", 1);
 }
 
@@ -138,19 +147,53 @@ static void free_command_sb(Command *c) {
 
 /*
  * LAB6 CHANGE: handle_lab6_builtin() - returns 1 if command was a lab6 builtin, 0 otherwise.
- * This is called BEFORE the original cd/exit/fork-exec path.
+ * This is called BEFORE the original cd/exit/fork-exec path. infile and
+ * outfile are the command's `< file` and `> file` redirections, if any.
  */
-static int handle_lab6_builtin(char **tokens, int ntok, ProgramManager *pm) {
+static int handle_lab6_builtin(char **tokens, int ntok, const char *infile,
+                               const char *outfile, ProgramManager *pm) {
     if (ntok == 0) return 0;
 
     if (strcmp(tokens[0], "submit") == 0) {
-        if (ntok < 2) { fprintf(stderr, "Usage: submit <file>\n"); return 1; }
-        pm_submit(pm, tokens[1]);
+        const char *usage = "Usage: submit <file> [stack|reg] [-O0|-O1|-O2] [natives.so]\n";
+        if (ntok < 2) { fprintf(stderr, "%s", usage); return 1; }
+        CodegenEngine engine = ENGINE_STACK;
+        int opt_level = OPT_LEVEL_DEFAULT;
+        const char *natives = NULL;
+        for (int i = 2; i < ntok; i++) {
+            if (strcmp(tokens[i], "reg") == 0) {
+                engine = ENGINE_REG;
+            } else if (strcmp(tokens[i], "stack") == 0) {
+                engine = ENGINE_STACK;
+            } else if (strncmp(tokens[i], "-O", 2) == 0) {
+                char *end;
+                long level = strtol(tokens[i] + 2, &end, 10);
+                if (tokens[i][2] == '\0' || *end || level < 0 || level > OPT_LEVEL_MAX) {
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                opt_level = (int)level;
+            } else if (!natives) {
+                natives = tokens[i];
+            } else {
+                fprintf(stderr, "%s", usage);
+                return 1;
+            }
+        }
+        pm_submit(pm, tokens[1], engine, opt_level, natives);
         return 1;
     }
     if (strcmp(tokens[0], "run") == 0) {
-        if (ntok < 2) { fprintf(stderr, "Usage: run <pid>\n"); return 1; }
-        pm_run(pm, atoi(tokens[1]));
+        bool use_jit = false;
+        if (ntok < 2) { fprintf(stderr, "Usage: run <pid> [jit] [< input]\n"); return 1; }
+        if (ntok >= 3) {
+            if (strcmp(tokens[2], "jit") != 0) {
+                fprintf(stderr, "Usage: run <pid> [jit] [< input]\n");
+                return 1;
+            }
+            use_jit = true;
+        }
+        pm_run(pm, atoi(tokens[1]), use_jit, infile);
         return 1;
     }
     if (strcmp(tokens[0], "debug") == 0) {
@@ -158,6 +201,74 @@ static int handle_lab6_builtin(char **tokens, int ntok, ProgramManager *pm) {
         pm_debug(pm, atoi(tokens[1]));
         return 1;
     }
+    if (strcmp(tokens[0], "compile") == 0) {
+        if (ntok < 2) { fprintf(stderr, "Usage: compile <pid>\n"); return 1; }
+        pm_compile(pm, atoi(tokens[1]));
+        return 1;
+    }
+    if (strcmp(tokens[0], "checkpoint") == 0) {
+        if (ntok < 3) { fprintf(stderr, "Usage: checkpoint <pid> <file>\n"); return 1; }
+        pm_checkpoint(pm, atoi(tokens[1]), tokens[2]);
+        return 1;
+    }
+    if (strcmp(tokens[0], "restore") == 0) {
+        if (ntok < 2) { fprintf(stderr, "Usage: restore <file>\n"); return 1; }
+        pm_restore(pm, tokens[1]);
+        return 1;
+    }
+    if (strcmp(tokens[0], "start") == 0) {
+        if (ntok < 2) { fprintf(stderr, "Usage: start <pid> [priority] [< input]\n"); return 1; }
+        pm_start(pm, atoi(tokens[1]), ntok >= 3 ? atoi(tokens[2]) : 1, infile);
+        return 1;
+    }
+    if (strcmp(tokens[0], "pause") == 0) {
+        if (ntok < 2) { fprintf(stderr, "Usage: pause <pid>\n"); return 1; }
+        pm_pause(pm, atoi(tokens[1]));
+        return 1;
+    }
+    if (strcmp(tokens[0], "wait") == 0) {
+        interrupted = 0;
+        pm_wait(pm, &interrupted);
+        return 1;
+    }
+    if (strcmp(tokens[0], "runall") == 0) {
+        int threads = 0;
+        if (ntok >= 3 && strcmp(tokens[1], "-j") == 0) {
+            threads = atoi(tokens[2]);
+        } else if (ntok != 1) {
+            fprintf(stderr, "Usage: runall [-j threads]\n");
+            return 1;
+        }
+        interrupted = 0;
+        pm_run_all(pm, threads, &interrupted);
+        return 1;
+    }
+    if (strcmp(tokens[0], "tail") == 0) {
+        if (ntok < 2) { fprintf(stderr, "Usage: tail <pid>\n"); return 1; }
+        pm_tail(pm, atoi(tokens[1]));
+        return 1;
+    }
+    if (strcmp(tokens[0], "output") == 0) {
+        if (ntok == 2 && outfile) {
+            pm_output(pm, atoi(tokens[1]), outfile);
+        } else if (ntok == 3 && !outfile &&
+                   (strcmp(tokens[2], "block") == 0 || strcmp(tokens[2], "drop") == 0)) {
+            pm_set_output_policy(pm, atoi(tokens[1]), strcmp(tokens[2], "drop") == 0);
+        } else {
+            fprintf(stderr, "Usage: output <pid> > <file> | output <pid> block|drop\n");
+        }
+        return 1;
+    }
+    if (strcmp(tokens[0], "drop") == 0) {
+        if (ntok < 2) { fprintf(stderr, "Usage: drop <pid>\n"); return 1; }
+        pm_drop(pm, atoi(tokens[1]));
+        return 1;
+    }
+    if (strcmp(tokens[0], "quantum") == 0) {
+        if (ntok >= 2) pm_set_quantum(pm, atoi(tokens[1]));
+        printf("Quantum: %d instructions\n", pm->quantum);
+        return 1;
+    }
     if (strcmp(tokens[0], "kill") == 0) {
         if (ntok < 2) { fprintf(stderr, "Usage: kill <pid>\n"); return 1; }
         pm_kill(pm, atoi(tokens[1]));
@@ -196,7 +307,7 @@ static int execute_single_sb(Command *cmd, ProgramManager *pm) {
     /* Count args for builtin dispatch */
     int argc = 0;
     while (cmd->argv[argc]) argc++;
-    if (handle_lab6_builtin(cmd->argv, argc, pm)) return 0;
+    if (handle_lab6_builtin(cmd->argv, argc, cmd->infile, cmd->outfile, pm)) return 0;
 
     /* Original Lab 1 builtins */
     if (strcmp(cmd->argv[0],"exit") == 0) {
@@ -293,6 +404,17 @@ static int execute_pipe_sb(Command *left,Command *right) {
     return 0;
 }
 
+/*
+ * LAB6 CHANGE: give started programs scheduler rounds until a command is
+ * typed (stdin readable or at EOF) or none of them is left running.
+ */
+static void run_until_input(ProgramManager *pm) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    while (poll(&pfd, 1, 0) == 0 && pm_schedule(pm) > 0) {
+        fflush(stdout);
+    }
+}
+
 /*
  * shell_run() - Lab 1 main() loop extracted into a function.
  * LAB6 CHANGE: takes ProgramManager, passes it to execute_single_sb.
@@ -302,10 +424,13 @@ void shell_run(ProgramManager *pm) {
     char input[MAX_CMD_LEN];
     signal(SIGINT,sigint_handler);
     signal(SIGCHLD,sigchld_handler);
+    /* LAB6 CHANGE: unbuffered, so poll() on fd 0 sees every pending line */
+    setvbuf(stdin,NULL,_IONBF,0);
 
     while (1) {
         printf("myshell> ");
         fflush(stdout);
+        run_until_input(pm);
         if (fgets(input,MAX_CMD_LEN,stdin) == NULL) break;
         input[strcspn(input,"\n")]=0;
 	 char *lineptr=trim_sb(input);
@@ -0,0 +1,633 @@
+/*
+ * snapshot.c - VM snapshots and checkpoint files
+ *
+ * A snapshot copies only what a run can have changed: the live part of
+ * the operand and return stacks, the program's memory slots and the heap
+ * objects. With regions sized per program that is a
+ * few hundred bytes for the sample programs, so taking one costs a few
+ * small copies rather than a copy of the whole VM.
+ *
+ * Checkpoint files start with an 8-byte magic ("LABCKPT" and a format
+ * version) followed by unsigned LEB128 varints, signed values zigzag
+ * encoded:
+ *   program  source name, engine, code, variable names, arrays (name,
+ *            base, length), functions (name, params, local names, entry,
+ *            line), memory_slots, max_stack_depth, source map
+ *   state    code hash, pc, sp, fp, rsp, running, error, instr_count, stack,
+ *            memory, return stack, GC settings, heap objects
+ * Objects keep their reference index, so the reference words on the stack,
+ * in memory and in pair fields are written as plain integers. Closure
+ * pointers are written as object index + 1 (0 for NULL). A file is
+ * written to "<path>.tmp" and renamed into place, so an interrupted
+ * checkpoint never replaces a good one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "snapshot.h"
+
+#define CKPT_MAGIC      "LABCKPT\004"
+#define CKPT_MAGIC_LEN  8
+#define CKPT_MAX_STRING 4096
+#define CKPT_MAX_COUNT  (1 << 24)   /* sanity bound for counts read from a file */
+
+typedef struct {
+    uint8_t type;           /* ObjectType */
+    int32_t ref;            /* reference index */
+    int32_t left, right;    /* OBJ_PAIR words */
+    uint32_t a, b;          /* closure fn/env: index + 1 */
+    void *function_ptr;     /* OBJ_FUNCTION; not written to files */
+} SnapObject;
+
+struct VMSnapshot {
+    uint32_t code_hash;
+    int code_size;
+
+    int pc;
+    int sp;
+    int fp;
+    int rsp;
+    bool running;
+    VMError error;
+    uint64_t instr_count;
+
+    int memory_size;
+    int32_t *stack;         /* sp entries */
+    int32_t *memory;        /* memory_size slots */
+    int32_t *return_stack;  /* rsp entries */
+
+    int max_objects;
+    bool auto_gc;
+    int object_count;
+    SnapObject *objects;    /* in vm->first_object list order */
+};
+
+/* FNV-1a, to tell whether a snapshot belongs to the loaded program */
+static uint32_t code_hash(const uint8_t *code, int size) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < size; i++) {
+        h = (h ^ code[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* +1 keeps empty regions from returning NULL */
+static int32_t *copy_ints(const int32_t *src, int n) {
+    int32_t *dst = malloc((n + 1) * sizeof(int32_t));
+    if (dst) memcpy(dst, src, n * sizeof(int32_t));
+    return dst;
+}
+
+/* Object address -> list index, sorted by address for bsearch() */
+typedef struct {
+    const Object *obj;
+    uint32_t index;
+} ObjectIndex;
+
+static int compare_object_index(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const ObjectIndex *)a)->obj;
+    uintptr_t y = (uintptr_t)((const ObjectIndex *)b)->obj;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t object_ref(const ObjectIndex *map, int n, const Object *obj) {
+    if (!obj) return 0;
+    ObjectIndex key = { obj, 0 };
+    const ObjectIndex *found = bsearch(&key, map, n, sizeof(ObjectIndex),
+                                       compare_object_index);
+    return found ? found->index + 1 : 0;
+}
+
+VMSnapshot *vm_snapshot(const VM *vm) {
+    VMSnapshot *s = calloc(1, sizeof(VMSnapshot));
+    if (!s) return NULL;
+
+    s->code_hash = code_hash(vm->code, vm->code_size);
+    s->code_size = vm->code_size;
+    s->pc = vm->pc;
+    s->sp = vm->sp;
+    s->fp = vm->fp;
+    s->rsp = vm->rsp;
+    s->running = vm->running;
+    s->error = vm->error;
+    s->instr_count = vm->instr_count;
+    s->memory_size = vm->memory_size;
+    s->max_objects = vm->max_objects;
+    s->auto_gc = vm->auto_gc;
+
+    int n = 0;
+    for (const Object *obj = vm->first_object; obj; obj = obj->next) n++;
+    s->object_count = n;
+
+    s->stack = copy_ints(vm->stack, vm->sp);
+    s->memory = copy_ints(vm->memory, vm->memory_size);
+    s->return_stack = copy_ints(vm->return_stack, vm->rsp);
+    s->objects = malloc((n + 1) * sizeof(SnapObject));
+    ObjectIndex *map = malloc((n + 1) * sizeof(ObjectIndex));
+    if (!s->stack || !s->memory || !s->return_stack || !s->objects || !map) {
+        free(map);
+        vm_snapshot_free(s);
+        return NULL;
+    }
+
+    uint32_t i = 0;
+    for (const Object *obj = vm->first_object; obj; obj = obj->next, i++) {
+        map[i].obj = obj;
+        map[i].index = i;
+    }
+    qsort(map, n, sizeof(ObjectIndex), compare_object_index);
+
+    i = 0;
+    for (const Object *obj = vm->first_object; obj; obj = obj->next, i++) {
+        SnapObject *so = &s->objects[i];
+        so->type = (uint8_t)obj->type;
+        so->ref = obj->ref;
+        so->left = so->right = 0;
+        so->a = so->b = 0;
+        so->function_ptr = NULL;
+        switch (obj->type) {
+            case OBJ_PAIR:
+                so->left = obj->pair.left;
+                so->right = obj->pair.right;
+                break;
+            case OBJ_FUNCTION:
+                so->function_ptr = obj->function.function_ptr;
+                break;
+            case OBJ_CLOSURE:
+                so->a = object_ref(map, n, obj->closure.fn);
+                so->b = object_ref(map, n, obj->closure.env);
+                break;
+        }
+    }
+
+    free(map);
+    return s;
+}
+
+void vm_snapshot_free(VMSnapshot *snap) {
+    if (!snap) return;
+    free(snap->stack);
+    free(snap->memory);
+    free(snap->return_stack);
+    free(snap->objects);
+    free(snap);
+}
+
+/* Every index in the snapshot names an object it contains, and no two
+   objects share a reference index */
+static bool snapshot_refs_ok(const VMSnapshot *s) {
+    uint32_t n = (uint32_t)s->object_count;
+    int32_t max_ref = -1;
+    for (int i = 0; i < s->object_count; i++) {
+        if (s->objects[i].type > OBJ_CLOSURE) return false;
+        if (s->objects[i].a > n || s->objects[i].b > n) return false;
+        if (s->objects[i].ref < 0 || s->objects[i].ref >= GC_MAX_OBJECTS) return false;
+        if (s->objects[i].ref > max_ref) max_ref = s->objects[i].ref;
+    }
+
+    uint8_t *seen = calloc((size_t)(max_ref + 1) / 8 + 1, 1);
+    if (!seen) return false;
+    bool ok = true;
+    for (int i = 0; i < s->object_count && ok; i++) {
+        int32_t ref = s->objects[i].ref;
+        if (seen[ref / 8] & (1u << (ref % 8))) ok = false;
+        seen[ref / 8] |= (uint8_t)(1u << (ref % 8));
+    }
+    free(seen);
+    return ok;
+}
+
+/*
+ * Put the snapshot's state into vm, which must have the snapshot's program
+ * loaded and regions at least as large as the state being restored.
+ * Returns false, leaving vm untouched, if it does not fit.
+ */
+bool vm_restore(VM *vm, const VMSnapshot *s) {
+    if (!vm->code || vm->code_size != s->code_size ||
+        code_hash(vm->code, vm->code_size) != s->code_hash) {
+        return false;
+    }
+    if (s->sp > vm->stack_size || s->rsp > vm->return_stack_size ||
+        s->memory_size > vm->memory_size) {
+        return false;
+    }
+    if (s->pc < 0 || s->pc > vm->code_size || vm->insn_at[s->pc] < 0) return false;
+    if (s->fp < 0 || s->fp > s->sp) return false;
+    if (!snapshot_refs_ok(s)) return false;
+
+    int n = s->object_count;
+    Object **objs = malloc((n + 1) * sizeof(Object *));
+    if (!objs) return false;
+    for (int i = 0; i < n; i++) {
+        objs[i] = malloc(sizeof(Object));
+        if (!objs[i]) {
+            while (i-- > 0) free(objs[i]);
+            free(objs);
+            return false;
+        }
+    }
+
+    gc_cleanup(vm);
+    for (int i = 0; i < n; i++) {
+        const SnapObject *so = &s->objects[i];
+        Object *obj = objs[i];
+        obj->marked = false;
+        obj->type = (ObjectType)so->type;
+        obj->ref = so->ref;
+        obj->next = i + 1 < n ? objs[i + 1] : NULL;
+        switch (obj->type) {
+            case OBJ_PAIR:
+                obj->pair.left = so->left;
+                obj->pair.right = so->right;
+                break;
+            case OBJ_FUNCTION:
+                obj->function.function_ptr = so->function_ptr;
+                break;
+            case OBJ_CLOSURE:
+                obj->closure.fn = so->a ? objs[so->a - 1] : NULL;
+                obj->closure.env = so->b ? objs[so->b - 1] : NULL;
+                break;
+        }
+    }
+    vm->first_object = n > 0 ? objs[0] : NULL;
+    vm->num_objects = n;
+    vm->max_objects = s->max_objects;
+    vm->auto_gc = s->auto_gc;
+    free(objs);
+    /* Indices were checked above: this fails only when out of memory */
+    if (!gc_rebuild_refs(vm)) {
+        gc_cleanup(vm);
+        return false;
+    }
+
+    memcpy(vm->stack, s->stack, s->sp * sizeof(int32_t));
+    memcpy(vm->return_stack, s->return_stack, s->rsp * sizeof(int32_t));
+    memcpy(vm->memory, s->memory, s->memory_size * sizeof(int32_t));
+    memset(vm->memory + s->memory_size, 0,
+           (vm->memory_size - s->memory_size) * sizeof(int32_t));
+
+    vm->pc = s->pc;
+    vm->sp = s->sp;
+    vm->fp = s->fp;
+    vm->rsp = s->rsp;
+    vm->running = s->running;
+    vm->error = s->error;
+    vm->instr_count = s->instr_count;
+
+    /* The unchecked loop relies on the verifier's depth at each
+       instruction (counted from fp), on the frames below it, which a
+       file cannot be trusted for, and on index ranges proven from zeroed
+       memory; a state it did not predict runs checked instead */
+    int index = vm->insn_at[s->pc];
+    if (vm->verified && index < vm->insn_count && vm->insn_depth[index] != s->sp - s->fp) {
+        vm->verified = false;
+    }
+    if (s->rsp > 0) vm->verified = false;
+    if (vm->index_proof) vm->verified = false;
+    return true;
+}
+
+/* ---- Checkpoint files ---- */
+
+static void put_uint(FILE *f, uint64_t v) {
+    do {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        if (v) b |= 0x80;
+        fputc(b, f);
+    } while (v);
+}
+
+static void put_int(FILE *f, int64_t v) {
+    put_uint(f, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void put_string(FILE *f, const char *str) {
+    size_t len = strlen(str);
+    put_uint(f, len);
+    fwrite(str, 1, len, f);
+}
+
+static void put_ints(FILE *f, const int32_t *v, int n) {
+    for (int i = 0; i < n; i++) put_int(f, v[i]);
+}
+
+static void write_program(FILE *f, const char *source_name, const BytecodeProgram *prog) {
+    put_string(f, source_name);
+    put_uint(f, prog->engine);
+    put_uint(f, prog->code_size);
+    fwrite(prog->code, 1, prog->code_size, f);
+    put_uint(f, prog->var_count);
+    for (int i = 0; i < prog->var_count; i++) put_string(f, prog->var_names[i]);
+    put_uint(f, prog->array_count);
+    for (int i = 0; i < prog->array_count; i++) {
+        put_string(f, prog->arrays[i].name);
+        put_uint(f, prog->arrays[i].base);
+        put_uint(f, prog->arrays[i].length);
+    }
+    put_uint(f, prog->function_count);
+    for (int i = 0; i < prog->function_count; i++) {
+        const FunctionInfo *fn = &prog->functions[i];
+        put_string(f, fn->name);
+        put_uint(f, fn->params);
+        put_uint(f, fn->local_count);
+        for (int k = 0; k < fn->local_count; k++) put_string(f, fn->local_names[k]);
+        put_uint(f, fn->entry);
+        put_uint(f, fn->line);
+    }
+    put_uint(f, prog->memory_slots);
+    put_int(f, prog->max_stack_depth);
+    put_uint(f, prog->source_map_count);
+    for (int i = 0; i < prog->source_map_count; i++) {
+        put_uint(f, prog->source_map[i].bytecode_offset);
+        put_uint(f, prog->source_map[i].source_line);
+    }
+}
+
+static void write_state(FILE *f, const VMSnapshot *s) {
+    put_uint(f, s->code_hash);
+    put_uint(f, s->pc);
+    put_uint(f, s->sp);
+    put_uint(f, s->fp);
+    put_uint(f, s->rsp);
+    put_uint(f, s->running);
+    put_uint(f, s->error);
+    put_uint(f, s->instr_count);
+    put_ints(f, s->stack, s->sp);
+    put_uint(f, s->memory_size);
+    put_ints(f, s->memory, s->memory_size);
+    put_ints(f, s->return_stack, s->rsp);
+
+    put_uint(f, s->max_objects);
+    put_uint(f, s->auto_gc);
+    put_uint(f, s->object_count);
+    for (int i = 0; i < s->object_count; i++) {
+        put_uint(f, s->objects[i].type);
+        put_uint(f, s->objects[i].ref);
+        if (s->objects[i].type == OBJ_PAIR) {
+            put_int(f, s->objects[i].left);
+            put_int(f, s->objects[i].right);
+        } else {
+            put_uint(f, s->objects[i].a);
+            put_uint(f, s->objects[i].b);
+        }
+    }
+}
+
+/* Returns the file size, or -1 after printing an error */
+long checkpoint_save(const char *path, const char *source_name,
+                     const BytecodeProgram *prog, const VMSnapshot *snap) {
+    size_t len = strlen(path) + 5;
+    char *tmp = malloc(len);
+    if (!tmp) return -1;
+    snprintf(tmp, len, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot write '%s'\n", tmp);
+        free(tmp);
+        return -1;
+    }
+    fwrite(CKPT_MAGIC, 1, CKPT_MAGIC_LEN, f);
+    write_program(f, source_name, prog);
+    write_state(f, snap);
+
+    long size = ftell(f);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tmp, path) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Error: cannot write '%s'\n", path);
+        remove(tmp);
+        size = -1;
+    }
+    free(tmp);
+    return size;
+}
+
+/* Reads clear ok on a short file or a value out of range */
+typedef struct {
+    FILE *f;
+    bool ok;
+} Reader;
+
+static uint64_t get_uint(Reader *r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(r->f);
+        if (c == EOF) break;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+    }
+    r->ok = false;
+    return 0;
+}
+
+static int64_t get_int(Reader *r) {
+    uint64_t v = get_uint(r);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int get_count(Reader *r, int max) {
+    uint64_t v = get_uint(r);
+    if (v > (uint64_t)max) {
+        r->ok = false;
+        return 0;
+    }
+    return (int)v;
+}
+
+static int32_t get_i32(Reader *r) {
+    int64_t v = get_int(r);
+    if (v < INT32_MIN || v > INT32_MAX) {
+        r->ok = false;
+        return 0;
+    }
+    return (int32_t)v;
+}
+
+static char *get_string(Reader *r) {
+    int len = get_count(r, CKPT_MAX_STRING);
+    if (!r->ok) return NULL;
+    char *str = malloc(len + 1);
+    if (!str || fread(str, 1, len, r->f) != (size_t)len) {
+        free(str);
+        r->ok = false;
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+static int32_t *get_ints(Reader *r, int n) {
+    int32_t *v = malloc((n + 1) * sizeof(int32_t));
+    if (!v) {
+        r->ok = false;
+        return NULL;
+    }
+    for (int i = 0; i < n && r->ok; i++) v[i] = get_i32(r);
+    return v;
+}
+
+static BytecodeProgram *read_program(Reader *r, char **source_name) {
+    BytecodeProgram *prog = calloc(1, sizeof(BytecodeProgram));
+    if (!prog) {
+        r->ok = false;
+        return NULL;
+    }
+
+    *source_name = get_string(r);
+    prog->engine = (CodegenEngine)get_count(r, ENGINE_REG);
+    prog->code_size = get_count(r, MAX_CODE_SIZE);
+    prog->code = malloc(MAX_CODE_SIZE);
+    if (!prog->code) r->ok = false;
+    if (r->ok && fread(prog->code, 1, prog->code_size, r->f) != (size_t)prog->code_size) {
+        r->ok = false;
+    }
+
+    int vars = get_count(r, CKPT_MAX_COUNT);
+    if (r->ok) {
+        prog->var_names = calloc(vars + 1, sizeof(char *));
+        if (!prog->var_names) r->ok = false;
+    }
+    for (int i = 0; i < vars && r->ok; i++) {
+        prog->var_names[i] = get_string(r);
+        prog->var_count++;
+    }
+    prog->var_capacity = prog->var_count;
+
+    int arrays = get_count(r, CKPT_MAX_COUNT);
+    if (r->ok) {
+        prog->arrays = calloc(arrays + 1, sizeof(ArrayInfo));
+        if (!prog->arrays) r->ok = false;
+    }
+    for (int i = 0; i < arrays && r->ok; i++) {
+        ArrayInfo *arr = &prog->arrays[i];
+        arr->name = get_string(r);
+        arr->base = get_count(r, CKPT_MAX_COUNT);
+        arr->length = get_count(r, MAX_ARRAY_SLOTS);
+        prog->array_count++;
+    }
+
+    int functions = get_count(r, CKPT_MAX_COUNT);
+    if (r->ok) {
+        prog->functions = calloc(functions + 1, sizeof(FunctionInfo));
+        if (!prog->functions) r->ok = false;
+    }
+    for (int i = 0; i < functions && r->ok; i++) {
+        FunctionInfo *fn = &prog->functions[i];
+        prog->function_count++;
+        fn->name = get_string(r);
+        fn->params = get_count(r, CKPT_MAX_COUNT);
+        int locals = get_count(r, CKPT_MAX_COUNT);
+        if (r->ok) {
+            fn->local_names = calloc(locals + 1, sizeof(char *));
+            if (!fn->local_names) r->ok = false;
+        }
+        for (int k = 0; k < locals && r->ok; k++) {
+            fn->local_names[k] = get_string(r);
+            fn->local_count++;
+        }
+        fn->entry = get_count(r, prog->code_size);
+        fn->line = get_count(r, CKPT_MAX_COUNT);
+        if (fn->params > fn->local_count) r->ok = false;
+    }
+
+    prog->memory_slots = get_count(r, CKPT_MAX_COUNT);
+    /* The debugger shows arrays straight from memory */
+    for (int i = 0; i < prog->array_count && r->ok; i++) {
+        if (prog->arrays[i].base + prog->arrays[i].length > prog->memory_slots) r->ok = false;
+    }
+    prog->max_stack_depth = get_i32(r);
+    prog->source_map_count = get_count(r, MAX_SOURCE_MAP);
+    for (int i = 0; i < prog->source_map_count && r->ok; i++) {
+        prog->source_map[i].bytecode_offset = get_count(r, MAX_CODE_SIZE);
+        prog->source_map[i].source_line = get_count(r, CKPT_MAX_COUNT);
+    }
+    return prog;
+}
+
+static VMSnapshot *read_state(Reader *r, const BytecodeProgram *prog) {
+    VMSnapshot *s = calloc(1, sizeof(VMSnapshot));
+    if (!s) {
+        r->ok = false;
+        return NULL;
+    }
+
+    s->code_size = prog->code_size;
+    s->code_hash = (uint32_t)get_uint(r);
+    s->pc = get_count(r, prog->code_size);
+    s->sp = get_count(r, CKPT_MAX_COUNT);
+    s->fp = get_count(r, s->sp);
+    s->rsp = get_count(r, CKPT_MAX_COUNT);
+    s->running = get_uint(r) != 0;
+    s->error = (VMError)get_count(r, VM_ERROR_HEAP_FULL);
+    s->instr_count = get_uint(r);
+    if (r->ok) s->stack = get_ints(r, s->sp);
+    s->memory_size = get_count(r, CKPT_MAX_COUNT);
+    if (r->ok) s->memory = get_ints(r, s->memory_size);
+    if (r->ok) s->return_stack = get_ints(r, s->rsp);
+
+    s->max_objects = get_count(r, CKPT_MAX_COUNT);
+    s->auto_gc = get_uint(r) != 0;
+
+    s->object_count = get_count(r, CKPT_MAX_COUNT);
+    if (r->ok) {
+        s->objects = malloc((s->object_count + 1) * sizeof(SnapObject));
+        if (!s->objects) r->ok = false;
+    }
+    for (int i = 0; i < s->object_count && r->ok; i++) {
+        SnapObject *so = &s->objects[i];
+        so->type = (uint8_t)get_count(r, OBJ_CLOSURE);
+        so->ref = get_count(r, GC_MAX_OBJECTS - 1);
+        so->left = so->right = 0;
+        so->a = so->b = 0;
+        if (so->type == OBJ_PAIR) {
+            so->left = get_i32(r);
+            so->right = get_i32(r);
+        } else {
+            so->a = (uint32_t)get_count(r, CKPT_MAX_COUNT);
+            so->b = (uint32_t)get_count(r, CKPT_MAX_COUNT);
+        }
+        so->function_ptr = NULL;
+    }
+    if (r->ok && !snapshot_refs_ok(s)) r->ok = false;
+    return s;
+}
+
+/* Prints an error and returns false if the file cannot be used */
+bool checkpoint_load(const char *path, char **source_name,
+                     BytecodeProgram **prog, VMSnapshot **snap) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open '%s'\n", path);
+        return false;
+    }
+
+    char magic[CKPT_MAGIC_LEN];
+    if (fread(magic, 1, CKPT_MAGIC_LEN, f) != CKPT_MAGIC_LEN ||
+        memcmp(magic, CKPT_MAGIC, CKPT_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Error: '%s' is not a checkpoint file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    Reader r = { f, true };
+    char *name = NULL;
+    BytecodeProgram *p = read_program(&r, &name);
+    VMSnapshot *s = r.ok ? read_state(&r, p) : NULL;
+    fclose(f);
+
+    if (!r.ok) {
+        fprintf(stderr, "Error: checkpoint '%s' is truncated or corrupt\n", path);
+        free(name);
+        codegen_free(p);
+        vm_snapshot_free(s);
+        return false;
+    }
+    *source_name = name;
+    *prog = p;
+    *snap = s;
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include "codegen.h"
+#include "vm.h"
+
+/*
+ * VM snapshots. vm_snapshot() copies the execution state of a VM (pc,
+ * operand and return stacks, memory slots, GC roots and heap, counters)
+ * into a standalone object; vm_restore() puts it back into a VM that has
+ * the same program loaded. Heap pointers are stored as object indices,
+ * so a snapshot can be written to disk and restored in another process.
+ *
+ * A checkpoint file holds a snapshot together with the compiled program
+ * it belongs to, so it can be restored without the source.
+ */
+typedef struct VMSnapshot VMSnapshot;
+
+VMSnapshot *vm_snapshot(const VM *vm);
+bool vm_restore(VM *vm, const VMSnapshot *snap);
+void vm_snapshot_free(VMSnapshot *snap);
+
+long checkpoint_save(const char *path, const char *source_name,
+                     const BytecodeProgram *prog, const VMSnapshot *snap);
+bool checkpoint_load(const char *path, char **source_name,
+                     BytecodeProgram **prog, VMSnapshot **snap);
+
+#endif
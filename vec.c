@@ -0,0 +1,222 @@
+/*
+ * vec.c - Bulk array kernels with run-time CPU dispatch (see vec.h)
+ *
+ * The SSE2 and AVX2 versions are compiled with target attributes, so the
+ * binary still runs on any x86-64 and needs no special flags. Loops take
+ * whole vectors and finish the last n % width elements in C. SSE2 has no
+ * 32-bit low multiply, so mullo_sse2() builds one from two 32x32->64
+ * multiplies. copy is memmove() in every set: libc already picks the
+ * widest moves the CPU has, and it is right for overlapping ranges too.
+ */
+#include <string.h>
+#include <pthread.h>
+#include "vec.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(VEC_SCALAR)
+#define VEC_X86
+#include <immintrin.h>
+#endif
+
+/* ---- Portable C ---- */
+
+static void fill_scalar(int32_t *dst, int32_t value, int32_t n) {
+    for (int32_t i = 0; i < n; i++) dst[i] = value;
+}
+
+static void copy_any(int32_t *dst, const int32_t *src, int32_t n) {
+    memmove(dst, src, (size_t)n * sizeof(int32_t));
+}
+
+static int32_t sum_scalar(const int32_t *a, int32_t n) {
+    uint32_t s = 0;
+    for (int32_t i = 0; i < n; i++) s += (uint32_t)a[i];
+    return (int32_t)s;
+}
+
+static int32_t dot_scalar(const int32_t *a, const int32_t *b, int32_t n) {
+    uint32_t s = 0;
+    for (int32_t i = 0; i < n; i++) s += (uint32_t)a[i] * (uint32_t)b[i];
+    return (int32_t)s;
+}
+
+static void add_scalar(int32_t *dst, const int32_t *src, int32_t n) {
+    for (int32_t i = 0; i < n; i++) dst[i] = (int32_t)((uint32_t)dst[i] + (uint32_t)src[i]);
+}
+
+static void mul_scalar(int32_t *dst, const int32_t *src, int32_t n) {
+    for (int32_t i = 0; i < n; i++) dst[i] = (int32_t)((uint32_t)dst[i] * (uint32_t)src[i]);
+}
+
+static const VecKernels scalar_kernels = {
+    "scalar", fill_scalar, copy_any, sum_scalar, dot_scalar, add_scalar, mul_scalar
+};
+
+#ifdef VEC_X86
+
+/* ---- SSE2: 4 lanes ---- */
+
+static inline __m128i mullo_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline int32_t hsum_sse2(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+static void fill_sse2(int32_t *dst, int32_t value, int32_t n) {
+    __m128i v = _mm_set1_epi32(value);
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i *)(dst + i), v);
+    fill_scalar(dst + i, value, n - i);
+}
+
+/* Two accumulators keep consecutive adds independent */
+static int32_t sum_sse2(const int32_t *a, int32_t n) {
+    __m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_epi32(s0, _mm_loadu_si128((const __m128i *)(a + i)));
+        s1 = _mm_add_epi32(s1, _mm_loadu_si128((const __m128i *)(a + i + 4)));
+    }
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_epi32(s0, _mm_loadu_si128((const __m128i *)(a + i)));
+    }
+    return (int32_t)((uint32_t)hsum_sse2(_mm_add_epi32(s0, s1)) +
+                     (uint32_t)sum_scalar(a + i, n - i));
+}
+
+static int32_t dot_sse2(const int32_t *a, const int32_t *b, int32_t n) {
+    __m128i s = _mm_setzero_si128();
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        s = _mm_add_epi32(s, mullo_sse2(x, y));
+    }
+    return (int32_t)((uint32_t)hsum_sse2(s) + (uint32_t)dot_scalar(a + i, b + i, n - i));
+}
+
+static void add_sse2(int32_t *dst, const int32_t *src, int32_t n) {
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(x, y));
+    }
+    add_scalar(dst + i, src + i, n - i);
+}
+
+static void mul_sse2(int32_t *dst, const int32_t *src, int32_t n) {
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), mullo_sse2(x, y));
+    }
+    mul_scalar(dst + i, src + i, n - i);
+}
+
+static const VecKernels sse2_kernels = {
+    "sse2", fill_sse2, copy_any, sum_sse2, dot_sse2, add_sse2, mul_sse2
+};
+
+/* ---- AVX2: 8 lanes ---- */
+
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 inline int32_t hsum_avx2(__m256i v) {
+    __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+static AVX2 void fill_avx2(int32_t *dst, int32_t value, int32_t n) {
+    __m256i v = _mm256_set1_epi32(value);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i *)(dst + i), v);
+    fill_scalar(dst + i, value, n - i);
+}
+
+static AVX2 int32_t sum_avx2(const int32_t *a, int32_t n) {
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_epi32(s0, _mm256_loadu_si256((const __m256i *)(a + i)));
+        s1 = _mm256_add_epi32(s1, _mm256_loadu_si256((const __m256i *)(a + i + 8)));
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_epi32(s0, _mm256_loadu_si256((const __m256i *)(a + i)));
+    }
+    return (int32_t)((uint32_t)hsum_avx2(_mm256_add_epi32(s0, s1)) +
+                     (uint32_t)sum_scalar(a + i, n - i));
+}
+
+/* vpmulld has a long latency: two independent chains */
+static AVX2 int32_t dot_avx2(const int32_t *a, const int32_t *b, int32_t n) {
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y0 = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(a + i + 8));
+        __m256i y1 = _mm256_loadu_si256((const __m256i *)(b + i + 8));
+        s0 = _mm256_add_epi32(s0, _mm256_mullo_epi32(x0, y0));
+        s1 = _mm256_add_epi32(s1, _mm256_mullo_epi32(x1, y1));
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        s0 = _mm256_add_epi32(s0, _mm256_mullo_epi32(x, y));
+    }
+    return (int32_t)((uint32_t)hsum_avx2(_mm256_add_epi32(s0, s1)) +
+                     (uint32_t)dot_scalar(a + i, b + i, n - i));
+}
+
+static AVX2 void add_avx2(int32_t *dst, const int32_t *src, int32_t n) {
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(x, y));
+    }
+    add_scalar(dst + i, src + i, n - i);
+}
+
+static AVX2 void mul_avx2(int32_t *dst, const int32_t *src, int32_t n) {
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_mullo_epi32(x, y));
+    }
+    mul_scalar(dst + i, src + i, n - i);
+}
+
+#undef AVX2
+
+static const VecKernels avx2_kernels = {
+    "avx2", fill_avx2, copy_any, sum_avx2, dot_avx2, add_avx2, mul_avx2
+};
+
+#endif /* VEC_X86 */
+
+static const VecKernels *selected = &scalar_kernels;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+#ifdef VEC_X86
+    __builtin_cpu_init();
+    selected = __builtin_cpu_supports("avx2") ? &avx2_kernels : &sse2_kernels;
+#endif
+}
+
+const VecKernels *vec_kernels(void) {
+    pthread_once(&select_once, select_kernels);
+    return selected;
+}
@@ -0,0 +1,25 @@
+#ifndef VEC_H
+#define VEC_H
+
+#include <stdint.h>
+
+/*
+ * Kernels behind the bulk array opcodes (OP_FILL .. OP_VMUL). Arithmetic
+ * wraps like the rest of the VM. vec_kernels() returns the widest set the
+ * CPU supports (AVX2, else SSE2 on x86-64, else portable C); the choice
+ * is made once and the same table serves the interpreter and the JIT.
+ * Build with -DVEC_SCALAR to use the portable kernels everywhere.
+ */
+typedef struct {
+    const char *name;       /* "avx2", "sse2" or "scalar" */
+    void (*fill)(int32_t *dst, int32_t value, int32_t n);
+    void (*copy)(int32_t *dst, const int32_t *src, int32_t n);
+    int32_t (*sum)(const int32_t *a, int32_t n);
+    int32_t (*dot)(const int32_t *a, const int32_t *b, int32_t n);
+    void (*add)(int32_t *dst, const int32_t *src, int32_t n);
+    void (*mul)(int32_t *dst, const int32_t *src, int32_t n);
+} VecKernels;
+
+const VecKernels *vec_kernels(void);
+
+#endif
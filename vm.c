@@ -2,50 +2,41 @@
  * vm.c - Virtual Machine implementation
  *
  * Base: Lab 4 vm.c (full instruction execution)
- * Merged with: Lab 5 vm.c (GC init/cleanup in create/destroy, value_stack allocation)
+ * Merged with: Lab 5 vm.c (GC init/cleanup in create/destroy)
  * LAB6 CHANGES:
  *   - Merged Lab 4 execute_instruction() with Lab 5 vm_create()/vm_destroy()
  *   - Added vm_step() for debugger single-stepping
  *   - Added OP_PRINT, OP_CMP_EQ/NE/GT/LE/GE cases in execute_instruction()
+ *
+ * execute_instruction() has since been replaced by the loop template in
+ * vm_loop.h, which supports threaded (computed goto) dispatch.
+ * vm_load_program() pre-decodes the bytecode and runs verify_program();
+ * verified programs execute on a loop without per-instruction stack and
+ * memory checks, or as native code (jit.c) when vm->jit_enabled is set.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef VM_GUARD_PAGES
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include "vm.h"
 #include "instructions.h"
-
-static bool stack_push(VM *vm, int32_t value) {
-    if (vm->sp >= STACK_SIZE) {
-        vm->error = VM_ERROR_STACK_OVERFLOW;
-        return false;
-    }
-    vm->stack[vm->sp] = value;
-    vm->sp++;
-    return true;
-}
-
-static int32_t stack_pop(VM *vm) {
-    if (vm->sp <= 0) {
-        vm->error = VM_ERROR_STACK_UNDERFLOW;
-        return 0;
-    }
-    vm->sp--;
-    return vm->stack[vm->sp];
-}
-
-static int32_t stack_peek(VM *vm) {
-    if (vm->sp <= 0) {
-        vm->error = VM_ERROR_STACK_UNDERFLOW;
-        return 0;
-    }
-    return vm->stack[vm->sp - 1];
-}
+#include "jit.h"
+#include "input.h"
+#include "vec.h"
 
 static bool return_stack_push(VM *vm, int32_t value) {
-    if (vm->rsp >= RETURN_STACK_SIZE) {
+#ifndef VM_GUARD_PAGES
+    if (vm->rsp >= vm->return_stack_size) {
         vm->error = VM_ERROR_RETURN_STACK_OVERFLOW;
         return false;
     }
+#endif
     vm->return_stack[vm->rsp] = value;
     vm->rsp++;
     return true;
@@ -60,330 +51,1285 @@ static int32_t return_stack_pop(VM *vm) {
     return vm->return_stack[vm->rsp];
 }
 
-static int32_t read_int32(VM *vm) {
-    if (vm->pc + 4 > vm->code_size) {
-        vm->error = VM_ERROR_CODE_BOUNDS;
-        return 0;
+/* Forget the decoded program but keep its buffers for the next load */
+static void clear_decoded(VM *vm) {
+    jit_free(vm->jit);
+    vm->jit = NULL;
+    vm->insn_count = 0;
+    vm->quickened = 0;
+    vm->verified = false;
+    vm->index_proof = false;
+    vm->max_stack_depth = 0;
+    vm->frame_depth = 0;
+}
+
+static void free_decoded(VM *vm) {
+    clear_decoded(vm);
+    free(vm->insns);
+    free(vm->insn_offset);
+    free(vm->insn_at);
+    free(vm->insn_depth);
+    vm->insns = NULL;
+    vm->insn_offset = NULL;
+    vm->insn_at = NULL;
+    vm->insn_depth = NULL;
+    vm->insn_capacity = 0;
+}
+
+/* Natives belong to the program a VM last ran */
+static void clear_natives(VM *vm) {
+    for (int i = 0; i < vm->native_count; i++) free(vm->natives[i].name);
+    vm->native_count = 0;
+}
+
+static int opcode_operand_count(uint8_t opcode) {
+    switch (opcode) {
+        case OP_PUSH: case OP_JMP: case OP_JZ: case OP_JNZ:
+        case OP_STORE: case OP_LOAD: case OP_CALL:
+        case OP_TAIL: case OP_LOAD_LOCAL: case OP_STORE_LOCAL:
+        case OP_JZ_LT: case OP_JZ_EQ: case OP_JZ_NE:
+        case OP_JZ_GT: case OP_JZ_LE: case OP_JZ_GE:
+        case OP_DIV_POW2: case OP_MOD_POW2:
+            return 1;
+        case OP_INC_SLOT: case OP_PUSH_STORE: case OP_NATIVE:
+        case OP_LOAD2_ADD: case OP_LOAD2_SUB: case OP_LOAD2_MUL:
+        case OP_R_MOV: case OP_R_MOVI: case OP_R_JZ:
+        case OP_LOAD_IDX: case OP_STORE_IDX: case OP_FILL: case OP_SUM:
+        case OP_ENTER:
+            return 2;
+        case OP_R_ADD: case OP_R_SUB: case OP_R_MUL: case OP_R_DIV:
+        case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+        case OP_R_GT: case OP_R_LE: case OP_R_GE:
+        case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+        case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+        case OP_LOAD_ELEM: case OP_STORE_ELEM:
+        case OP_COPY: case OP_DOT: case OP_VADD: case OP_VMUL:
+        case OP_LOOP_INC: case OP_LOOP_DEC: case OP_LOOP_INC_M: case OP_LOOP_DEC_M:
+        case OP_R_MOD: case OP_R_AND: case OP_R_OR: case OP_R_XOR:
+        case OP_R_SHL: case OP_R_SHR: case OP_R_DIV_POW2: case OP_R_MOD_POW2:
+            return 3;
+        case OP_R_PRINT: case OP_R_READ: case OP_R_EOF:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static bool opcode_is_cond_jump(uint8_t opcode) {
+    switch (opcode) {
+        case OP_JZ: case OP_JNZ:
+        case OP_JZ_LT: case OP_JZ_EQ: case OP_JZ_NE:
+        case OP_JZ_GT: case OP_JZ_LE: case OP_JZ_GE:
+        case OP_R_JZ:
+        case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+        case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+        case OP_LOOP_INC: case OP_LOOP_DEC: case OP_LOOP_INC_M: case OP_LOOP_DEC_M:
+            return true;
+        default:
+            return false;
     }
+}
 
+/* Counted-loop branches: backward by construction (see LOOP_OP) */
+static bool opcode_is_loop(uint8_t opcode) {
+    return opcode == OP_LOOP_INC || opcode == OP_LOOP_DEC ||
+           opcode == OP_LOOP_INC_M || opcode == OP_LOOP_DEC_M;
+}
+
+static bool opcode_is_jump(uint8_t opcode) {
+    return opcode == OP_JMP || opcode == OP_CALL || opcode == OP_TAIL ||
+           opcode_is_cond_jump(opcode);
+}
+
+static int32_t decode_int32(const uint8_t *p) {
     /* little-endian */
-    int32_t value = (int32_t)vm->code[vm->pc] |
-                    ((int32_t)vm->code[vm->pc + 1] << 8) |
-                    ((int32_t)vm->code[vm->pc + 2] << 16) |
-                    ((int32_t)vm->code[vm->pc + 3] << 24);
-    vm->pc += 4;
-    return value;
+    return (int32_t)p[0] |
+           ((int32_t)p[1] << 8) |
+           ((int32_t)p[2] << 16) |
+           ((int32_t)p[3] << 24);
 }
 
-/* Lab 5 vm_create merged with Lab 4 structure */
-VM* vm_create(void) {
-    VM *vm = (VM*)malloc(sizeof(VM));
-    if (!vm) return NULL;
+/*
+ * Translate vm->code into vm->insns. Each instruction becomes one record
+ * with its operand already decoded; jump and call targets are resolved
+ * to record indices. Targets that are out of range or land inside an
+ * instruction point at the OP_END_OF_CODE sentinel, so taking them raises
+ * VM_ERROR_CODE_BOUNDS just like the old byte interpreter did for
+ * out-of-range addresses. A truncated trailing operand also decodes to
+ * the sentinel.
+ */
+static bool decode_program(VM *vm) {
+    int size = vm->code_size;
+
+    clear_decoded(vm);
+    if (!vm->insns || size > vm->insn_capacity) {
+        free_decoded(vm);
+        /* At most one record per byte, plus the sentinel; insn_depth
+           doubles as the verifier's worklist in its second half */
+        vm->insns = malloc((size + 1) * sizeof(VMInstr));
+        vm->insn_offset = malloc((size + 1) * sizeof(int));
+        vm->insn_at = malloc((size + 1) * sizeof(int));
+        vm->insn_depth = malloc(2 * (size + 1) * sizeof(int));
+        if (!vm->insns || !vm->insn_offset || !vm->insn_at || !vm->insn_depth) {
+            free_decoded(vm);
+            return false;
+        }
+        vm->insn_capacity = size;
+    }
+
+    for (int i = 0; i <= size; i++) vm->insn_at[i] = -1;
+
+    int n = 0;
+    int pc = 0;
+    while (pc < size) {
+        uint8_t opcode = vm->code[pc];
+        int operands = opcode_operand_count(opcode);
+        if (pc + 1 + 4 * operands > size) break;
+
+        vm->insn_at[pc] = n;
+        vm->insn_offset[n] = pc;
+        vm->insns[n].opcode = opcode;
+        vm->insns[n].base_opcode = opcode;
+        vm->insns[n].operand = operands > 0 ? decode_int32(vm->code + pc + 1) : 0;
+        vm->insns[n].operand2 = operands > 1 ? decode_int32(vm->code + pc + 5) : 0;
+        vm->insns[n].operand3 = operands > 2 ? decode_int32(vm->code + pc + 9) : 0;
+        pc += 1 + 4 * operands;
+        n++;
+    }
+
+    /* Sentinel: running off the end (or a truncated operand) */
+    vm->insns[n].opcode = OP_END_OF_CODE;
+    vm->insns[n].base_opcode = OP_END_OF_CODE;
+    vm->insns[n].operand = 0;
+    vm->insns[n].operand2 = 0;
+    vm->insns[n].operand3 = 0;
+    vm->insn_offset[n] = pc;
+    vm->insn_at[pc] = n;
+    vm->insn_count = n;
+
+    vm->back_branches = false;
+    for (int i = 0; i < n; i++) {
+        uint8_t opcode = vm->insns[i].opcode;
+        if (!opcode_is_jump(opcode)) continue;
+        int32_t target = vm->insns[i].operand;
+        if (target < 0 || target > size || vm->insn_at[target] < 0) {
+            vm->insns[i].operand = n;
+        } else {
+            vm->insns[i].operand = vm->insn_at[target];
+        }
+        if (opcode_is_cond_jump(opcode) && !opcode_is_loop(opcode) && vm->insns[i].operand <= i) {
+            vm->back_branches = true;
+        }
+    }
+    return true;
+}
+
+/* Stack effect of an instruction: values popped and pushed */
+static bool stack_effect(uint8_t opcode, int *pops, int *pushes) {
+    switch (opcode) {
+        case OP_PUSH: case OP_LOAD: case OP_READ: case OP_EOF:
+        case OP_LOAD2_ADD: case OP_LOAD2_SUB: case OP_LOAD2_MUL:
+        case OP_LOAD_ELEM: case OP_SUM: case OP_DOT: case OP_LOAD_LOCAL:
+            *pops = 0; *pushes = 1; return true;
+        case OP_POP: case OP_STORE: case OP_PRINT: case OP_JZ: case OP_JNZ:
+        case OP_STORE_ELEM: case OP_FILL: case OP_STORE_LOCAL: case OP_RETURN:
+            *pops = 1; *pushes = 0; return true;
+        case OP_JZ_LT: case OP_JZ_EQ: case OP_JZ_NE:
+        case OP_JZ_GT: case OP_JZ_LE: case OP_JZ_GE:
+        case OP_STORE_IDX: case OP_SET_LEFT: case OP_SET_RIGHT:
+            *pops = 2; *pushes = 0; return true;
+        case OP_DUP:
+            *pops = 1; *pushes = 2; return true;
+        case OP_LOAD_IDX: case OP_DIV_POW2: case OP_MOD_POW2:
+        case OP_LEFT: case OP_RIGHT:
+            *pops = 1; *pushes = 1; return true;
+        case OP_COPY: case OP_VADD: case OP_VMUL:
+            *pops = 0; *pushes = 0; return true;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_MOD: case OP_AND: case OP_OR: case OP_XOR: case OP_SHL: case OP_SHR:
+        case OP_CMP: case OP_CMP_EQ: case OP_CMP_NE:
+        case OP_CMP_GT: case OP_CMP_LE: case OP_CMP_GE:
+        case OP_PAIR:
+            *pops = 2; *pushes = 1; return true;
+        case OP_JMP: case OP_HALT: case OP_INC_SLOT: case OP_PUSH_STORE:
+            *pops = 0; *pushes = 0; return true;
+        case OP_R_MOV: case OP_R_MOVI:
+        case OP_R_ADD: case OP_R_SUB: case OP_R_MUL: case OP_R_DIV:
+        case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+        case OP_R_GT: case OP_R_LE: case OP_R_GE:
+        case OP_R_JZ:
+        case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+        case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+        case OP_R_PRINT: case OP_R_READ: case OP_R_EOF:
+        case OP_R_MOD: case OP_R_AND: case OP_R_OR: case OP_R_XOR:
+        case OP_R_SHL: case OP_R_SHR: case OP_R_DIV_POW2: case OP_R_MOD_POW2:
+        case OP_LOOP_INC: case OP_LOOP_DEC: case OP_LOOP_INC_M: case OP_LOOP_DEC_M:
+            /* register forms and counted loops leave the operand stack alone */
+            *pops = 0; *pushes = 0; return true;
+        default:
+            /* OP_CALL, OP_ENTER, OP_TAIL and OP_NATIVE depend on the
+               callee (see verify_program()); OP_RET and invalid opcodes
+               never verify */
+            return false;
+    }
+}
+
+static bool slot_ok(const VM *vm, int32_t slot) {
+    return slot >= 0 && slot < vm->memory_size;
+}
+
+/* The array [base, base + len) lies inside memory */
+static bool range_ok(const VM *vm, int32_t base, int32_t len) {
+    return base >= 0 && len >= 0 && (int64_t)base + len <= vm->memory_size;
+}
+
+/* Memory slots named by an instruction's operands are valid */
+static bool slots_in_range(const VM *vm, const VMInstr *ins) {
+    switch (ins->opcode) {
+        case OP_LOAD: case OP_STORE: case OP_INC_SLOT: case OP_PUSH_STORE:
+            return slot_ok(vm, ins->operand);
+        case OP_LOAD2_ADD: case OP_LOAD2_SUB: case OP_LOAD2_MUL:
+        case OP_R_MOV: case OP_R_DIV_POW2: case OP_R_MOD_POW2:
+            return slot_ok(vm, ins->operand) && slot_ok(vm, ins->operand2);
+        case OP_R_MOVI: case OP_R_PRINT: case OP_R_READ: case OP_R_EOF:
+            return slot_ok(vm, ins->operand);
+        case OP_R_JZ:
+            return slot_ok(vm, ins->operand2);
+        case OP_R_ADD: case OP_R_SUB: case OP_R_MUL: case OP_R_DIV:
+        case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+        case OP_R_GT: case OP_R_LE: case OP_R_GE:
+        case OP_R_MOD: case OP_R_AND: case OP_R_OR: case OP_R_XOR: case OP_R_SHL: case OP_R_SHR:
+            return slot_ok(vm, ins->operand) && slot_ok(vm, ins->operand2) && slot_ok(vm, ins->operand3);
+        case OP_R_JZ_LT: case OP_R_JZ_EQ: case OP_R_JZ_NE:
+        case OP_R_JZ_GT: case OP_R_JZ_LE: case OP_R_JZ_GE:
+        case OP_LOOP_INC_M: case OP_LOOP_DEC_M:
+            return slot_ok(vm, ins->operand2) && slot_ok(vm, ins->operand3);
+        case OP_LOOP_INC: case OP_LOOP_DEC:
+            return slot_ok(vm, ins->operand2);
+        case OP_LOAD_IDX: case OP_STORE_IDX: case OP_FILL: case OP_SUM:
+            return range_ok(vm, ins->operand, ins->operand2);
+        case OP_LOAD_ELEM: case OP_STORE_ELEM:
+            return range_ok(vm, ins->operand, ins->operand2) && slot_ok(vm, ins->operand3);
+        case OP_COPY: case OP_DOT: case OP_VADD: case OP_VMUL:
+            return range_ok(vm, ins->operand, ins->operand3) &&
+                   range_ok(vm, ins->operand2, ins->operand3);
+        default:
+            return true;
+    }
+}
+
+/*
+ * Index ranges for the element forms, which use M[slot] as an index
+ * without checking it. For each slot used that way the verifier tracks
+ * an interval over every path from record 0, where memory is all zeros:
+ * PUSH_STORE and R_MOVI set it, INC_SLOT and the LOOP_* steps shift it,
+ * any other write to the slot makes it unknown, and a LOAD s; PUSH c;
+ * JZ_xx test or a LOOP_INC / LOOP_DEC limit narrows it on both edges. A bound that moves along a backward jump goes straight
+ * to infinity; every loop contains one, so each record is visited only a
+ * few times. Every element access must see its interval inside [0, len).
+ */
+#define RANGE_INF ((int64_t)1 << 40)
+
+typedef struct {
+    int64_t lo, hi;
+} IndexRange;
+
+static bool opcode_is_element(uint8_t opcode) {
+    return opcode == OP_LOAD_ELEM || opcode == OP_STORE_ELEM;
+}
+
+static bool slot_in_array(int32_t slot, int32_t base, int32_t len) {
+    return slot >= base && (int64_t)slot < (int64_t)base + len;
+}
+
+static void range_shift(IndexRange *r, int32_t k) {
+    int64_t lo = r->lo + k, hi = r->hi + k;
+    /* A value that may wrap around could end up anywhere */
+    if (r->lo <= -RANGE_INF || r->hi >= RANGE_INF || lo < INT32_MIN || hi > INT32_MAX) {
+        r->lo = -RANGE_INF;
+        r->hi = RANGE_INF;
+    } else {
+        r->lo = lo;
+        r->hi = hi;
+    }
+}
+
+/* Effect of one instruction on M[slot] */
+static void range_after(const VMInstr *ins, int32_t slot, IndexRange *r) {
+    bool unknown = false;
+    switch (ins->opcode) {
+        case OP_PUSH_STORE: case OP_R_MOVI:
+            if (ins->operand == slot) r->lo = r->hi = ins->operand2;
+            return;
+        case OP_INC_SLOT:
+            if (ins->operand == slot) range_shift(r, ins->operand2);
+            return;
+        case OP_LOOP_INC: case OP_LOOP_INC_M:
+            if (ins->operand2 == slot) range_shift(r, 1);
+            return;
+        case OP_LOOP_DEC: case OP_LOOP_DEC_M:
+            if (ins->operand2 == slot) range_shift(r, -1);
+            return;
+        case OP_STORE: case OP_R_MOV:
+        case OP_R_ADD: case OP_R_SUB: case OP_R_MUL: case OP_R_DIV:
+        case OP_R_LT: case OP_R_EQ: case OP_R_NE:
+        case OP_R_GT: case OP_R_LE: case OP_R_GE:
+        case OP_R_READ: case OP_R_EOF:
+        case OP_R_MOD: case OP_R_AND: case OP_R_OR: case OP_R_XOR:
+        case OP_R_SHL: case OP_R_SHR: case OP_R_DIV_POW2: case OP_R_MOD_POW2:
+            unknown = ins->operand == slot;
+            break;
+        case OP_STORE_IDX: case OP_STORE_ELEM: case OP_FILL:
+            unknown = slot_in_array(slot, ins->operand, ins->operand2);
+            break;
+        case OP_COPY: case OP_VADD: case OP_VMUL:
+            unknown = slot_in_array(slot, ins->operand, ins->operand3);
+            break;
+        default:
+            return;
+    }
+    if (unknown) {
+        r->lo = -RANGE_INF;
+        r->hi = RANGE_INF;
+    }
+}
+
+/* Narrow r for the fall-through (cond true) or jump (cond false) edge of
+   a JZ_xx comparing M[slot] with the constant c */
+static void range_narrow(IndexRange *r, uint8_t opcode, int64_t c, bool cond) {
+    int64_t lo = -RANGE_INF, hi = RANGE_INF;
+    switch (opcode) {
+        case OP_JZ_LT: if (cond) hi = c - 1; else lo = c; break;
+        case OP_JZ_LE: if (cond) hi = c; else lo = c + 1; break;
+        case OP_JZ_GT: if (cond) lo = c + 1; else hi = c; break;
+        case OP_JZ_GE: if (cond) lo = c; else hi = c - 1; break;
+        case OP_JZ_EQ: if (cond) lo = hi = c; break;
+        case OP_JZ_NE: if (!cond) lo = hi = c; break;
+        default: return;
+    }
+    if (lo > r->lo) r->lo = lo;
+    if (hi < r->hi) r->hi = hi;
+}
+
+typedef struct {
+    int n, k;
+    IndexRange *state;      /* k ranges per record */
+    bool *seen, *queued;
+    int *work;
+    int top;
+} RangeWalk;
+
+/* Join `in` into record t's state, widening for a backward edge: a
+   bound that moves goes to the one in `cap` (what the edge itself
+   enforces), or to infinity if cap is NULL. An edge on which some range
+   is empty cannot be taken and is dropped. */
+static void range_merge(RangeWalk *w, int t, const IndexRange *in, bool widen,
+                        const IndexRange *cap) {
+    for (int j = 0; j < w->k; j++) {
+        if (in[j].lo > in[j].hi) return;
+    }
+    IndexRange *st = w->state + (size_t)t * w->k;
+    bool changed = !w->seen[t];
+    if (!w->seen[t]) {
+        memcpy(st, in, w->k * sizeof(IndexRange));
+        w->seen[t] = true;
+    } else {
+        for (int j = 0; j < w->k; j++) {
+            if (in[j].lo < st[j].lo) {
+                st[j].lo = !widen ? in[j].lo : cap ? cap[j].lo : -RANGE_INF;
+                changed = true;
+            }
+            if (in[j].hi > st[j].hi) {
+                st[j].hi = !widen ? in[j].hi : cap ? cap[j].hi : RANGE_INF;
+                changed = true;
+            }
+        }
+    }
+    if (changed && !w->queued[t]) {
+        w->queued[t] = true;
+        w->work[w->top++] = t;
+    }
+}
+
+static bool verify_index_ranges(VM *vm) {
+    int n = vm->insn_count;
+    const VMInstr *insns = vm->insns;
+    int32_t slots[VM_INDEX_SLOTS];
+    int k = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!opcode_is_element(insns[i].opcode)) continue;
+        int j = 0;
+        while (j < k && slots[j] != insns[i].operand3) j++;
+        if (j == k) {
+            if (k == VM_INDEX_SLOTS) return false;
+            slots[k++] = insns[i].operand3;
+        }
+    }
+    vm->index_proof = k > 0;
+    if (k == 0) return true;
+
+    RangeWalk w = { n, k, NULL, NULL, NULL, NULL, 0 };
+    w.state = malloc((size_t)(n + 1) * k * sizeof(IndexRange));
+    w.seen = calloc(n + 1, sizeof(bool));
+    w.queued = calloc(n + 1, sizeof(bool));
+    bool *target = calloc(n + 1, sizeof(bool));
+    w.work = malloc((n + 1) * sizeof(int));
+    bool ok = w.state && w.seen && w.queued && target && w.work;
+
+    for (int i = 0; ok && i < n; i++) {
+        if (opcode_is_jump(insns[i].opcode)) target[insns[i].operand] = true;
+    }
+
+    IndexRange cur[VM_INDEX_SLOTS], jump[VM_INDEX_SLOTS];
+    if (ok) {
+        for (int j = 0; j < k; j++) cur[j].lo = cur[j].hi = 0;
+        range_merge(&w, 0, cur, false, NULL);
+    }
+
+    while (ok && w.top > 0) {
+        int i = w.work[--w.top];
+        const VMInstr *ins = &insns[i];
+        w.queued[i] = false;
+        memcpy(cur, w.state + (size_t)i * k, k * sizeof(IndexRange));
+
+        if (opcode_is_element(ins->opcode)) {
+            int j = 0;
+            while (slots[j] != ins->operand3) j++;
+            if (cur[j].lo < 0 || cur[j].hi >= ins->operand2) {
+                ok = false;
+                break;
+            }
+        }
+        for (int j = 0; j < k; j++) range_after(ins, slots[j], &cur[j]);
 
-    vm->stack = (int32_t*)malloc(STACK_SIZE * sizeof(int32_t));
-    if (!vm->stack) { free(vm); return NULL; }
+        if (ins->opcode == OP_HALT || ins->opcode == OP_RETURN) continue;
+        if (ins->opcode == OP_CALL || ins->opcode == OP_TAIL) {
+            /* The callee may write any slot, and starts knowing nothing */
+            for (int j = 0; j < k; j++) {
+                cur[j].lo = -RANGE_INF;
+                cur[j].hi = RANGE_INF;
+            }
+            range_merge(&w, ins->operand, cur, false, NULL);
+            if (ins->opcode == OP_CALL) range_merge(&w, i + 1, cur, false, NULL);
+            continue;
+        }
+        if (ins->opcode == OP_JMP) {
+            range_merge(&w, ins->operand, cur, ins->operand <= i, NULL);
+            continue;
+        }
+        if (!opcode_is_cond_jump(ins->opcode)) {
+            range_merge(&w, i + 1, cur, false, NULL);
+            continue;
+        }
 
-    vm->memory = (int32_t*)malloc(MEMORY_SIZE * sizeof(int32_t));
-    if (!vm->memory) { free(vm->stack); free(vm); return NULL; }
+        memcpy(jump, cur, k * sizeof(IndexRange));
+        /* LOAD s; PUSH c; JZ_xx with nothing jumping into the middle */
+        if (i >= 2 && insns[i - 2].opcode == OP_LOAD && insns[i - 1].opcode == OP_PUSH &&
+            !target[i - 1] && !target[i]) {
+            for (int j = 0; j < k; j++) {
+                if (slots[j] != insns[i - 2].operand) continue;
+                range_narrow(&cur[j], ins->opcode, insns[i - 1].operand, true);
+                range_narrow(&jump[j], ins->opcode, insns[i - 1].operand, false);
+            }
+        }
+        /* A counted loop jumps back while the stepped slot is short of
+           its constant limit: the taken edge is the comparison's true
+           side, and widening along it stops at the limit */
+        IndexRange cap[VM_INDEX_SLOTS];
+        bool capped = ins->opcode == OP_LOOP_INC || ins->opcode == OP_LOOP_DEC;
+        if (capped) {
+            uint8_t cmp = ins->opcode == OP_LOOP_INC ? OP_JZ_LT : OP_JZ_GT;
+            for (int j = 0; j < k; j++) {
+                cap[j].lo = -RANGE_INF;
+                cap[j].hi = RANGE_INF;
+                if (slots[j] != ins->operand2) continue;
+                range_narrow(&cap[j], cmp, ins->operand3, true);
+                range_narrow(&jump[j], cmp, ins->operand3, true);
+                range_narrow(&cur[j], cmp, ins->operand3, false);
+            }
+        }
+        range_merge(&w, ins->operand, jump, ins->operand <= i, capped ? cap : NULL);
+        range_merge(&w, i + 1, cur, false, NULL);
+    }
 
-    vm->return_stack = (int32_t*)malloc(RETURN_STACK_SIZE * sizeof(int32_t));
-    if (!vm->return_stack) { free(vm->memory); free(vm->stack); free(vm); return NULL; }
+    free(w.state);
+    free(w.seen);
+    free(w.queued);
+    free(target);
+    free(w.work);
+    return ok;
+}
+
+/*
+ * Abstract interpretation of operand stack depth over every path from
+ * record 0. A program is verified when every reachable instruction is
+ * seen with one consistent depth, never pops more than it has, never
+ * exceeds vm->stack_size, only addresses valid memory slots and arrays,
+ * indexes arrays unchecked only within bounds (verify_index_ranges()), and
+ * every jump and fall-through lands on a real instruction. Sets vm->verified and
+ * vm->max_stack_depth; unverified programs run on the checked loop.
+ *
+ * Functions: each OP_ENTER a CALL or TAIL targets starts a walk of its
+ * own, with depths counted from fp and the arguments already there. A
+ * record belongs to exactly one function (owner) or to the main program
+ * (-1); control only moves between them through CALL, TAIL and RETURN,
+ * and frame slots are only addressed below the current depth. The
+ * deepest frame becomes vm->frame_depth, which OP_ENTER checks against
+ * the room left on the stack.
+ */
+static bool frame_ok(const VMInstr *ins, int depth, int owner, int i) {
+    switch (ins->opcode) {
+        case OP_LOAD_LOCAL:
+            return ins->operand >= 0 && ins->operand < depth;
+        case OP_STORE_LOCAL:
+            return ins->operand >= 0 && ins->operand < depth - 1;
+        case OP_RETURN: case OP_TAIL:
+            return owner >= 0;
+        case OP_ENTER:
+            return owner == i && ins->operand >= 0 && ins->operand2 >= 0;
+        default:
+            return true;
+    }
+}
+
+static void verify_program(VM *vm) {
+    int n = vm->insn_count;
+    int *depth = vm->insn_depth;
+    int *worklist = vm->insn_depth + vm->insn_capacity + 1;
+    int *owner = malloc((n + 1) * sizeof(int));
+    int top = 0;
+    int max_depth = 0;
+    int frame_depth = 0;
+    bool ok = owner != NULL;
 
-    /* Lab 5: allocate value stack for GC */
-    vm->value_stack = (Value*)malloc(VM_STACK_MAX * sizeof(Value));
-    if (!vm->value_stack) {
-        free(vm->return_stack); free(vm->memory); free(vm->stack); free(vm);
+    vm->verified = false;
+    vm->index_proof = false;
+    vm->max_stack_depth = 0;
+    vm->frame_depth = 0;
+
+    if (ok) {
+        for (int i = 0; i <= n; i++) depth[i] = -1;
+        depth[0] = 0;
+        owner[0] = -1;
+        worklist[top++] = 0;
+    }
+
+    while (ok && top > 0) {
+        int i = worklist[--top];
+        VMInstr *ins = &vm->insns[i];
+        int pops, pushes;
+        int callee = -1;
+
+        if (i == n) { ok = false; break; }
+        if (ins->opcode == OP_CALL || ins->opcode == OP_TAIL) {
+            callee = ins->operand;
+            if (callee >= n || vm->insns[callee].opcode != OP_ENTER) { ok = false; break; }
+            pops = vm->insns[callee].operand;
+            pushes = ins->opcode == OP_CALL;
+        } else if (ins->opcode == OP_ENTER) {
+            pops = 0;
+            pushes = ins->operand2;
+        } else if (ins->opcode == OP_NATIVE) {
+            if (ins->operand < 0 || ins->operand >= vm->native_count ||
+                vm->natives[ins->operand].arity != ins->operand2) {
+                ok = false;
+                break;
+            }
+            pops = ins->operand2;
+            pushes = 1;
+        } else if (!stack_effect(ins->opcode, &pops, &pushes)) {
+            ok = false;
+            break;
+        }
+        if (depth[i] < pops || !frame_ok(ins, depth[i], owner[i], i)) {
+            ok = false;
+            break;
+        }
+        int d = depth[i] - pops + pushes;
+        if (d > vm->stack_size) { ok = false; break; }
+        if (owner[i] < 0 && d > max_depth) max_depth = d;
+        if (owner[i] >= 0 && d > frame_depth) frame_depth = d;
+
+        if (!slots_in_range(vm, ins)) {
+            ok = false;
+            break;
+        }
+
+        int succ[3], succ_depth[3], succ_owner[3];
+        int nsucc = 0;
+        if (ins->opcode == OP_JMP || opcode_is_cond_jump(ins->opcode)) {
+            succ[nsucc] = ins->operand;
+            succ_depth[nsucc] = d;
+            succ_owner[nsucc++] = owner[i];
+        }
+        if (ins->opcode != OP_JMP && ins->opcode != OP_HALT &&
+            ins->opcode != OP_RETURN && ins->opcode != OP_TAIL) {
+            succ[nsucc] = i + 1;
+            succ_depth[nsucc] = d;
+            succ_owner[nsucc++] = owner[i];
+        }
+        if (callee >= 0) {
+            succ[nsucc] = callee;
+            succ_depth[nsucc] = pops;
+            succ_owner[nsucc++] = callee;
+        }
+
+        for (int k = 0; k < nsucc; k++) {
+            int t = succ[k];
+            if (t >= n) { ok = false; break; }  /* sentinel: off the end */
+            if (depth[t] < 0) {
+                depth[t] = succ_depth[k];
+                owner[t] = succ_owner[k];
+                worklist[top++] = t;
+            } else if (depth[t] != succ_depth[k] || owner[t] != succ_owner[k]) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    free(owner);
+    if (ok) ok = verify_index_ranges(vm);
+    if (ok) {
+        vm->verified = true;
+        vm->max_stack_depth = max_depth;   /* insn_depth is kept for the JIT */
+        vm->frame_depth = frame_depth;
+    }
+}
+
+#ifdef VM_GUARD_PAGES
+/*
+ * Guard-page layout: the VM struct, memory, operand stack and return
+ * stack share one anonymous mapping. Both stacks end exactly
+ * at a page boundary followed by a PROT_NONE page, so the checked loop
+ * and return_stack_push() skip their overflow comparisons: the first
+ * write past either stack faults, and guard_handler() turns the fault
+ * into VM_ERROR_STACK_OVERFLOW / VM_ERROR_RETURN_STACK_OVERFLOW by
+ * jumping back to run_guarded(). The mapping is zero-filled, so nothing
+ * needs clearing. The pc of a run that overflows is left where the run
+ * started (the loop's ip lives in a register).
+ */
+static __thread VM *guarded_vm;
+static __thread sigjmp_buf guard_jmp;
+
+static size_t page_round(size_t n, size_t page) {
+    return (n + page - 1) / page * page;
+}
+
+static bool in_guard(const void *addr, const int32_t *end, size_t page) {
+    const char *a = addr;
+    return a >= (const char *)end && a < (const char *)end + page;
+}
+
+static void guard_handler(int sig, siginfo_t *info, void *ctx) {
+    VM *vm = guarded_vm;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    (void)ctx;
+
+    if (vm && in_guard(info->si_addr, vm->stack + vm->stack_size, page)) {
+        siglongjmp(guard_jmp, VM_ERROR_STACK_OVERFLOW);
+    }
+    if (vm && in_guard(info->si_addr, vm->return_stack + vm->return_stack_size, page)) {
+        siglongjmp(guard_jmp, VM_ERROR_RETURN_STACK_OVERFLOW);
+    }
+    /* Not ours: fault again with the default action */
+    signal(sig, SIG_DFL);
+}
+
+static VM *vm_alloc(const VMLimits *l) {
+    static bool handler_installed = false;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t head = page_round(sizeof(VM) + l->memory_size * sizeof(int32_t) + 64, page);
+    size_t stack_bytes = page_round((l->stack_size + 1) * sizeof(int32_t), page);
+    size_t rstack_bytes = page_round(l->return_stack_size * sizeof(int32_t), page);
+    size_t total = head + stack_bytes + page + rstack_bytes + page;
+
+    char *slab = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) return NULL;
+
+    char *stack_end = slab + head + stack_bytes;
+    char *rstack_end = stack_end + page + rstack_bytes;
+    if (mprotect(stack_end, page, PROT_NONE) != 0 ||
+        mprotect(rstack_end, page, PROT_NONE) != 0) {
+        munmap(slab, total);
         return NULL;
     }
 
-    memset(vm->stack, 0, STACK_SIZE * sizeof(int32_t));
-    memset(vm->memory, 0, MEMORY_SIZE * sizeof(int32_t));
-    memset(vm->return_stack, 0, RETURN_STACK_SIZE * sizeof(int32_t));
+    if (!handler_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = guard_handler;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, NULL);
+        handler_installed = true;
+    }
 
+    VM *vm = (VM *)slab;
+    vm->slab_size = total;
+    vm->memory = (int32_t *)(slab + page_round(sizeof(VM), 16));
+    vm->stack = (int32_t *)stack_end - l->stack_size;   /* stack[-1] is the spare */
+    vm->return_stack = (int32_t *)rstack_end - l->return_stack_size;
+    return vm;
+}
+
+/* Shrink or grow the stacks within their capacity, keeping each one's
+   end against its guard page so overflow still faults at the limit */
+static void vm_place_stacks(VM *vm, const VMLimits *l) {
+    vm->stack += vm->stack_size - l->stack_size;
+    vm->return_stack += vm->return_stack_size - l->return_stack_size;
+}
+
+static void vm_release(VM *vm) {
+    munmap(vm, vm->slab_size);
+}
+
+/* Run one of the loops with overflow faults turned into VM errors */
+static void run_guarded(VM *vm, void (*loop)(VM *, uint64_t), uint64_t budget) {
+    int err = sigsetjmp(guard_jmp, 0);
+    if (err != 0) {
+        guarded_vm = NULL;
+        if (err == VM_ERROR_STACK_OVERFLOW) vm->sp = vm->stack_size;
+        else vm->rsp = vm->return_stack_size;
+        vm->error = (VMError)err;
+        vm->running = false;
+        return;
+    }
+    guarded_vm = vm;
+    loop(vm, budget);
+    guarded_vm = NULL;
+}
+#else
+static VM *vm_alloc(const VMLimits *l) {
+    VM *vm = (VM*)malloc(sizeof(VM));
+    if (!vm) return NULL;
+    vm->slab_size = 0;
+
+    /* One spare slot below stack[0]: the top-of-stack cached loop spills
+       its (empty) register there when the stack is empty. */
+    int32_t *stack_block = (int32_t*)calloc(l->stack_size + 1, sizeof(int32_t));
+    if (!stack_block) { free(vm); return NULL; }
+    vm->stack = stack_block + 1;
+
+    /* +1 keeps empty regions from returning NULL */
+    vm->memory = (int32_t*)calloc(l->memory_size + 1, sizeof(int32_t));
+    if (!vm->memory) { free(stack_block); free(vm); return NULL; }
+
+    vm->return_stack = (int32_t*)calloc(l->return_stack_size + 1, sizeof(int32_t));
+    if (!vm->return_stack) { free(vm->memory); free(stack_block); free(vm); return NULL; }
+    return vm;
+}
+
+/* Every region starts at the front of its block; nothing moves */
+static void vm_place_stacks(VM *vm, const VMLimits *l) {
+    (void)vm;
+    (void)l;
+}
+
+static void vm_release(VM *vm) {
+    free(vm->stack - 1);
+    free(vm->memory);
+    free(vm->return_stack);
+    free(vm);
+}
+
+static void run_guarded(VM *vm, void (*loop)(VM *, uint64_t), uint64_t budget) {
+    loop(vm, budget);
+}
+#endif
+
+/* Lab 5 vm_create merged with Lab 4 structure */
+VM* vm_create(void) {
+    VMLimits limits = { MEMORY_SIZE, STACK_SIZE, RETURN_STACK_SIZE };
+    return vm_create_sized(&limits);
+}
+
+static VMLimits clamp_limits(const VMLimits *limits) {
+    VMLimits l = *limits;
+    if (l.memory_size < 0) l.memory_size = 0;
+    if (l.stack_size < 0) l.stack_size = 0;
+    if (l.return_stack_size < 0) l.return_stack_size = 0;
+    return l;
+}
+
+/* Execution state of a VM with no program loaded */
+static void init_state(VM *vm) {
     vm->sp = 0;
     vm->rsp = 0;
+    vm->fp = 0;
     vm->pc = 0;
     vm->code = NULL;
     vm->code_size = 0;
+    vm->owns_code = false;
+    vm->jit_enabled = false;
     vm->running = false;
     vm->error = VM_OK;
+    vm->instr_count = 0;
+    vm->out_len = 0;
+    vm->out_dropped = 0;
+    vm->output_fn = NULL;
+    vm->output_ctx = NULL;
 
     /* Lab 5: Initialize GC */
     gc_init(vm);
+}
+
+/* Regions sized for one program; sizes below zero are treated as zero */
+VM* vm_create_sized(const VMLimits *limits) {
+    VMLimits l = clamp_limits(limits);
 
+    VM *vm = vm_alloc(&l);
+    if (!vm) return NULL;
+
+    vm->capacity = l;
+    vm->memory_size = l.memory_size;
+    vm->stack_size = l.stack_size;
+    vm->return_stack_size = l.return_stack_size;
+    vm->insns = NULL;
+    vm->insn_offset = NULL;
+    vm->insn_at = NULL;
+    vm->insn_depth = NULL;
+    vm->insn_capacity = 0;
+    vm->jit = NULL;
+    vm->out_buf = NULL;
+    vm->out_capacity = 0;
+    vm->input = NULL;
+    vm->natives = NULL;
+    vm->native_count = 0;
+    vm->native_capacity = 0;
+    clear_decoded(vm);     /* no program decoded yet */
+    init_state(vm);
     return vm;
 }
 
+/*
+ * Return a used VM to the state vm_create_sized(limits) would produce,
+ * without allocating; the decode buffers are kept for the next load.
+ * Only what a run can have written is cleared: the memory slots below
+ * the previous memory_size and the stack entries below sp and rsp.
+ * Slots beyond the previous memory_size were never addressable, so they
+ * are still zero. Returns false, leaving the VM untouched, if limits
+ * exceed the sizes the VM was created with.
+ */
+bool vm_reset(VM *vm, const VMLimits *limits) {
+    VMLimits l = clamp_limits(limits);
+
+    if (l.memory_size > vm->capacity.memory_size ||
+        l.stack_size > vm->capacity.stack_size ||
+        l.return_stack_size > vm->capacity.return_stack_size) {
+        return false;
+    }
+
+    gc_cleanup(vm);
+    if (vm->owns_code) free(vm->code);
+    clear_decoded(vm);
+    clear_natives(vm);
+    vm_set_input(vm, NULL);
+
+    memset(vm->memory, 0, vm->memory_size * sizeof(int32_t));
+    memset(vm->stack - 1, 0, (vm->sp + 1) * sizeof(int32_t));
+    memset(vm->return_stack, 0, vm->rsp * sizeof(int32_t));
+
+    vm_place_stacks(vm, &l);
+    vm->memory_size = l.memory_size;
+    vm->stack_size = l.stack_size;
+    vm->return_stack_size = l.return_stack_size;
+    init_state(vm);
+    return true;
+}
+
 /* Lab 5 vm_destroy with GC cleanup */
 void vm_destroy(VM *vm) {
     if (vm) {
         /* Lab 5: Cleanup GC first */
         gc_cleanup(vm);
 
-        if (vm->stack) free(vm->stack);
-        if (vm->memory) free(vm->memory);
-        if (vm->return_stack) free(vm->return_stack);
-        if (vm->value_stack) free(vm->value_stack);
-        if (vm->code) free(vm->code);
-        free(vm);
+        if (vm->owns_code) free(vm->code);
+        free_decoded(vm);
+        free(vm->out_buf);
+        input_close(vm->input);
+        clear_natives(vm);
+        free(vm->natives);
+        vm_release(vm);
     }
 }
 
+/* Takes ownership of bytecode */
 VMError vm_load_program(VM *vm, uint8_t *bytecode, int size) {
-    vm->code = bytecode;
+    VMError err = vm_attach_program(vm, bytecode, size);
+    vm->owns_code = true;
+    return err;
+}
+
+/* Like vm_load_program(), but the caller keeps bytecode, which must stay
+   unchanged for as long as the VM uses it */
+VMError vm_attach_program(VM *vm, const uint8_t *bytecode, int size) {
+    if (vm->owns_code && vm->code != bytecode) free(vm->code);
+    vm->code = (uint8_t *)bytecode;
+    vm->owns_code = false;
     vm->code_size = size;
     vm->pc = 0;
     vm->sp = 0;
     vm->rsp = 0;
+    vm->fp = 0;
     vm->running = false;
     vm->error = VM_OK;
-    memset(vm->memory, 0, MEMORY_SIZE * sizeof(int32_t));
+    vm->instr_count = 0;
+    memset(vm->memory, 0, vm->memory_size * sizeof(int32_t));
+    if (!decode_program(vm)) return VM_ERROR_MEMORY_BOUNDS;
+    verify_program(vm);
     return VM_OK;
 }
 
-/* Lab 4 execute_instruction with LAB6 additions */
-static void execute_instruction(VM *vm) {
-    if (vm->pc >= vm->code_size) {
-        vm->error = VM_ERROR_CODE_BOUNDS;
-        vm->running = false;
-        return;
-    }
+/*
+ * Runtime quickening. The verified loop counts each backward OP_JMP (a
+ * while loop's back-edge) in the record's operand2; when the count
+ * reaches VM_QUICKEN_THRESHOLD the records of the loop body are rewritten
+ * in place into the OP_Q_* forms, which fuse sequences codegen leaves
+ * apart. A counted loop's OP_LOOP_* uses all three operands, so there is
+ * nowhere to count: its body is quickened the first time it branches
+ * back (quicken_loop()). A fused record runs the whole sequence and steps ip over the
+ * records it covers; those records stay as they were, so a jump into the
+ * middle still works. Only vm->insns changes: vm->code, the pc values
+ * and the source map the debugger uses are untouched.
+ */
+#define VM_QUICKEN_THRESHOLD 64
 
-    uint8_t opcode = vm->code[vm->pc];
-    vm->pc++;
+static uint8_t quickened_compare(uint8_t jz_opcode) {
+    return (uint8_t)(OP_Q_JZ_LT_IMM + (jz_opcode - OP_JZ_LT));
+}
 
-    switch (opcode) {
+static uint8_t quickened_binary(uint8_t first, uint8_t op) {
+    int k = op == OP_ADD ? 0 : op == OP_SUB ? 1 : op == OP_MUL ? 2 : 3;
+    return (uint8_t)((first == OP_PUSH ? OP_Q_ADDI : OP_Q_LOAD_ADD) + k);
+}
 
-        case OP_PUSH: {
-            int32_t value = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, value)) { vm->running = false; }
-            break;
-        }
+static void quicken_region(VM *vm, int from, int to) {
+    VMInstr *insns = vm->insns;
 
-        case OP_POP: {
-            stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; }
-            break;
-        }
+    for (int i = from; i < to; i++) {
+        VMInstr *ins = &insns[i];
+        uint8_t next = i + 1 < to ? insns[i + 1].base_opcode : OP_END_OF_CODE;
+        uint8_t after = i + 2 < to ? insns[i + 2].base_opcode : OP_END_OF_CODE;
 
-        case OP_DUP: {
-            int32_t value = stack_peek(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, value)) { vm->running = false; }
-            break;
-        }
+        if (ins->opcode != ins->base_opcode) continue;
 
-        case OP_ADD: {
-            int32_t b = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, a + b)) { vm->running = false; }
-            break;
+        if (ins->opcode == OP_LOAD && next == OP_PUSH &&
+            after >= OP_JZ_LT && after <= OP_JZ_GE) {
+            ins->operand2 = insns[i + 1].operand;
+            ins->operand3 = insns[i + 2].operand;
+            ins->opcode = quickened_compare(after);
+        } else if (ins->opcode == OP_PUSH &&
+                   (next == OP_ADD || next == OP_SUB || next == OP_MUL ||
+                    (next == OP_DIV && ins->operand != 0))) {
+            ins->opcode = quickened_binary(OP_PUSH, next);
+        } else if (ins->opcode == OP_LOAD &&
+                   (next == OP_ADD || next == OP_SUB || next == OP_MUL)) {
+            ins->opcode = quickened_binary(OP_LOAD, next);
+        } else {
+            continue;
         }
+        vm->quickened++;
+    }
+}
 
-        case OP_SUB: {
-            int32_t b = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, a - b)) { vm->running = false; }
-            break;
-        }
+/* The record at `at` is an OP_LOOP_*; it becomes its OP_Q_LOOP_* twin,
+   which branches the same way without quickening again */
+static void quicken_loop(VM *vm, int at) {
+    VMInstr *ins = &vm->insns[at];
+    quicken_region(vm, ins->operand, at);
+    ins->opcode = (uint8_t)(OP_Q_LOOP_INC + (ins->base_opcode - OP_LOOP_INC));
+    vm->quickened++;
+}
 
-        case OP_MUL: {
-            int32_t b = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, a * b)) { vm->running = false; }
-            break;
-        }
+/* Put the decoded program back the way vm_load_program() left it */
+static void unquicken_program(VM *vm) {
+    for (int i = 0; i < vm->insn_count; i++) {
+        VMInstr *ins = &vm->insns[i];
+        int operands = opcode_operand_count(ins->base_opcode);
+        ins->opcode = ins->base_opcode;
+        if (operands < 2) ins->operand2 = 0;
+        if (operands < 3) ins->operand3 = 0;
+    }
+    vm->quickened = 0;
+}
 
-        case OP_DIV: {
-            int32_t b = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (b == 0) {
-                vm->error = VM_ERROR_DIVISION_BY_ZERO;
-                vm->running = false;
-                return;
-            }
-            int32_t a = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, a / b)) { vm->running = false; }
-            break;
-        }
+/*
+ * Interpreter loops. The handlers live in vm_loop.h and are expanded once
+ * for vm_run() and once for vm_step(). GCC builds get threaded dispatch
+ * (labels-as-values); define VM_NO_COMPUTED_GOTO to force the portable
+ * switch.
+ */
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
 
-        case OP_CMP: {
-            int32_t b = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, (a < b) ? 1 : 0)) { vm->running = false; }
-            break;
-        }
+/*
+ * OP_PRINT output. Values are formatted by hand into vm->out_buf, so a
+ * print is a few stores rather than a locked, formatted stdio call; the
+ * buffer goes to output_fn when it fills and when the VM returns to its
+ * caller. The default sink is fwrite() to stdout, which keeps program
+ * output in order with what the shell prints around it.
+ *
+ * A sink may take less than it is offered (a full ring, see the program
+ * manager). The rest stays in the buffer, which then grows instead of
+ * losing output; callers that care check vm->out_len after a run and
+ * hold the program back until its sink has room. Only if that memory
+ * cannot be had is a value lost, and vm->out_dropped counts its bytes.
+ */
+#define OUTPUT_INT_MAX 12   /* "-2147483648\n" */
 
-        /* LAB6 CHANGE: additional comparison opcodes */
-        case OP_CMP_EQ: {
-            int32_t b = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, (a == b) ? 1 : 0)) { vm->running = false; }
-            break;
-        }
-        case OP_CMP_NE: {
-            int32_t b = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, (a != b) ? 1 : 0)) { vm->running = false; }
-            break;
-        }
-        case OP_CMP_GT: {
-            int32_t b = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, (a > b) ? 1 : 0)) { vm->running = false; }
-            break;
-        }
-        case OP_CMP_LE: {
-            int32_t b = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, (a <= b) ? 1 : 0)) { vm->running = false; }
-            break;
-        }
-        case OP_CMP_GE: {
-            int32_t b = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t a = stack_pop(vm); if (vm->error != VM_OK) { vm->running = false; return; }
-            if (!stack_push(vm, (a >= b) ? 1 : 0)) { vm->running = false; }
-            break;
-        }
+static size_t output_to_stdout(void *ctx, const char *data, size_t len) {
+    (void)ctx;
+    return fwrite(data, 1, len, stdout);
+}
 
-        case OP_JMP: {
-            int32_t address = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (address < 0 || address > vm->code_size) {
-                vm->error = VM_ERROR_CODE_BOUNDS;
-                vm->running = false;
-                return;
-            }
-            vm->pc = address;
-            break;
-        }
+/* Hand the buffer to the sink; true if it took everything */
+bool vm_flush_output(VM *vm) {
+    if (vm->out_len == 0) return true;
+    size_t taken = vm->output_fn ? vm->output_fn(vm->output_ctx, vm->out_buf, vm->out_len)
+                                 : output_to_stdout(NULL, vm->out_buf, vm->out_len);
+    if (taken < vm->out_len) {
+        memmove(vm->out_buf, vm->out_buf + taken, vm->out_len - taken);
+    }
+    vm->out_len -= taken;
+    return vm->out_len == 0;
+}
 
-        case OP_JZ: {
-            int32_t address = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t value = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (value == 0) {
-                if (address < 0 || address > vm->code_size) {
-                    vm->error = VM_ERROR_CODE_BOUNDS;
-                    vm->running = false;
-                    return;
-                }
-                vm->pc = address;
-            }
-            break;
-        }
+void vm_set_output(VM *vm, VMOutputFn fn, void *ctx) {
+    vm_flush_output(vm);
+    vm->output_fn = fn;
+    vm->output_ctx = ctx;
+}
 
-        case OP_JNZ: {
-            int32_t address = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            int32_t value = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (value != 0) {
-                if (address < 0 || address > vm->code_size) {
-                    vm->error = VM_ERROR_CODE_BOUNDS;
-                    vm->running = false;
-                    return;
-                }
-                vm->pc = address;
-            }
-            break;
-        }
+/* Make room for one formatted value; false if no buffer can be had */
+static bool output_reserve(VM *vm) {
+    if (!vm->out_buf) {
+        vm->out_buf = malloc(VM_OUTPUT_BUFFER);
+        if (!vm->out_buf) return false;
+        vm->out_capacity = VM_OUTPUT_BUFFER;
+    }
+    if (vm->out_capacity - vm->out_len >= OUTPUT_INT_MAX || vm_flush_output(vm)) {
+        return true;
+    }
+    if (vm->out_capacity - vm->out_len < OUTPUT_INT_MAX) {
+        char *grown = realloc(vm->out_buf, vm->out_capacity * 2);
+        if (!grown) return false;
+        vm->out_buf = grown;
+        vm->out_capacity *= 2;
+    }
+    return true;
+}
 
-        case OP_STORE: {
-            int32_t index = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (index < 0 || index >= MEMORY_SIZE) {
-                vm->error = VM_ERROR_MEMORY_BOUNDS;
-                vm->running = false;
-                return;
-            }
-            int32_t value = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            vm->memory[index] = value;
-            break;
-        }
+static inline void output_int(VM *vm, int32_t value) {
+    char digits[10];
+    int n = 0;
+    uint32_t u = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    do {
+        digits[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
 
-        case OP_LOAD: {
-            int32_t index = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            if (index < 0 || index >= MEMORY_SIZE) {
-                vm->error = VM_ERROR_MEMORY_BOUNDS;
-                vm->running = false;
-                return;
-            }
-            if (!stack_push(vm, vm->memory[index])) { vm->running = false; }
-            break;
-        }
+    if (vm->out_capacity - vm->out_len < OUTPUT_INT_MAX && !output_reserve(vm)) {
+        vm->out_dropped += (size_t)n + 1 + (value < 0);
+        return;
+    }
+    char *p = vm->out_buf + vm->out_len;
+    if (value < 0) *p++ = '-';
+    while (n > 0) *p++ = digits[--n];
+    *p++ = '\n';
+    vm->out_len = (size_t)(p - vm->out_buf);
+}
 
-        case OP_CALL: {
-            int32_t address = read_int32(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
+/* OP_PRINT for JIT and AOT code */
+void vm_print_int(VM *vm, int32_t value) {
+    output_int(vm, value);
+}
 
-            if (address < 0 || address >= vm->code_size) {
-                vm->error = VM_ERROR_CODE_BOUNDS;
-                vm->running = false;
-                return;
-            }
+/* Takes ownership of input (NULL detaches) and closes the previous one */
+void vm_set_input(VM *vm, struct VMInput *input) {
+    if (vm->input != input) input_close(vm->input);
+    vm->input = input;
+}
 
-            if (!return_stack_push(vm, vm->pc)) {
-                vm->running = false;
-                return;
-            }
+static inline int32_t input_int(VM *vm) {
+    return vm->input ? input_read(vm->input) : 0;
+}
 
-            vm->pc = address;
-            break;
-        }
+static inline int32_t input_done(VM *vm) {
+    return !vm->input || input_eof(vm->input);
+}
 
-        case OP_RET: {
-            int32_t return_address = return_stack_pop(vm);
-            if (vm->error != VM_OK) {
-                vm->running = false;
-                return;
-            }
-            vm->pc = return_address;
-            break;
-        }
+/*
+ * OP_DIV and OP_MOD for b != 0. idiv traps on INT32_MIN / -1, so b == -1
+ * is done by hand: the quotient wraps like OP_SUB, the remainder is 0.
+ */
+static inline int32_t div_int(int32_t a, int32_t b) {
+    return b == -1 ? (int32_t)(0u - (uint32_t)a) : a / b;
+}
 
-        /* LAB6 CHANGE: print opcode */
-        case OP_PRINT: {
-            int32_t value = stack_pop(vm);
-            if (vm->error != VM_OK) { vm->running = false; return; }
-            printf("%d\n", value);
-            break;
-        }
+static inline int32_t mod_int(int32_t a, int32_t b) {
+    return b == -1 ? 0 : a % b;
+}
 
-        case OP_HALT: {
-            vm->running = false;
-            break;
-        }
+/*
+ * OP_DIV_POW2 and OP_MOD_POW2: a / 2^k and a % 2^k rounding toward zero
+ * like OP_DIV and OP_MOD. A negative a is biased by 2^k - 1 first, so the
+ * arithmetic shift and the mask see the value that truncates correctly.
+ */
+static inline int32_t div_pow2(int32_t a, int32_t k) {
+    int32_t m = (int32_t)((1u << (k & 31)) - 1);
+    return (a + ((a >> 31) & m)) >> (k & 31);
+}
 
-        default: {
-            vm->error = VM_ERROR_INVALID_OPCODE;
-            vm->running = false;
-            break;
-        }
+static inline int32_t mod_pow2(int32_t a, int32_t k) {
+    int32_t m = (int32_t)((1u << (k & 31)) - 1);
+    int32_t bias = (a >> 31) & m;
+    return ((a + bias) & m) - bias;
+}
+
+/* OP_READ and OP_EOF for JIT and AOT code */
+int32_t vm_read_int(VM *vm) {
+    return input_int(vm);
+}
+
+int32_t vm_input_eof(VM *vm) {
+    return input_done(vm);
+}
+
+/*
+ * Add fn to the VM's native table and return its index, or -1 if out of
+ * memory. Natives are registered before vm_attach_program(): the
+ * verifier only passes an OP_NATIVE whose index and argc match an entry.
+ */
+int vm_register_native(VM *vm, const char *name, VMNativeFn fn, int arity) {
+    if (!fn || arity < 0) return -1;
+    if (vm->native_count >= vm->native_capacity) {
+        int cap = vm->native_capacity ? vm->native_capacity * 2 : 8;
+        VMNative *natives = realloc(vm->natives, cap * sizeof(VMNative));
+        if (!natives) return -1;
+        vm->natives = natives;
+        vm->native_capacity = cap;
     }
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    VMNative *n = &vm->natives[vm->native_count];
+    n->name = copy;
+    n->fn = fn;
+    n->arity = arity;
+    n->calls = 0;
+    n->ns = 0;
+    return vm->native_count++;
 }
 
+/* OP_NATIVE for the interpreter and JIT code: index was checked */
+int32_t vm_call_native(VM *vm, int32_t index, const int32_t *args) {
+    VMNative *n = &vm->natives[index];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int32_t result = n->fn(vm, args);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    n->calls++;
+    n->ns += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000LL +
+                        (end.tv_nsec - start.tv_nsec));
+    return result;
+}
+
+#define VM_LOOP_NAME run_loop
+#define VM_LOOP_STEP 0
+#define VM_LOOP_CHECKED 1
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_STEP
+#undef VM_LOOP_CHECKED
+
+/* Same handlers with stack and slot checks compiled out and the top of
+   stack cached in a local; only entered for programs that passed
+   verify_program(), and the only loop that quickens. Define
+   VM_NO_TOS_CACHE to keep the whole stack in memory instead. */
+#define VM_LOOP_NAME run_loop_verified
+#define VM_LOOP_STEP 0
+#define VM_LOOP_CHECKED 0
+#ifdef VM_NO_TOS_CACHE
+#define VM_LOOP_TOS 0
+#else
+#define VM_LOOP_TOS 1
+#endif
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_STEP
+#undef VM_LOOP_CHECKED
+#undef VM_LOOP_TOS
+
+/* Budgeted copies of the two run loops for vm_run_slice(); kept separate
+   so vm_run() pays nothing for the budget check on jumps */
+#define VM_LOOP_NAME run_slice
+#define VM_LOOP_STEP 0
+#define VM_LOOP_CHECKED 1
+#define VM_LOOP_BUDGET 1
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_STEP
+#undef VM_LOOP_CHECKED
+#undef VM_LOOP_BUDGET
+
+#define VM_LOOP_NAME run_slice_verified
+#define VM_LOOP_STEP 0
+#define VM_LOOP_CHECKED 0
+#define VM_LOOP_BUDGET 1
+#ifdef VM_NO_TOS_CACHE
+#define VM_LOOP_TOS 0
+#else
+#define VM_LOOP_TOS 1
+#endif
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_STEP
+#undef VM_LOOP_CHECKED
+#undef VM_LOOP_BUDGET
+#undef VM_LOOP_TOS
+
+#define VM_LOOP_NAME step_one
+#define VM_LOOP_STEP 1
+#define VM_LOOP_CHECKED 1
+#include "vm_loop.h"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_STEP
+#undef VM_LOOP_CHECKED
+
 VMError vm_run(VM *vm) {
     vm->running = true;
     vm->error = VM_OK;
 
-    while (vm->running && vm->error == VM_OK) {
-        execute_instruction(vm);
+    /* The JIT declines anything it cannot run (see jit.h) */
+    if (vm->jit_enabled && jit_run(vm)) {
+        vm_flush_output(vm);
+        return vm->error;
     }
 
+    run_guarded(vm, vm->verified ? run_loop_verified : run_loop, 0);
+    vm_flush_output(vm);
+
+    return vm->error;
+}
+
+/*
+ * Run for about `budget` instructions: the slice ends at the first
+ * backward jump or call after that many have executed (code between them
+ * is bounded by the program size). vm->running stays true if the program
+ * was cut short; call again to continue. Always interprets, since JIT and
+ * AOT code run to completion.
+ */
+VMError vm_run_slice(VM *vm, uint64_t budget) {
+    vm->running = true;
+    vm->error = VM_OK;
+
+    run_guarded(vm, vm->verified && !vm->back_branches ? run_slice_verified : run_slice,
+                budget);
+    vm_flush_output(vm);
+
     return vm->error;
 }
 
@@ -393,8 +1339,13 @@ VMError vm_step(VM *vm) {
         vm->running = true;
         vm->error = VM_OK;
     }
+    /* Single-stepping must see one record per bytecode instruction */
+    if (vm->quickened > 0) {
+        unquicken_program(vm);
+    }
     if (vm->running && vm->error == VM_OK) {
-        execute_instruction(vm);
+        run_guarded(vm, step_one, 0);
+        vm_flush_output(vm);
     }
     return vm->error;
 }
@@ -402,7 +1353,7 @@ VMError vm_step(VM *vm) {
 void vm_dump_state(VM *vm) {
     printf("=== VM State ===\n");
     printf("PC: %d\n", vm->pc);
-    printf("SP: %d, RSP: %d\n", vm->sp, vm->rsp);
+    printf("SP: %d, RSP: %d, FP: %d\n", vm->sp, vm->rsp, vm->fp);
     printf("Running: %s\n", vm->running ? "yes" : "no");
     printf("Error: %s\n", vm_error_string(vm->error));
 
@@ -426,7 +1377,7 @@ void vm_dump_state(VM *vm) {
 
     printf("Memory: [");
     int shown = 0;
-    for (int i = 0; i < MEMORY_SIZE && shown < 5; i++) {
+    for (int i = 0; i < vm->memory_size && shown < 5; i++) {
         if (vm->memory[i] != 0) {
             if (shown > 0) printf(", ");
             printf("M[%d]=%d", i, vm->memory[i]);
@@ -454,6 +1405,10 @@ const char* vm_error_string(VMError error) {
         case VM_ERROR_RETURN_STACK_OVERFLOW:  return "Return stack overflow";
         case VM_ERROR_RETURN_STACK_UNDERFLOW: return "Return stack underflow";
         case VM_ERROR_FILE_IO:                return "File I/O error";
+        case VM_ERROR_INDEX_BOUNDS:           return "Array index out of bounds";
+        case VM_ERROR_NOT_PAIR:               return "Not a pair";
+        case VM_ERROR_HEAP_FULL:              return "Object heap is full";
+        case VM_ERROR_BAD_NATIVE:             return "Unknown native function";
         default:                              return "Unknown error";
     }
 }
@@ -3,12 +3,58 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "gc.h"  /* For Object and Value types */
 
+struct JitCode;
+struct VMInput;
+
+/* Region sizes used by vm_create(); vm_create_sized() takes per-program
+   sizes (see codegen_vm_limits()) */
 #define STACK_SIZE        1024
 #define MEMORY_SIZE       256
 #define RETURN_STACK_SIZE 256
-#define VM_STACK_MAX      256
+
+/* Programs with functions: operand stack entries shared by all live
+   frames, and return stack entries (two per active call) */
+#define CALL_STACK_SIZE   65536
+#define CALL_RETURN_SIZE  16384
+
+/* Distinct slots the verifier tracks as element indices (OP_LOAD_ELEM,
+   OP_STORE_ELEM); codegen stays within this */
+#define VM_INDEX_SLOTS 8
+
+/* OP_PRINT output is formatted into a per-VM buffer of this many bytes
+   and handed on in large chunks (see vm_flush_output()) */
+#define VM_OUTPUT_BUFFER 65536
+
+/* Receives a VM's output and returns how many bytes it took; the
+   default writes everything to stdout */
+typedef size_t (*VMOutputFn)(void *ctx, const char *data, size_t len);
+
+struct VM;
+
+/* A host function called by OP_NATIVE. args points at the call's
+   arguments in place on the operand stack, first argument first. A
+   native may read the VM and write the elements of arrays it was passed
+   (an array argument is its base slot in vm->memory), but must not
+   allocate objects or change anything else. */
+typedef int32_t (*VMNativeFn)(struct VM *vm, const int32_t *args);
+
+/* An entry of the VM's native table; OP_NATIVE's operand indexes it */
+typedef struct {
+    char *name;
+    VMNativeFn fn;
+    int arity;
+    uint64_t calls;        /* calls since registration, */
+    uint64_t ns;           /* and the time spent in them */
+} VMNative;
+
+typedef struct {
+    int memory_size;        /* variable slots */
+    int stack_size;         /* operand stack entries */
+    int return_stack_size;
+} VMLimits;
 
 typedef enum {
     VM_OK = 0,
@@ -20,35 +66,121 @@ typedef enum {
     VM_ERROR_CODE_BOUNDS,
     VM_ERROR_RETURN_STACK_OVERFLOW,
     VM_ERROR_RETURN_STACK_UNDERFLOW,
-    VM_ERROR_FILE_IO
+    VM_ERROR_FILE_IO,
+    VM_ERROR_INDEX_BOUNDS,
+    VM_ERROR_NOT_PAIR,
+    VM_ERROR_HEAP_FULL,
+    VM_ERROR_BAD_NATIVE
 } VMError;
 
+/* One pre-decoded instruction. vm_load_program() translates the byte
+   stream into an array of these so the interpreter never re-reads the
+   little-endian operand encoding; jump operands hold record indices.
+   Backward OP_JMP records count their executions in operand2. */
+typedef struct {
+    int32_t operand;
+    int32_t operand2;      /* second operand of superinstructions */
+    int32_t operand3;      /* third operand of register-engine forms */
+    uint8_t opcode;
+    uint8_t base_opcode;   /* opcode before quickening */
+} VMInstr;
+
 typedef struct VM {
     /* Original VM fields */
     int32_t *stack;
     int sp;
     int32_t *memory;
+    int stack_size;        /* region sizes in use; vm_reset() may change them */
+    int memory_size;
+    int return_stack_size;
+    VMLimits capacity;     /* region sizes allocated at creation */
     uint8_t *code;
     int code_size;
+    bool owns_code;        /* vm_destroy() frees code (vm_load_program) */
     int pc;
     int32_t *return_stack;
     int rsp;
+    int fp;                /* frame pointer: stack index of the current frame */
     bool running;
     VMError error;
+    uint64_t instr_count;  /* instructions dispatched since load */
+
+    /* Pre-decoded program (built by vm_load_program) */
+    VMInstr *insns;        /* insn_count records + OP_END_OF_CODE sentinel */
+    int insn_count;
+    int *insn_offset;      /* record index -> byte offset (pc) */
+    int *insn_at;          /* byte offset -> record index, -1 mid-instruction */
+    bool verified;         /* passed load-time verification: unchecked loop */
+    bool back_branches;    /* a JZ/JNZ-style jump goes backward (hand-made
+                              code); vm_run_slice() then checks every branch */
+    bool index_proof;      /* verified relies on element indices proven from
+                              zeroed memory (see verify_index_ranges()) */
+    int max_stack_depth;   /* computed by the verifier */
+    int frame_depth;       /* deepest function frame, counted from fp */
+    int *insn_depth;       /* verifier's stack depth per record, -1 if unreachable */
+    int insn_capacity;     /* code bytes the buffers above can decode */
+    int quickened;         /* records currently rewritten to OP_Q_* forms */
+
+    /* Native code (jit.c), built on the first vm_run() with jit_enabled */
+    bool jit_enabled;
+    struct JitCode *jit;
+
+    size_t slab_size;      /* VM_GUARD_PAGES: bytes mapped for the whole VM */
+
+    /* Buffered OP_PRINT output; flushed when full and whenever a run,
+       slice or step returns */
+    char *out_buf;         /* allocated on first print */
+    size_t out_len;        /* bytes not yet taken by the sink */
+    size_t out_capacity;   /* VM_OUTPUT_BUFFER, more while a sink is full */
+    size_t out_dropped;    /* bytes lost because no buffer could be had */
+    VMOutputFn output_fn;  /* NULL: stdout */
+    void *output_ctx;
+
+    /* Values for read() and eof(); NULL reads as empty (see input.h) */
+    struct VMInput *input;
+
+    /* Host functions for OP_NATIVE, registered before the program is
+       attached so the verifier can check each call against its entry;
+       vm_reset() empties the table */
+    VMNative *natives;
+    int native_count;
+    int native_capacity;
 
-    /* GC-related fields (Lab 5) */
+    /* GC-related fields (Lab 5). The operand stack and memory are the
+       roots; refs maps a reference word to its object (see gc.h). */
     Object *first_object;
     int num_objects;
     int max_objects;
-    Value *value_stack;
-    int stack_count;
     bool auto_gc;  /* Enable/disable automatic GC triggering */
+    Object **refs;         /* reference index -> object, NULL once freed */
+    int32_t *free_refs;    /* freed indices, reused before refs grows */
+    int ref_count;         /* indices handed out */
+    int ref_capacity;
+    int free_ref_count;
+    Object **gray;         /* marked objects not yet scanned */
+    int gray_count;
+    int gray_capacity;
+    uint64_t gc_runs;      /* collections since load, */
+    uint64_t gc_freed;     /* the objects they freed */
+    uint64_t gc_ns;        /* and the time they took */
 } VM;
 
 VM* vm_create(void);
+VM* vm_create_sized(const VMLimits *limits);
 void vm_destroy(VM *vm);
+bool vm_reset(VM *vm, const VMLimits *limits);
 VMError vm_load_program(VM *vm, uint8_t *bytecode, int size);
+VMError vm_attach_program(VM *vm, const uint8_t *bytecode, int size);
 VMError vm_run(VM *vm);
+VMError vm_run_slice(VM *vm, uint64_t budget);
+void vm_set_output(VM *vm, VMOutputFn fn, void *ctx);
+void vm_print_int(VM *vm, int32_t value);
+bool vm_flush_output(VM *vm);
+void vm_set_input(VM *vm, struct VMInput *input);
+int32_t vm_read_int(VM *vm);
+int32_t vm_input_eof(VM *vm);
+int vm_register_native(VM *vm, const char *name, VMNativeFn fn, int arity);
+int32_t vm_call_native(VM *vm, int32_t index, const int32_t *args);
 void vm_dump_state(VM *vm);
 const char* vm_error_string(VMError error);
 
@@ -0,0 +1,1066 @@
+/*
+ * vm_loop.h - Interpreter loop template (included by vm.c only)
+ *
+ * This file has no include guard on purpose: vm.c includes it once per
+ * loop variant. Before each include, define:
+ *   VM_LOOP_NAME   name of the generated static function
+ *   VM_LOOP_STEP   1 to return after one instruction (vm_step), 0 to run
+ *                  until halt or error (vm_run)
+ *   VM_LOOP_CHECKED 1 to check stack depth and memory slots on every
+ *                  instruction, 0 for programs that passed verify_program()
+ *   VM_LOOP_TOS    optional, 1 to keep the top of the operand stack in a
+ *                  local (unchecked loops only); it is spilled to
+ *                  vm->stack whenever the loop returns
+ *   VM_LOOP_BUDGET optional, 1 to return with the program still running
+ *                  at the first backward jump once `budget`
+ *                  instructions have executed (vm_run_slice)
+ *
+ * Unchecked, non-stepping loops also count back-edges and call
+ * quicken_region() on hot loops, and quicken_loop() on counted loops
+ * (see vm.c).
+ *
+ * The loop runs over the pre-decoded records built by vm_load_program()
+ * (vm->insns); vm->pc is only translated to and from a record index on
+ * entry and exit. With VM_COMPUTED_GOTO (GCC labels-as-values) every
+ * handler ends by jumping straight to the next handler through
+ * dispatch_table. Otherwise the same handler bodies are compiled as cases
+ * of a portable switch inside a loop.
+ */
+
+#ifdef VM_COMPUTED_GOTO
+#define TARGET(op) L_##op:
+#if VM_LOOP_STEP
+#define DISPATCH() goto vm_yield
+#else
+#define DISPATCH() do {                                         \
+        executed++;                                             \
+        goto *dispatch_table[(ip++)->opcode];                   \
+    } while (0)
+#endif
+#else
+#define TARGET(op) case op:
+#define DISPATCH() goto vm_next
+#endif
+
+#define VM_FAIL(err) do { vm->error = (err); goto vm_exit; } while (0)
+#define CHECK_ERROR() do { if (vm->error != VM_OK) goto vm_exit; } while (0)
+
+/* Operands of the instruction being executed (ip already points past it) */
+#define OPERAND (ip[-1].operand)
+#define OPERAND2 (ip[-1].operand2)
+#define OPERAND3 (ip[-1].operand3)
+
+#if VM_LOOP_TOS && VM_LOOP_CHECKED
+#error "top-of-stack caching is only implemented for the unchecked loop"
+#endif
+
+#if VM_LOOP_TOS
+/*
+ * The top element lives in `tos` and sp points at the slot it spills to,
+ * so memory holds the other depth - 1 elements. At depth 0 sp is
+ * stack[-1], the spare slot vm_create() allocates below the stack.
+ */
+#define PUSH(v) do { int32_t pushed_ = (v); *sp++ = tos; tos = pushed_; } while (0)
+#define POP(dst) do { (dst) = tos; tos = *--sp; } while (0)
+#define PEEK(dst) ((dst) = tos)
+#define TOP tos
+#define CHECK_SLOT(i) ((void)0)
+#define CHECK_ARRAY(base, len) ((void)0)
+#elif VM_LOOP_CHECKED
+#ifdef VM_GUARD_PAGES
+/* Writing past the stack faults on its guard page (see vm.c) */
+#define PUSH(v) (*sp++ = (v))
+#else
+#define PUSH(v) do {                                            \
+        if (sp >= stack_limit) VM_FAIL(VM_ERROR_STACK_OVERFLOW);\
+        *sp++ = (v);                                            \
+    } while (0)
+#endif
+#define POP(dst) do {                                           \
+        if (sp <= stack_base) VM_FAIL(VM_ERROR_STACK_UNDERFLOW);\
+        (dst) = *--sp;                                          \
+    } while (0)
+#define PEEK(dst) do {                                          \
+        if (sp <= stack_base) VM_FAIL(VM_ERROR_STACK_UNDERFLOW);\
+        (dst) = sp[-1];                                         \
+    } while (0)
+#define CHECK_SLOT(i) do {                                      \
+        if ((i) < 0 || (i) >= memory_size)                      \
+            VM_FAIL(VM_ERROR_MEMORY_BOUNDS);                    \
+    } while (0)
+#define CHECK_ARRAY(base, len) do {                             \
+        if ((base) < 0 || (len) < 0 || (base) > memory_size - (len)) \
+            VM_FAIL(VM_ERROR_MEMORY_BOUNDS);                    \
+    } while (0)
+#define TOP (sp[-1])
+#else
+/* Depth and slot ranges were proven at load time */
+#define PUSH(v) (*sp++ = (v))
+#define POP(dst) ((dst) = *--sp)
+#define PEEK(dst) ((dst) = sp[-1])
+#define TOP (sp[-1])
+#define CHECK_SLOT(i) ((void)0)
+#define CHECK_ARRAY(base, len) ((void)0)
+#endif
+
+/* Element indices: the indexed forms always check theirs; the element
+   forms' were proven in range unless the program runs checked */
+#define CHECK_INDEX(i) do {                                     \
+        if ((uint32_t)(i) >= (uint32_t)OPERAND2)                \
+            VM_FAIL(VM_ERROR_INDEX_BOUNDS);                     \
+    } while (0)
+#if VM_LOOP_CHECKED
+#define CHECK_ELEMENT(i) CHECK_INDEX(i)
+#else
+#define CHECK_ELEMENT(i) ((void)0)
+#endif
+
+/* Frame slots (OP_LOAD_LOCAL, OP_STORE_LOCAL) sit below the top; with
+   the top cached, the slot at sp is the one in tos. SPILL() and RELOAD()
+   bracket the frame opcodes, which move sp by more than one entry. */
+#if VM_LOOP_TOS
+#define LOCAL_GET(k) (fp + (k) == sp ? tos : fp[k])
+#define LOCAL_SET(k, v) do {                                    \
+        if (fp + (k) == sp) tos = (v); else fp[k] = (v);        \
+    } while (0)
+#define SPILL() (*sp++ = tos)
+#define RELOAD() (tos = *--sp)
+#else
+#define LOCAL_GET(k) (fp[k])
+#define LOCAL_SET(k, v) (fp[k] = (v))
+#define SPILL() ((void)0)
+#define RELOAD() ((void)0)
+#endif
+/* The collector scans vm->stack below vm->sp: OP_PAIR publishes the
+   depth, and the cached top, before it allocates */
+#if VM_LOOP_TOS
+#define SYNC_STACK() (*sp = tos, vm->sp = (int)(sp - stack_base) + 1)
+#else
+#define SYNC_STACK() (vm->sp = (int)(sp - stack_base))
+#endif
+
+/* Pair field access: a is the reference word */
+#define PAIR_OF(obj, a) do {                                    \
+        (obj) = gc_deref(vm, (a));                              \
+        if (!(obj) || (obj)->type != OBJ_PAIR)                  \
+            VM_FAIL(VM_ERROR_NOT_PAIR);                         \
+    } while (0)
+
+#if VM_LOOP_CHECKED
+#define CHECK_LOCAL(k) do {                                     \
+        if ((k) < 0 || fp + (k) >= sp)                          \
+            VM_FAIL(VM_ERROR_MEMORY_BOUNDS);                    \
+    } while (0)
+#else
+#define CHECK_LOCAL(k) ((void)0)
+#endif
+
+#if VM_LOOP_TOS
+/* b is already in a register; one load and no stores */
+#define BINARY_OP(expr) do {                                    \
+        b = tos;                                                \
+        a = *--sp;                                              \
+        tos = (expr);                                           \
+        DISPATCH();                                             \
+    } while (0)
+#else
+#define BINARY_OP(expr) do {                                    \
+        POP(b);                                                 \
+        POP(a);                                                 \
+        PUSH(expr);                                             \
+        DISPATCH();                                             \
+    } while (0)
+#endif
+
+/* Jump operands are record indices resolved by decode_program(). Code
+   only runs again after a transfer to an earlier record, so a slice ends
+   only there: JUMP_BACK on the sites that are backward by construction
+   (loop back-edges, calls, tail calls) and JUMP_IF on conditional jumps,
+   which codegen only emits forward. The verified slice loop takes that on
+   trust (vm_run_slice() gives hand-made code with backward conditional
+   jumps to the checked loop), so forward branches pay nothing. In a
+   budgeted loop `executed` counts up from -budget: the slice is used up
+   once it turns non-negative, a sign test on a register every dispatch
+   already updates. Returns (OP_RET, OP_RETURN) never end a slice. */
+#define JUMP_TO(index) (ip = insns + (index))
+#if VM_LOOP_BUDGET
+#define JUMP_BACK(index) do {                                   \
+        ip = insns + (index);                                   \
+        if ((int64_t)executed >= 0) goto vm_pause;              \
+    } while (0)
+#else
+#define JUMP_BACK(index) JUMP_TO(index)
+#endif
+#if VM_LOOP_BUDGET && VM_LOOP_CHECKED
+#define JUMP_IF(index) do {                                     \
+        VMInstr *to_ = insns + (index);                         \
+        if (to_ < ip && (int64_t)executed >= 0) {               \
+            ip = to_;                                           \
+            goto vm_pause;                                      \
+        }                                                       \
+        ip = to_;                                               \
+    } while (0)
+#else
+#define JUMP_IF(index) JUMP_TO(index)
+#endif
+
+/* Fused CMP_xx + JZ: branch when the comparison is false */
+#define COMPARE_JZ(cond) do {                                   \
+        POP(b);                                                 \
+        POP(a);                                                 \
+        if (!(cond)) JUMP_IF(OPERAND);                          \
+        DISPATCH();                                             \
+    } while (0)
+
+#define LOAD2_OP(op) do {                                       \
+        CHECK_SLOT(OPERAND);                                    \
+        CHECK_SLOT(OPERAND2);                                   \
+        PUSH(memory[OPERAND] op memory[OPERAND2]);              \
+        DISPATCH();                                             \
+    } while (0)
+
+/* Register engine: dst = M[a] op M[b] */
+#define REG_OP(expr) do {                                       \
+        CHECK_SLOT(OPERAND);                                    \
+        CHECK_SLOT(OPERAND2);                                   \
+        CHECK_SLOT(OPERAND3);                                   \
+        a = memory[OPERAND2];                                   \
+        b = memory[OPERAND3];                                   \
+        memory[OPERAND] = (expr);                               \
+        DISPATCH();                                             \
+    } while (0)
+
+#define REG_JZ(cond) do {                                       \
+        CHECK_SLOT(OPERAND2);                                   \
+        CHECK_SLOT(OPERAND3);                                   \
+        a = memory[OPERAND2];                                   \
+        b = memory[OPERAND3];                                   \
+        if (!(cond)) JUMP_IF(OPERAND);                          \
+        DISPATCH();                                             \
+    } while (0)
+
+/* Counted loop: step M[slot] by one, then jump back while it is short
+   of the limit. `taken` runs on the backward branch. The step is done
+   in uint32_t: it wraps like OP_ADD even without -fwrapv, so the compare
+   right after it cannot be folded on a no-overflow assumption. */
+#define LOOP_OP(step, cond, limit, taken) do {                  \
+        CHECK_SLOT(OPERAND2);                                   \
+        a = memory[OPERAND2] =                                  \
+            (int32_t)((uint32_t)memory[OPERAND2] + (uint32_t)(step)); \
+        b = (limit);                                            \
+        if (cond) {                                             \
+            taken;                                              \
+            JUMP_BACK(OPERAND);                                 \
+        }                                                       \
+        DISPATCH();                                             \
+    } while (0)
+
+#if !VM_LOOP_CHECKED && !VM_LOOP_STEP
+#define QUICKEN_LOOP() quicken_loop(vm, (int)(ip - insns) - 1)
+#else
+#define QUICKEN_LOOP() ((void)0)
+#endif
+
+/* Quickened forms: run the fused sequence, then step ip over the
+   records it covered and count them as executed */
+#define Q_SLOT_IMM_JZ(cond) do {                                \
+        CHECK_SLOT(OPERAND);                                    \
+        a = memory[OPERAND];                                    \
+        b = OPERAND2;                                           \
+        executed += 2;                                          \
+        if (!(cond)) JUMP_IF(OPERAND3);                         \
+        else ip += 2;                                           \
+        DISPATCH();                                             \
+    } while (0)
+
+#define Q_TOP_OP(expr) do {                                     \
+        PEEK(a);                                                \
+        TOP = (expr);                                           \
+        executed++;                                             \
+        ip++;                                                   \
+        DISPATCH();                                             \
+    } while (0)
+
+static void VM_LOOP_NAME(VM *vm, uint64_t budget) {
+    VMInstr *insns = vm->insns;
+    VMInstr *ip;
+    int32_t *const stack_base = vm->stack;
+#if VM_LOOP_TOS
+    int32_t *sp = vm->stack + vm->sp - 1;
+    int32_t tos = *sp;
+#else
+    int32_t *sp = vm->stack + vm->sp;
+#endif
+    int32_t *fp = vm->stack + vm->fp;
+    int32_t *const memory = vm->memory;
+#if VM_LOOP_BUDGET
+    uint64_t executed = 0 - budget;     /* see JUMP_BACK */
+#else
+    uint64_t executed = 0;
+    (void)budget;
+#endif
+    int32_t a, b;
+#if VM_LOOP_CHECKED
+    const int memory_size = vm->memory_size;
+#ifndef VM_GUARD_PAGES
+    int32_t *const stack_limit = vm->stack + vm->stack_size;
+#endif
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *dispatch_table[256] = {
+        [0 ... 255]  = &&L_invalid,
+        [OP_PUSH]    = &&L_OP_PUSH,
+        [OP_POP]     = &&L_OP_POP,
+        [OP_DUP]     = &&L_OP_DUP,
+        [OP_ADD]     = &&L_OP_ADD,
+        [OP_SUB]     = &&L_OP_SUB,
+        [OP_MUL]     = &&L_OP_MUL,
+        [OP_DIV]     = &&L_OP_DIV,
+        [OP_MOD]     = &&L_OP_MOD,
+        [OP_AND]     = &&L_OP_AND,
+        [OP_OR]      = &&L_OP_OR,
+        [OP_XOR]     = &&L_OP_XOR,
+        [OP_SHL]     = &&L_OP_SHL,
+        [OP_SHR]     = &&L_OP_SHR,
+        [OP_CMP]     = &&L_OP_CMP,
+        [OP_CMP_EQ]  = &&L_OP_CMP_EQ,
+        [OP_CMP_NE]  = &&L_OP_CMP_NE,
+        [OP_CMP_GT]  = &&L_OP_CMP_GT,
+        [OP_CMP_LE]  = &&L_OP_CMP_LE,
+        [OP_CMP_GE]  = &&L_OP_CMP_GE,
+        [OP_JMP]     = &&L_OP_JMP,
+        [OP_JZ]      = &&L_OP_JZ,
+        [OP_JNZ]     = &&L_OP_JNZ,
+        [OP_STORE]   = &&L_OP_STORE,
+        [OP_LOAD]    = &&L_OP_LOAD,
+        [OP_CALL]    = &&L_OP_CALL,
+        [OP_RET]     = &&L_OP_RET,
+        [OP_ENTER]   = &&L_OP_ENTER,
+        [OP_RETURN]  = &&L_OP_RETURN,
+        [OP_TAIL]    = &&L_OP_TAIL,
+        [OP_LOAD_LOCAL]  = &&L_OP_LOAD_LOCAL,
+        [OP_STORE_LOCAL] = &&L_OP_STORE_LOCAL,
+        [OP_PRINT]   = &&L_OP_PRINT,
+        [OP_READ]    = &&L_OP_READ,
+        [OP_EOF]     = &&L_OP_EOF,
+        [OP_LOOP_INC]   = &&L_OP_LOOP_INC,
+        [OP_LOOP_DEC]   = &&L_OP_LOOP_DEC,
+        [OP_LOOP_INC_M] = &&L_OP_LOOP_INC_M,
+        [OP_LOOP_DEC_M] = &&L_OP_LOOP_DEC_M,
+        [OP_INC_SLOT]   = &&L_OP_INC_SLOT,
+        [OP_PUSH_STORE] = &&L_OP_PUSH_STORE,
+        [OP_LOAD2_ADD]  = &&L_OP_LOAD2_ADD,
+        [OP_LOAD2_SUB]  = &&L_OP_LOAD2_SUB,
+        [OP_LOAD2_MUL]  = &&L_OP_LOAD2_MUL,
+        [OP_DIV_POW2]   = &&L_OP_DIV_POW2,
+        [OP_MOD_POW2]   = &&L_OP_MOD_POW2,
+        [OP_JZ_LT]   = &&L_OP_JZ_LT,
+        [OP_JZ_EQ]   = &&L_OP_JZ_EQ,
+        [OP_JZ_NE]   = &&L_OP_JZ_NE,
+        [OP_JZ_GT]   = &&L_OP_JZ_GT,
+        [OP_JZ_LE]   = &&L_OP_JZ_LE,
+        [OP_JZ_GE]   = &&L_OP_JZ_GE,
+        [OP_R_MOV]   = &&L_OP_R_MOV,
+        [OP_R_MOVI]  = &&L_OP_R_MOVI,
+        [OP_R_ADD]   = &&L_OP_R_ADD,
+        [OP_R_SUB]   = &&L_OP_R_SUB,
+        [OP_R_MUL]   = &&L_OP_R_MUL,
+        [OP_R_DIV]   = &&L_OP_R_DIV,
+        [OP_R_LT]    = &&L_OP_R_LT,
+        [OP_R_EQ]    = &&L_OP_R_EQ,
+        [OP_R_NE]    = &&L_OP_R_NE,
+        [OP_R_GT]    = &&L_OP_R_GT,
+        [OP_R_LE]    = &&L_OP_R_LE,
+        [OP_R_GE]    = &&L_OP_R_GE,
+        [OP_R_JZ]    = &&L_OP_R_JZ,
+        [OP_R_JZ_LT] = &&L_OP_R_JZ_LT,
+        [OP_R_JZ_EQ] = &&L_OP_R_JZ_EQ,
+        [OP_R_JZ_NE] = &&L_OP_R_JZ_NE,
+        [OP_R_JZ_GT] = &&L_OP_R_JZ_GT,
+        [OP_R_JZ_LE] = &&L_OP_R_JZ_LE,
+        [OP_R_JZ_GE] = &&L_OP_R_JZ_GE,
+        [OP_R_PRINT] = &&L_OP_R_PRINT,
+        [OP_R_READ]  = &&L_OP_R_READ,
+        [OP_R_EOF]   = &&L_OP_R_EOF,
+        [OP_LOAD_IDX]   = &&L_OP_LOAD_IDX,
+        [OP_STORE_IDX]  = &&L_OP_STORE_IDX,
+        [OP_LOAD_ELEM]  = &&L_OP_LOAD_ELEM,
+        [OP_STORE_ELEM] = &&L_OP_STORE_ELEM,
+        [OP_FILL]    = &&L_OP_FILL,
+        [OP_COPY]    = &&L_OP_COPY,
+        [OP_SUM]     = &&L_OP_SUM,
+        [OP_DOT]     = &&L_OP_DOT,
+        [OP_VADD]    = &&L_OP_VADD,
+        [OP_VMUL]    = &&L_OP_VMUL,
+        [OP_R_MOD]   = &&L_OP_R_MOD,
+        [OP_R_AND]   = &&L_OP_R_AND,
+        [OP_R_OR]    = &&L_OP_R_OR,
+        [OP_R_XOR]   = &&L_OP_R_XOR,
+        [OP_R_SHL]   = &&L_OP_R_SHL,
+        [OP_R_SHR]   = &&L_OP_R_SHR,
+        [OP_R_DIV_POW2] = &&L_OP_R_DIV_POW2,
+        [OP_R_MOD_POW2] = &&L_OP_R_MOD_POW2,
+        [OP_PAIR]       = &&L_OP_PAIR,
+        [OP_LEFT]       = &&L_OP_LEFT,
+        [OP_RIGHT]      = &&L_OP_RIGHT,
+        [OP_SET_LEFT]   = &&L_OP_SET_LEFT,
+        [OP_SET_RIGHT]  = &&L_OP_SET_RIGHT,
+        [OP_NATIVE]     = &&L_OP_NATIVE,
+        [OP_Q_JZ_LT_IMM] = &&L_OP_Q_JZ_LT_IMM,
+        [OP_Q_JZ_EQ_IMM] = &&L_OP_Q_JZ_EQ_IMM,
+        [OP_Q_JZ_NE_IMM] = &&L_OP_Q_JZ_NE_IMM,
+        [OP_Q_JZ_GT_IMM] = &&L_OP_Q_JZ_GT_IMM,
+        [OP_Q_JZ_LE_IMM] = &&L_OP_Q_JZ_LE_IMM,
+        [OP_Q_JZ_GE_IMM] = &&L_OP_Q_JZ_GE_IMM,
+        [OP_Q_ADDI]      = &&L_OP_Q_ADDI,
+        [OP_Q_SUBI]      = &&L_OP_Q_SUBI,
+        [OP_Q_MULI]      = &&L_OP_Q_MULI,
+        [OP_Q_DIVI]      = &&L_OP_Q_DIVI,
+        [OP_Q_LOAD_ADD]  = &&L_OP_Q_LOAD_ADD,
+        [OP_Q_LOAD_SUB]  = &&L_OP_Q_LOAD_SUB,
+        [OP_Q_LOAD_MUL]  = &&L_OP_Q_LOAD_MUL,
+        [OP_Q_LOOP_INC]   = &&L_OP_Q_LOOP_INC,
+        [OP_Q_LOOP_DEC]   = &&L_OP_Q_LOOP_DEC,
+        [OP_Q_LOOP_INC_M] = &&L_OP_Q_LOOP_INC_M,
+        [OP_Q_LOOP_DEC_M] = &&L_OP_Q_LOOP_DEC_M,
+        [OP_HALT]    = &&L_OP_HALT,
+        [OP_END_OF_CODE] = &&L_OP_END_OF_CODE,
+    };
+#pragma GCC diagnostic pop
+#endif
+
+    if (!insns || vm->pc < 0 || vm->pc > vm->code_size || vm->insn_at[vm->pc] < 0) {
+        vm->error = VM_ERROR_CODE_BOUNDS;
+        vm->running = false;
+        return;
+    }
+    ip = insns + vm->insn_at[vm->pc];
+
+#ifdef VM_COMPUTED_GOTO
+    executed++;
+    goto *dispatch_table[(ip++)->opcode];
+#else
+    for (;;) {
+        executed++;
+        switch ((ip++)->opcode) {
+#endif
+
+        TARGET(OP_PUSH) {
+            PUSH(OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_POP) {
+            POP(a);
+            DISPATCH();
+        }
+
+        TARGET(OP_DUP) {
+            PEEK(a);
+            PUSH(a);
+            DISPATCH();
+        }
+
+        TARGET(OP_ADD) BINARY_OP(a + b);
+        TARGET(OP_SUB) BINARY_OP(a - b);
+        TARGET(OP_MUL) BINARY_OP(a * b);
+
+        TARGET(OP_DIV) {
+            POP(b);
+            if (b == 0) VM_FAIL(VM_ERROR_DIVISION_BY_ZERO);
+            POP(a);
+            PUSH(div_int(a, b));
+            DISPATCH();
+        }
+
+        TARGET(OP_MOD) {
+            POP(b);
+            if (b == 0) VM_FAIL(VM_ERROR_DIVISION_BY_ZERO);
+            POP(a);
+            PUSH(mod_int(a, b));
+            DISPATCH();
+        }
+
+        TARGET(OP_AND) BINARY_OP(a & b);
+        TARGET(OP_OR)  BINARY_OP(a | b);
+        TARGET(OP_XOR) BINARY_OP(a ^ b);
+        TARGET(OP_SHL) BINARY_OP((int32_t)((uint32_t)a << (b & 31)));
+        TARGET(OP_SHR) BINARY_OP(a >> (b & 31));
+
+        TARGET(OP_CMP)    BINARY_OP((a < b) ? 1 : 0);
+        TARGET(OP_CMP_EQ) BINARY_OP((a == b) ? 1 : 0);
+        TARGET(OP_CMP_NE) BINARY_OP((a != b) ? 1 : 0);
+        TARGET(OP_CMP_GT) BINARY_OP((a > b) ? 1 : 0);
+        TARGET(OP_CMP_LE) BINARY_OP((a <= b) ? 1 : 0);
+        TARGET(OP_CMP_GE) BINARY_OP((a >= b) ? 1 : 0);
+
+        TARGET(OP_JMP) {
+            if (OPERAND < ip - insns) {
+#if !VM_LOOP_CHECKED && !VM_LOOP_STEP
+                /* Back-edge: count it; quicken the loop body once it is hot */
+                if (ip[-1].operand2 < VM_QUICKEN_THRESHOLD &&
+                    ++ip[-1].operand2 == VM_QUICKEN_THRESHOLD) {
+                    quicken_region(vm, OPERAND, (int)(ip - insns) - 1);
+                }
+#endif
+                JUMP_BACK(OPERAND);
+            } else {
+                JUMP_TO(OPERAND);
+            }
+            DISPATCH();
+        }
+
+        TARGET(OP_JZ) {
+            POP(a);
+            if (a == 0) JUMP_IF(OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_JNZ) {
+            POP(a);
+            if (a != 0) JUMP_IF(OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_STORE) {
+            CHECK_SLOT(OPERAND);
+            POP(a);
+            memory[OPERAND] = a;
+            DISPATCH();
+        }
+
+        TARGET(OP_LOAD) {
+            CHECK_SLOT(OPERAND);
+            PUSH(memory[OPERAND]);
+            DISPATCH();
+        }
+
+        /* Superinstructions */
+        TARGET(OP_INC_SLOT) {
+            CHECK_SLOT(OPERAND);
+            memory[OPERAND] = (int32_t)((uint32_t)memory[OPERAND] + (uint32_t)OPERAND2);
+            DISPATCH();
+        }
+
+        TARGET(OP_PUSH_STORE) {
+            CHECK_SLOT(OPERAND);
+            memory[OPERAND] = OPERAND2;
+            DISPATCH();
+        }
+
+        TARGET(OP_LOAD2_ADD) LOAD2_OP(+);
+        TARGET(OP_LOAD2_SUB) LOAD2_OP(-);
+        TARGET(OP_LOAD2_MUL) LOAD2_OP(*);
+
+        TARGET(OP_DIV_POW2) {
+            PEEK(a);
+            TOP = div_pow2(a, OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_MOD_POW2) {
+            PEEK(a);
+            TOP = mod_pow2(a, OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_JZ_LT) COMPARE_JZ(a < b);
+        TARGET(OP_JZ_EQ) COMPARE_JZ(a == b);
+        TARGET(OP_JZ_NE) COMPARE_JZ(a != b);
+        TARGET(OP_JZ_GT) COMPARE_JZ(a > b);
+        TARGET(OP_JZ_LE) COMPARE_JZ(a <= b);
+        TARGET(OP_JZ_GE) COMPARE_JZ(a >= b);
+
+        /* Register engine */
+        TARGET(OP_R_MOV) {
+            CHECK_SLOT(OPERAND);
+            CHECK_SLOT(OPERAND2);
+            memory[OPERAND] = memory[OPERAND2];
+            DISPATCH();
+        }
+
+        TARGET(OP_R_MOVI) {
+            CHECK_SLOT(OPERAND);
+            memory[OPERAND] = OPERAND2;
+            DISPATCH();
+        }
+
+        TARGET(OP_R_ADD) REG_OP(a + b);
+        TARGET(OP_R_SUB) REG_OP(a - b);
+        TARGET(OP_R_MUL) REG_OP(a * b);
+
+        TARGET(OP_R_DIV) {
+            CHECK_SLOT(OPERAND);
+            CHECK_SLOT(OPERAND2);
+            CHECK_SLOT(OPERAND3);
+            b = memory[OPERAND3];
+            if (b == 0) VM_FAIL(VM_ERROR_DIVISION_BY_ZERO);
+            memory[OPERAND] = div_int(memory[OPERAND2], b);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_LT) REG_OP((a < b) ? 1 : 0);
+        TARGET(OP_R_EQ) REG_OP((a == b) ? 1 : 0);
+        TARGET(OP_R_NE) REG_OP((a != b) ? 1 : 0);
+        TARGET(OP_R_GT) REG_OP((a > b) ? 1 : 0);
+        TARGET(OP_R_LE) REG_OP((a <= b) ? 1 : 0);
+        TARGET(OP_R_GE) REG_OP((a >= b) ? 1 : 0);
+
+        TARGET(OP_R_MOD) {
+            CHECK_SLOT(OPERAND);
+            CHECK_SLOT(OPERAND2);
+            CHECK_SLOT(OPERAND3);
+            b = memory[OPERAND3];
+            if (b == 0) VM_FAIL(VM_ERROR_DIVISION_BY_ZERO);
+            memory[OPERAND] = mod_int(memory[OPERAND2], b);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_AND) REG_OP(a & b);
+        TARGET(OP_R_OR)  REG_OP(a | b);
+        TARGET(OP_R_XOR) REG_OP(a ^ b);
+        TARGET(OP_R_SHL) REG_OP((int32_t)((uint32_t)a << (b & 31)));
+        TARGET(OP_R_SHR) REG_OP(a >> (b & 31));
+
+        TARGET(OP_R_DIV_POW2) {
+            CHECK_SLOT(OPERAND);
+            CHECK_SLOT(OPERAND2);
+            memory[OPERAND] = div_pow2(memory[OPERAND2], OPERAND3);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_MOD_POW2) {
+            CHECK_SLOT(OPERAND);
+            CHECK_SLOT(OPERAND2);
+            memory[OPERAND] = mod_pow2(memory[OPERAND2], OPERAND3);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_JZ) {
+            CHECK_SLOT(OPERAND2);
+            if (memory[OPERAND2] == 0) JUMP_IF(OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_JZ_LT) REG_JZ(a < b);
+        TARGET(OP_R_JZ_EQ) REG_JZ(a == b);
+        TARGET(OP_R_JZ_NE) REG_JZ(a != b);
+        TARGET(OP_R_JZ_GT) REG_JZ(a > b);
+        TARGET(OP_R_JZ_LE) REG_JZ(a <= b);
+        TARGET(OP_R_JZ_GE) REG_JZ(a >= b);
+
+        TARGET(OP_R_PRINT) {
+            CHECK_SLOT(OPERAND);
+            output_int(vm, memory[OPERAND]);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_READ) {
+            CHECK_SLOT(OPERAND);
+            memory[OPERAND] = input_int(vm);
+            DISPATCH();
+        }
+
+        TARGET(OP_R_EOF) {
+            CHECK_SLOT(OPERAND);
+            memory[OPERAND] = input_done(vm);
+            DISPATCH();
+        }
+
+        /* Arrays */
+        TARGET(OP_LOAD_IDX) {
+            CHECK_ARRAY(OPERAND, OPERAND2);
+            POP(a);
+            CHECK_INDEX(a);
+            PUSH(memory[OPERAND + a]);
+            DISPATCH();
+        }
+
+        TARGET(OP_STORE_IDX) {
+            CHECK_ARRAY(OPERAND, OPERAND2);
+            POP(b);
+            POP(a);
+            CHECK_INDEX(a);
+            memory[OPERAND + a] = b;
+            DISPATCH();
+        }
+
+        TARGET(OP_LOAD_ELEM) {
+            CHECK_ARRAY(OPERAND, OPERAND2);
+            CHECK_SLOT(OPERAND3);
+            a = memory[OPERAND3];
+            CHECK_ELEMENT(a);
+            PUSH(memory[OPERAND + a]);
+            DISPATCH();
+        }
+
+        TARGET(OP_STORE_ELEM) {
+            CHECK_ARRAY(OPERAND, OPERAND2);
+            CHECK_SLOT(OPERAND3);
+            a = memory[OPERAND3];
+            CHECK_ELEMENT(a);
+            POP(b);
+            memory[OPERAND + a] = b;
+            DISPATCH();
+        }
+
+        TARGET(OP_FILL) {
+            CHECK_ARRAY(OPERAND, OPERAND2);
+            POP(a);
+            vec_kernels()->fill(memory + OPERAND, a, OPERAND2);
+            DISPATCH();
+        }
+
+        TARGET(OP_COPY) {
+            CHECK_ARRAY(OPERAND, OPERAND3);
+            CHECK_ARRAY(OPERAND2, OPERAND3);
+            vec_kernels()->copy(memory + OPERAND, memory + OPERAND2, OPERAND3);
+            DISPATCH();
+        }
+
+        TARGET(OP_SUM) {
+            CHECK_ARRAY(OPERAND, OPERAND2);
+            PUSH(vec_kernels()->sum(memory + OPERAND, OPERAND2));
+            DISPATCH();
+        }
+
+        TARGET(OP_DOT) {
+            CHECK_ARRAY(OPERAND, OPERAND3);
+            CHECK_ARRAY(OPERAND2, OPERAND3);
+            PUSH(vec_kernels()->dot(memory + OPERAND, memory + OPERAND2, OPERAND3));
+            DISPATCH();
+        }
+
+        TARGET(OP_VADD) {
+            CHECK_ARRAY(OPERAND, OPERAND3);
+            CHECK_ARRAY(OPERAND2, OPERAND3);
+            vec_kernels()->add(memory + OPERAND, memory + OPERAND2, OPERAND3);
+            DISPATCH();
+        }
+
+        TARGET(OP_VMUL) {
+            CHECK_ARRAY(OPERAND, OPERAND3);
+            CHECK_ARRAY(OPERAND2, OPERAND3);
+            vec_kernels()->mul(memory + OPERAND, memory + OPERAND2, OPERAND3);
+            DISPATCH();
+        }
+
+        /* The return stack holds byte offsets so it reads the same in
+           vm_dump_state() as before pre-decoding. */
+        TARGET(OP_CALL) {
+            if (OPERAND == vm->insn_count) VM_FAIL(VM_ERROR_CODE_BOUNDS);
+            if (!return_stack_push(vm, vm->insn_offset[ip - insns])) goto vm_exit;
+            JUMP_BACK(OPERAND);
+            DISPATCH();
+        }
+
+        TARGET(OP_RET) {
+            a = return_stack_pop(vm);
+            CHECK_ERROR();
+            if (a < 0 || a > vm->code_size || vm->insn_at[a] < 0) VM_FAIL(VM_ERROR_CODE_BOUNDS);
+            JUMP_TO(vm->insn_at[a]);
+            DISPATCH();
+        }
+
+        TARGET(OP_ENTER) {
+#if VM_LOOP_CHECKED
+            if (OPERAND < 0 || OPERAND2 < 0) VM_FAIL(VM_ERROR_INVALID_OPCODE);
+            if (sp - stack_base < OPERAND) VM_FAIL(VM_ERROR_STACK_UNDERFLOW);
+#endif
+            SPILL();
+#if !VM_LOOP_CHECKED
+            /* Pushes are unchecked: the verifier bounds every frame by
+               vm->frame_depth, so the whole frame has to fit now */
+            if (vm->frame_depth > vm->stack_size - (sp - OPERAND - stack_base)) {
+                RELOAD();
+                VM_FAIL(VM_ERROR_STACK_OVERFLOW);
+            }
+#endif
+            if (!return_stack_push(vm, (int32_t)(fp - stack_base))) {
+                RELOAD();
+                goto vm_exit;
+            }
+            fp = sp - OPERAND;
+#if VM_LOOP_CHECKED
+            for (a = 0; a < OPERAND2; a++) PUSH(0);
+#else
+            memset(sp, 0, OPERAND2 * sizeof(int32_t));
+            sp += OPERAND2;
+#endif
+            RELOAD();
+            DISPATCH();
+        }
+
+        TARGET(OP_RETURN) {
+            int32_t saved_fp, ret;
+#if VM_LOOP_TOS
+            /* The result stays in tos; it spills to the frame's first slot */
+            a = tos;
+#else
+            POP(a);
+#endif
+            saved_fp = return_stack_pop(vm);
+            ret = return_stack_pop(vm);
+            CHECK_ERROR();
+            if (saved_fp < 0 || saved_fp > fp - stack_base ||
+                ret < 0 || ret > vm->code_size || vm->insn_at[ret] < 0) {
+                VM_FAIL(VM_ERROR_CODE_BOUNDS);
+            }
+            sp = fp;
+            fp = stack_base + saved_fp;
+#if VM_LOOP_TOS
+            tos = a;
+#else
+            PUSH(a);
+#endif
+            JUMP_TO(vm->insn_at[ret]);
+            DISPATCH();
+        }
+
+        /* A tail call reuses the frame, so fp and the return stack stay
+           as they are; the callee's ENTER is skipped */
+        TARGET(OP_TAIL) {
+            const VMInstr *callee = insns + OPERAND;
+#if VM_LOOP_CHECKED
+            if (callee->opcode != OP_ENTER) VM_FAIL(VM_ERROR_CODE_BOUNDS);
+            if (callee->operand < 0 || callee->operand2 < 0) VM_FAIL(VM_ERROR_INVALID_OPCODE);
+            if (sp - fp < callee->operand) VM_FAIL(VM_ERROR_STACK_UNDERFLOW);
+#endif
+            SPILL();
+            memmove(fp, sp - callee->operand, callee->operand * sizeof(int32_t));
+            sp = fp + callee->operand;
+#if VM_LOOP_CHECKED
+            for (a = 0; a < callee->operand2; a++) PUSH(0);
+#else
+            memset(sp, 0, callee->operand2 * sizeof(int32_t));
+            sp += callee->operand2;
+#endif
+            RELOAD();
+            JUMP_BACK(OPERAND + 1);
+            DISPATCH();
+        }
+
+        TARGET(OP_LOAD_LOCAL) {
+            CHECK_LOCAL(OPERAND);
+            PUSH(LOCAL_GET(OPERAND));
+            DISPATCH();
+        }
+
+        TARGET(OP_STORE_LOCAL) {
+            POP(a);
+            CHECK_LOCAL(OPERAND);
+            LOCAL_SET(OPERAND, a);
+            DISPATCH();
+        }
+
+        /* Counted loops */
+        TARGET(OP_LOOP_INC) LOOP_OP(1, a < b, OPERAND3, QUICKEN_LOOP());
+        TARGET(OP_LOOP_DEC) LOOP_OP(-1, a > b, OPERAND3, QUICKEN_LOOP());
+        TARGET(OP_LOOP_INC_M) { CHECK_SLOT(OPERAND3); LOOP_OP(1, a < b, memory[OPERAND3], QUICKEN_LOOP()); }
+        TARGET(OP_LOOP_DEC_M) { CHECK_SLOT(OPERAND3); LOOP_OP(-1, a > b, memory[OPERAND3], QUICKEN_LOOP()); }
+
+        TARGET(OP_PAIR) {
+            Object *obj;
+            POP(b);
+            POP(a);
+            SYNC_STACK();
+            obj = new_pair(vm, a, b);
+            if (!obj) VM_FAIL(VM_ERROR_HEAP_FULL);
+            PUSH(GC_REF(obj));
+            DISPATCH();
+        }
+
+        TARGET(OP_LEFT) {
+            Object *obj;
+            PEEK(a);
+            PAIR_OF(obj, a);
+            TOP = obj->pair.left;
+            DISPATCH();
+        }
+
+        TARGET(OP_RIGHT) {
+            Object *obj;
+            PEEK(a);
+            PAIR_OF(obj, a);
+            TOP = obj->pair.right;
+            DISPATCH();
+        }
+
+        TARGET(OP_SET_LEFT) {
+            Object *obj;
+            POP(b);
+            POP(a);
+            PAIR_OF(obj, a);
+            obj->pair.left = b;
+            DISPATCH();
+        }
+
+        TARGET(OP_SET_RIGHT) {
+            Object *obj;
+            POP(b);
+            POP(a);
+            PAIR_OF(obj, a);
+            obj->pair.right = b;
+            DISPATCH();
+        }
+
+        /* The native reads its arguments where they are; with the top
+           cached, SPILL() puts the last one in place first */
+        TARGET(OP_NATIVE) {
+#if VM_LOOP_CHECKED
+            if (OPERAND < 0 || OPERAND >= vm->native_count ||
+                vm->natives[OPERAND].arity != OPERAND2) {
+                VM_FAIL(VM_ERROR_BAD_NATIVE);
+            }
+            if (sp - stack_base < OPERAND2) VM_FAIL(VM_ERROR_STACK_UNDERFLOW);
+#endif
+            SPILL();
+            vm->sp = (int)(sp - stack_base);
+            a = vm_call_native(vm, OPERAND, sp - OPERAND2);
+            sp -= OPERAND2;
+#if VM_LOOP_TOS
+            tos = a;
+#else
+            PUSH(a);
+#endif
+            DISPATCH();
+        }
+
+        TARGET(OP_PRINT) {
+            POP(a);
+            output_int(vm, a);
+            DISPATCH();
+        }
+
+        TARGET(OP_READ) {
+            PUSH(input_int(vm));
+            DISPATCH();
+        }
+
+        TARGET(OP_EOF) {
+            PUSH(input_done(vm));
+            DISPATCH();
+        }
+
+        /* Quickened forms (written only by quicken_region()) */
+        TARGET(OP_Q_JZ_LT_IMM) Q_SLOT_IMM_JZ(a < b);
+        TARGET(OP_Q_JZ_EQ_IMM) Q_SLOT_IMM_JZ(a == b);
+        TARGET(OP_Q_JZ_NE_IMM) Q_SLOT_IMM_JZ(a != b);
+        TARGET(OP_Q_JZ_GT_IMM) Q_SLOT_IMM_JZ(a > b);
+        TARGET(OP_Q_JZ_LE_IMM) Q_SLOT_IMM_JZ(a <= b);
+        TARGET(OP_Q_JZ_GE_IMM) Q_SLOT_IMM_JZ(a >= b);
+        TARGET(OP_Q_ADDI) Q_TOP_OP(a + OPERAND);
+        TARGET(OP_Q_SUBI) Q_TOP_OP(a - OPERAND);
+        TARGET(OP_Q_MULI) Q_TOP_OP(a * OPERAND);
+        TARGET(OP_Q_DIVI) Q_TOP_OP(div_int(a, OPERAND));
+        TARGET(OP_Q_LOAD_ADD) { CHECK_SLOT(OPERAND); Q_TOP_OP(a + memory[OPERAND]); }
+        TARGET(OP_Q_LOAD_SUB) { CHECK_SLOT(OPERAND); Q_TOP_OP(a - memory[OPERAND]); }
+        TARGET(OP_Q_LOAD_MUL) { CHECK_SLOT(OPERAND); Q_TOP_OP(a * memory[OPERAND]); }
+        TARGET(OP_Q_LOOP_INC) LOOP_OP(1, a < b, OPERAND3, (void)0);
+        TARGET(OP_Q_LOOP_DEC) LOOP_OP(-1, a > b, OPERAND3, (void)0);
+        TARGET(OP_Q_LOOP_INC_M) LOOP_OP(1, a < b, memory[OPERAND3], (void)0);
+        TARGET(OP_Q_LOOP_DEC_M) LOOP_OP(-1, a > b, memory[OPERAND3], (void)0);
+
+        TARGET(OP_HALT) {
+            goto vm_exit;
+        }
+
+        /* Sentinel after the last record; also the target of bad jumps */
+        TARGET(OP_END_OF_CODE) {
+            ip--;
+            VM_FAIL(VM_ERROR_CODE_BOUNDS);
+        }
+
+#ifdef VM_COMPUTED_GOTO
+    L_invalid:
+        VM_FAIL(VM_ERROR_INVALID_OPCODE);
+#else
+        default:
+            VM_FAIL(VM_ERROR_INVALID_OPCODE);
+        }
+    vm_next:
+#if VM_LOOP_STEP
+        goto vm_yield;
+#else
+        continue;
+#endif
+    }
+#endif
+
+#if VM_LOOP_STEP
+vm_yield:
+    vm->pc = vm->insn_offset[ip - insns];
+    vm->sp = (int)(sp - stack_base);
+    vm->fp = (int)(fp - stack_base);
+    vm->instr_count += executed;
+    return;
+#endif
+
+#if VM_LOOP_BUDGET
+/* Out of budget: save the state and leave vm->running set */
+vm_pause:
+    vm->pc = vm->insn_offset[ip - insns];
+    vm->fp = (int)(fp - stack_base);
+#if VM_LOOP_TOS
+    *sp = tos;
+    vm->sp = (int)(sp - stack_base) + 1;
+#else
+    vm->sp = (int)(sp - stack_base);
+#endif
+    vm->instr_count += executed + budget;
+    return;
+#endif
+
+vm_exit:
+    vm->pc = vm->insn_offset[ip - insns];
+    vm->fp = (int)(fp - stack_base);
+#if VM_LOOP_TOS
+    *sp = tos;
+    vm->sp = (int)(sp - stack_base) + 1;
+#else
+    vm->sp = (int)(sp - stack_base);
+#endif
+#if VM_LOOP_BUDGET
+    executed += budget;
+#endif
+    vm->instr_count += executed;
+    vm->running = false;
+}
+
+#undef TARGET
+#undef DISPATCH
+#undef VM_FAIL
+#undef CHECK_ERROR
+#undef OPERAND
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef CHECK_SLOT
+#undef CHECK_ARRAY
+#undef CHECK_INDEX
+#undef CHECK_ELEMENT
+#undef BINARY_OP
+#undef JUMP_TO
+#undef JUMP_BACK
+#undef JUMP_IF
+#undef COMPARE_JZ
+#undef LOAD2_OP
+#undef OPERAND2
+#undef OPERAND3
+#undef REG_OP
+#undef REG_JZ
+#undef TOP
+#undef Q_SLOT_IMM_JZ
+#undef Q_TOP_OP
+#undef LOOP_OP
+#undef QUICKEN_LOOP
+#undef LOCAL_GET
+#undef LOCAL_SET
+#undef SPILL
+#undef RELOAD
+#undef CHECK_LOCAL
+#undef SYNC_STACK
+#undef PAIR_OF
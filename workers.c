@@ -0,0 +1,224 @@
+/*
+ * workers.c - Work-stealing thread pool (see workers.h)
+ *
+ * Deques are guarded by a mutex each. Tasks are whole programs, so a
+ * worker touches a deque once per program (and once per requeue) and the
+ * locks are never contended for long. The pool lock guards the parked
+ * tasks, the count of unfinished ones and the wake generation; it is
+ * taken before a deque lock, never after.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "workers.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    void **items;
+    int top;        /* next task to steal */
+    int bottom;     /* one past the owner's next task */
+} Deque;
+
+typedef struct {
+    WorkerPool *pool;
+    int id;
+    pthread_t thread;
+} Worker;
+
+struct WorkerPool {
+    Worker *workers;
+    Deque *deques;
+    int count;      /* workers and deques */
+    int started;    /* threads actually running */
+    WorkerFn fn;
+    void *arg;
+    atomic_bool stopped;
+    atomic_int steals;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* work is back, all done, or stopped */
+    void **parked;          /* tasks that could not go on */
+    int parked_count;
+    int pending;            /* tasks not finished yet */
+    unsigned long generation;   /* workers_wake() calls so far */
+};
+
+static void *deque_pop(Deque *d) {
+    void *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) task = d->items[--d->bottom];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static void *deque_steal(Deque *d) {
+    void *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) task = d->items[d->top++];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+/* Requeue behind the rest; the deque holds room for every task */
+static void deque_push_top(Deque *d, void *task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->top == 0) {
+        memmove(d->items + 1, d->items, d->bottom * sizeof(void *));
+        d->bottom++;
+    } else {
+        d->top--;
+    }
+    d->items[d->top] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Own deque first, then the others starting with the next worker */
+static void *next_task(WorkerPool *wp, int id) {
+    void *task = deque_pop(&wp->deques[id]);
+    for (int i = 1; !task && i < wp->count; i++) {
+        task = deque_steal(&wp->deques[(id + i) % wp->count]);
+        if (task) atomic_fetch_add(&wp->steals, 1);
+    }
+    return task;
+}
+
+/*
+ * A task that cannot go on is parked, unless workers_wake() ran while it
+ * was being tried: then whatever it waited for may already have happened,
+ * so it goes straight back on the deque. Likewise a worker that found no
+ * task only sleeps if nothing was woken since it looked.
+ */
+static void *worker_main(void *p) {
+    Worker *w = p;
+    WorkerPool *wp = w->pool;
+    while (!atomic_load(&wp->stopped)) {
+        pthread_mutex_lock(&wp->lock);
+        unsigned long seen = wp->generation;
+        pthread_mutex_unlock(&wp->lock);
+
+        void *task = next_task(wp, w->id);
+        if (task) {
+            bool finished = wp->fn(task, wp->arg);
+            pthread_mutex_lock(&wp->lock);
+            if (finished) {
+                if (--wp->pending == 0) pthread_cond_broadcast(&wp->wake);
+            } else if (!atomic_load(&wp->stopped)) {
+                if (wp->generation != seen) deque_push_top(&wp->deques[w->id], task);
+                else wp->parked[wp->parked_count++] = task;
+            }
+            pthread_mutex_unlock(&wp->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&wp->lock);
+        while (!atomic_load(&wp->stopped) && wp->pending > 0 && wp->generation == seen) {
+            pthread_cond_wait(&wp->wake, &wp->lock);
+        }
+        bool done = wp->pending == 0;
+        pthread_mutex_unlock(&wp->lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+int workers_default_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+WorkerPool *workers_start(int nthreads, void **tasks, int ntasks,
+                          WorkerFn fn, void *arg) {
+    if (nthreads > ntasks) nthreads = ntasks;
+    if (nthreads < 1) nthreads = 1;
+
+    WorkerPool *wp = calloc(1, sizeof(WorkerPool));
+    if (!wp) return NULL;
+    wp->workers = calloc(nthreads, sizeof(Worker));
+    wp->deques = calloc(nthreads, sizeof(Deque));
+    wp->parked = malloc(ntasks * sizeof(void *));
+    if (!wp->workers || !wp->deques || !wp->parked) goto fail;
+    wp->count = nthreads;
+    wp->fn = fn;
+    wp->arg = arg;
+    wp->pending = ntasks;
+    atomic_init(&wp->stopped, false);
+    atomic_init(&wp->steals, 0);
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->wake, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        Deque *d = &wp->deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->items = malloc(ntasks * sizeof(void *));
+        if (!d->items) goto fail;
+    }
+    for (int i = 0; i < ntasks; i++) {
+        Deque *d = &wp->deques[i % nthreads];
+        d->items[d->bottom++] = tasks[i];
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        wp->workers[i].pool = wp;
+        wp->workers[i].id = i;
+        if (pthread_create(&wp->workers[i].thread, NULL, worker_main,
+                           &wp->workers[i]) != 0) {
+            break;  /* the threads that did start steal the rest */
+        }
+        wp->started++;
+    }
+    if (wp->started == 0) goto fail;
+    return wp;
+
+fail:
+    if (wp->deques) {
+        for (int i = 0; i < nthreads; i++) free(wp->deques[i].items);
+    }
+    free(wp->deques);
+    free(wp->workers);
+    free(wp->parked);
+    free(wp);
+    return NULL;
+}
+
+/* Put the parked tasks back, dealt round-robin, and wake the workers */
+void workers_wake(WorkerPool *wp) {
+    pthread_mutex_lock(&wp->lock);
+    for (int i = 0; i < wp->parked_count; i++) {
+        deque_push_top(&wp->deques[i % wp->count], wp->parked[i]);
+    }
+    wp->parked_count = 0;
+    wp->generation++;
+    pthread_cond_broadcast(&wp->wake);
+    pthread_mutex_unlock(&wp->lock);
+}
+
+/* Workers finish the task they are running and take no new ones */
+void workers_stop(WorkerPool *wp) {
+    pthread_mutex_lock(&wp->lock);
+    atomic_store(&wp->stopped, true);
+    pthread_cond_broadcast(&wp->wake);
+    pthread_mutex_unlock(&wp->lock);
+}
+
+/* Wait for every worker and free the pool; returns how many tasks were
+   stolen from another worker's deque */
+int workers_join(WorkerPool *wp) {
+    for (int i = 0; i < wp->started; i++) {
+        pthread_join(wp->workers[i].thread, NULL);
+    }
+    int steals = atomic_load(&wp->steals);
+    for (int i = 0; i < wp->count; i++) {
+        pthread_mutex_destroy(&wp->deques[i].lock);
+        free(wp->deques[i].items);
+    }
+    pthread_cond_destroy(&wp->wake);
+    pthread_mutex_destroy(&wp->lock);
+    free(wp->deques);
+    free(wp->workers);
+    free(wp->parked);
+    free(wp);
+    return steals;
+}
@@ -0,0 +1,30 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdbool.h>
+
+/*
+ * Work-stealing thread pool. Tasks are dealt round-robin onto one deque
+ * per worker; a worker takes from the bottom of its own deque and, once
+ * that is empty, steals from the top of the others. A worker that finds
+ * every deque empty sleeps until there is work again, and exits once
+ * every task has finished or the pool is stopped.
+ *
+ * The task function runs on a worker thread and must only touch state
+ * that belongs to its task (a VM, for the program manager). It returns
+ * false if the task cannot go on for now (its output has nowhere to go);
+ * the task is then parked until the owner calls workers_wake(), which
+ * puts every parked task back on the deques.
+ */
+typedef struct WorkerPool WorkerPool;
+
+typedef bool (*WorkerFn)(void *task, void *arg);
+
+int workers_default_count(void);
+WorkerPool *workers_start(int nthreads, void **tasks, int ntasks,
+                          WorkerFn fn, void *arg);
+void workers_wake(WorkerPool *wp);
+void workers_stop(WorkerPool *wp);
+int workers_join(WorkerPool *wp);
+
+#endif